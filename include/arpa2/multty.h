@@ -16,6 +16,7 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <time.h>
 #include <limits.h>
 #include <unistd.h>
 #include <sys/uio.h>
@@ -124,6 +125,59 @@
 #define MULTTY_ESC_MIXED  ((uint32_t) ( (1<<0) | MULTTY_ESC_ASCII ))
 
 
+/* An escape table holds the outcome of mtyescapewish() for
+ * each of the 256 byte values under one escape style.  This
+ * replaces the folding and shifting per byte with one lookup.
+ */
+typedef bool MULTTY_ESCTABLE [256];
+
+
+/* Units of mulTTY output are sent atomically.  For pipes, this
+ * limits them to PIPE_BUF, but larger units are safe for some
+ * outputs.  The ATOMIC_SEND_MAX and ATOMIC_RECV_MIN are set or
+ * detected per output and input, but never beyond this limit.
+ */
+#define MULTTY_ATOMIC_MAX 65536
+
+
+/* Buffers are attached to handles while output is pending, and
+ * otherwise kept in pools, one per buffer size.  This is the
+ * default number of idle buffers that a pool keeps for reuse.
+ */
+#define MULTTY_POOL_IDLE 8
+
+
+/* The default limit to the <SOH> name prefix on input, including
+ * any <US> and description.  Longer names are dropped, so a peer
+ * cannot keep the parser waiting for the end of a name.
+ */
+#define MULTTY_INNAME_MAX 256
+
+
+/* The number of input units that are collected into one batch
+ * for a callback of type mtycb_batch.
+ */
+#define MULTTY_INUNITS 64
+
+
+/* The largest number of worker threads for one inflow, see
+ * mtyinflow_workers().
+ */
+#define MULTTY_WORKERS_MAX 64
+
+
+/* The default high-water mark for the queue of a stream that
+ * is read with mtyread(), see mtyregister_queue().
+ */
+#define MULTTY_INQUEUE_HIGH 65536
+
+
+/* The default number of bytes that a reactor reads from one
+ * inflow in one round, before it serves the other inflows.
+ */
+#define MULTTY_REACTOR_BUDGET 65536
+
+
 /* Programs are identified with a standard structure
  * holding an id name of up to 32 chars and optionally
  * a <US> appended to indicate the use of a description.
@@ -139,17 +193,51 @@ typedef struct multty_progset MULTTY_PROGSET;
 typedef struct multty_prog    MULTTY_PROG   ;
 
 
-/* The handle structure, with builtin buffer and stream name,
- * for for a MULTTY stream.
+/* The output flow structure, to which multiplexed traffic
+ * is sent from programs and/or streams.  It is opaque, and
+ * it holds the file descriptor, ATOMIC_SEND_MAX, the program
+ * set and the default stream for one mulTTY connection.
+ */
+typedef struct multty_outflow MULTTY_OUTFLOW;
+
+
+/* The handle structure, with buffer and stream name, for
+ * for a MULTTY stream.  The buffer starts with the stream
+ * shift and holds up to bufsize bytes.  When bufpool is set,
+ * the buffer was taken from a pool when output was written,
+ * and it returns there after a flush.  Without a buffer, the
+ * shift is found in prefix, and fill equals shift.  Once the
+ * handle is aliased, the prefix is <SOH>#N<SO> for its alias
+ * and the <SOH>name<SO> form is kept in fullprefix.
+ *
+ * The vbufmode is set with mtysetvbuf(), and buffered handles
+ * are listed to send their output at exit.  Buffered output that
+ * waits for a deadline lists the handle with its outflow, until
+ * it is due.
+ *
+ * Each handle is bound to one outflow; NULL stands for the
+ * default MULTTY_OUTFLOW_STDOUT.
  */
 struct multty {
 	struct multty *next;
 	MULTTY_PROG *prog;
+	MULTTY_OUTFLOW *flow;
 	int shift;
 	int fill;
 	int rdofs;
-	uint8_t buf [PIPE_BUF];
+	int bufsize;
+	uint8_t *buf;
+	uint8_t *prefix;
+	bool bufpool;
 	bool got_dle;
+	bool aliased;
+	uint8_t *fullprefix;
+	int vbufmode;
+	unsigned deadline_usec;
+	bool duelisted;
+	struct timespec due;
+	struct multty *nextdue;
+	struct multty *nextvbuf;
 };
 typedef struct multty MULTTY;
 
@@ -161,6 +249,19 @@ typedef struct multty MULTTY;
 typedef struct multty_inflow MULTTY_INFLOW;
 
 
+/* A program in the input of an inflow, as selected with the
+ * <DC1> through <DC4> codes.  It has its own streams, and it
+ * may be the parent of further programs.  It is opaque, see
+ * mtyregister_programs().
+ */
+typedef struct multty_inprog MULTTY_INPROG;
+
+
+/* A reactor serves many inflows from one thread, using epoll.  It is opaque, see mtyreactor().
+ */
+typedef struct multty_reactor MULTTY_REACTOR;
+
+
 /* Standard pre-opened handles for "stdin", "stdout", "stderr".
  * Stored in global variables that may be included.
  */
@@ -172,6 +273,24 @@ extern struct multty multty_stderr;
 #define MULTTY_STDERR (&multty_stderr)
 
 
+/* Usage of a pool, as reported by mtypool_usage().  The size
+ * is that of a handle or buffer in the pool.  Busy items are
+ * in use, idle items are kept for reuse.
+ */
+struct multty_poolusage {
+	int size;
+	unsigned busy;
+	unsigned idle;
+};
+
+
+/* Standard outflow to stdout, to which the standard handles
+ * and those not explicitly bound elsewhere send their output.
+ */
+extern struct multty_outflow multty_outflow_stdout;
+#define MULTTY_OUTFLOW_STDOUT (&multty_outflow_stdout)
+
+
 /* We can have a global variable with the default program set.
  * It will be instantiated when it referenced, anywhere.
  * Functions call for a pointer, hence MULTTY_PROGRAMS.
@@ -258,6 +377,30 @@ bool mtyescapewish (uint32_t style, uint8_t ch);
 bool mtyescapefree (uint32_t style, const uint8_t *ptr, int len);
 
 
+/* Find the escape table for a given style.  Tables exist for
+ * the built-in styles MULTTY_ESC_MULTTY, MULTTY_ESC_BINARY,
+ * MULTTY_ESC_ASCII and MULTTY_ESC_MIXED and for any style
+ * that was setup with mtyescape_register().
+ *
+ * The table holds the outcome of mtyescapewish() for each
+ * byte value, so a lookup replaces a call.
+ *
+ * Returns the table on success, or else NULL/errno=ENOENT.
+ */
+const bool *mtyescape_table (uint32_t style);
+
+
+/* Register a custom escape style, so it will have a table
+ * for quick lookups.  This is harmless to do for built-in
+ * styles or styles that were already registered.  Escaping
+ * routines register styles on first use, so doing it up
+ * front only moves the work to a convenient moment.
+ *
+ * Returns the table on success, or else NULL/errno.
+ */
+const bool *mtyescape_register (uint32_t style);
+
+
 /* Escape a string and move it into the indicated MULTTY buffer.
  * The escaping style is provided as a parameter.
  *
@@ -279,7 +422,8 @@ size_t mtyescape (uint32_t style, MULTTY *mty, const uint8_t *ptr, size_t len);
  * even in a multi-threading program.
  *
  * The buffer is assumed to already be escaped inasfar as
- * necessary.
+ * necessary.  A buffer taken from the pool is returned after
+ * sending.
  *
  * Drop-in replacement for fflush() with FILE changed to MULTTY.
  * Returns 0 on success, else EOF+errno.
@@ -287,6 +431,36 @@ size_t mtyescape (uint32_t style, MULTTY *mty, const uint8_t *ptr, size_t len);
 int mtyflush (MULTTY *mty);
 
 
+/* Set the buffering mode of a MULTTY handle to _IONBF, _IOLBF or
+ * _IOFBF.  Unbuffered output, the default, is sent right away.
+ * Fully buffered output is collected until it fills a unit of
+ * ATOMIC_SEND_MAX, and line buffered output is sent up to the
+ * last <LF> of every call that writes one.  Buffered output is
+ * sent on mtyflush() and mtyclose(), and when the program exits
+ * normally.  See mtysetdeadline() to send it after a given time.
+ *
+ * Buffers come from a pool, so buf must be NULL and the size is
+ * ignored.  Setting _IONBF sends any pending output.
+ *
+ * Drop-in replacement for setvbuf() with FILE changed to MULTTY.
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtysetvbuf (MULTTY *mty, char *buf, int mode, size_t size);
+
+
+/* Set a deadline for the buffered output of a MULTTY handle, so
+ * output that is pending is sent deadline_usec microseconds after
+ * it was first written.  The value 0 removes the deadline.
+ *
+ * Deadlines are met by mtyoutflow_flushdue(), which is called by
+ * the application when the timer from mtyoutflow_timerfd()
+ * expires.
+ * Handles with a deadline should be written from the thread that
+ * makes this call.
+ */
+void mtysetdeadline (MULTTY *mty, unsigned deadline_usec);
+
+
 /* Open an MULTTY buffer for input ("r") or output ("w")
  * and using the given stream name.  TODO: Currently the
  * mode "r" / "w" is not used.  TODO: Output is always
@@ -352,6 +526,61 @@ inline int mtyputs (const char *s, MULTTY *mty) {
 ssize_t mtywrite (MULTTY *mty, const void *buf, size_t count);
 
 
+/* Send binary data from an iovec array to the given mulTTY stream,
+ * without copying it into the MULTTY buffer.  Clean runs are
+ * sent straight from the caller's memory, and bytes that need
+ * escaping are sent as <DLE> pairs from a static table.  The
+ * atomic units sent are limited to ATOMIC_SEND_MAX, and each
+ * returns to the default stream.
+ *
+ * Drop-in replacement for writev() with FD changed to MULTTY*.
+ * Returns buf-bytes written on success, else -1&errno
+ */
+ssize_t mtywritev (MULTTY *mty, const struct iovec *iov, int iovcnt);
+
+
+/* Open an outflow for a given file descriptor, to send
+ * a separate mulTTY connection than MULTTY_OUTFLOW_STDOUT.
+ * The outflow has its own ATOMIC_SEND_MAX, detected from
+ * the file descriptor, and its own settings for exclusive
+ * output and coalescing.  It also has its own handle for
+ * the default stream, see mtyoutflow_stdout().
+ *
+ * The file descriptor remains owned by the caller, but it
+ * is closed when output is found to be inconsistent.
+ *
+ * Returns non-NULL pointer or NULL/errno.
+ */
+MULTTY_OUTFLOW *mtyoutflow (int outfd);
+
+
+/* Close an outflow, after sending any output that it holds.
+ * Handles that are bound to it should be closed first.  The
+ * file descriptor is not closed.  Closing the standard outflow
+ * only sends what it holds.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_close (MULTTY_OUTFLOW *flow);
+
+
+/* Return the handle for the default stream of an outflow.
+ * This is MULTTY_STDOUT for MULTTY_OUTFLOW_STDOUT.  Output
+ * to the default stream needs no stream shifting.
+ */
+MULTTY *mtyoutflow_stdout (MULTTY_OUTFLOW *flow);
+
+
+/* Bind a MULTTY handle to an outflow, so its output will be
+ * sent there.  Any buffered output is first sent to the
+ * outflow that the handle was bound to before.  An alias
+ * for the stream is not taken along.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_bind (MULTTY *mty, MULTTY_OUTFLOW *flow);
+
+
 /* Open an inflow for a given file descriptor.
  *
  * Returns non-NULL pointer or NULL/errno.
@@ -359,6 +588,59 @@ ssize_t mtywrite (MULTTY *mty, const void *buf, size_t count);
 MULTTY_INFLOW *mtyinflow (int infd);
 
 
+/* Close an inflow, and free the streams and programs that it
+ * holds.  The file descriptor is not closed.
+ */
+void mtyinflow_close (MULTTY_INFLOW *flow);
+
+
+/* Set the ATOMIC_RECV_MIN for an inflow, which is the buffer
+ * size needed to hold the largest atomic unit that senders may
+ * write.  Use 0 to detect it from the type of the input, which
+ * is also done by mtyinflow().  The value must lie between
+ * _POSIX_PIPE_BUF and MULTTY_ATOMIC_MAX, and it is rounded up
+ * to a power of two.  Datagram and sequential packet sockets
+ * get twice the size, so a whole packet fits behind a partial
+ * unit.  The buffer cannot shrink below the data it holds,
+ * which fails with EBUSY.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyinflow_atomic (MULTTY_INFLOW *flow, int recv_min);
+
+
+/* Set the longest <SOH> name prefix that an inflow accepts,
+ * including any <US> and description.  Use 0 for the default,
+ * MULTTY_INNAME_MAX.  A longer name is reported and dropped,
+ * and so is a name that fills the input buffer.  The control
+ * code after a dropped name is dropped too, and so is the text
+ * that follows, up to a nameless shift or <EM>.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyinflow_namemax (MULTTY_INFLOW *flow, int namemax);
+
+
+/* Run the callbacks for the streams of an inflow on a number of
+ * worker threads, so they may use more than one core.  The input
+ * is still read and parsed by the calling thread, and then passed
+ * over to the worker for its stream.  The input for one stream
+ * always goes to the same worker, so it arrives in order, but the
+ * callbacks for different streams may run at the same time.  When
+ * a stream has an escape style, its worker does the unescaping.
+ *
+ * Batched dispatch and queued streams are not passed to workers.
+ * Registrations should not change while workers run.  Use 0 to
+ * stop the workers, after they did the work passed to them, which
+ * also happens when the inflow is closed.  Any other value first
+ * stops the current workers.  At most MULTTY_WORKERS_MAX workers
+ * can be started.
+ *
+ * Returns the number of workers on success, or else -1/errno.
+ */
+int mtyinflow_workers (MULTTY_INFLOW *flow, int numworkers);
+
+
 
 /********** FUNCTIONS FOR STREAM READER DISPATCH **********/
 
@@ -376,6 +658,8 @@ MULTTY_INFLOW *mtyinflow (int infd);
  * that was read only partially, as that may be the
  * result of stream switching or program multiplexing
  * and the other traffic also needs to get through.
+ * Streams that need to defer can be read with mtyread()
+ * instead, see mtyregister_queue().
  *
  * Note that dangling <DLE> characters are cared for
  * in the unescape routines, but your application
@@ -396,12 +680,53 @@ MULTTY_INFLOW *mtyinflow (int infd);
  * which is initially set as though <SO> was issued.
  *
  * Callbacks are registered with a MULTTY, together with
- * a userdata pointer reproduced here.
+ * a userdata pointer reproduced here.  For an inflow, the
+ * MULTTY handle belongs to the stream and holds the input
+ * for mtyunescape() during the callback, pointing into the
+ * buffer of the inflow.  A dangling <DLE> at its end is
+ * completed on the next callback for the stream.
  */
 typedef void mtycb_ready (MULTTY *mty, void *userdata,
 		char *name, int namelen, uint8_t control);
 
 
+/* A unit of input for batched dispatch, see mtycb_batch().
+ * The data is still escaped, and points into the buffer of
+ * the inflow.  Input that wraps around the end of that buffer
+ * is delivered as two units for the same stream, so a <DLE>
+ * at the end of a unit escapes the first byte of the next.
+ *
+ * The stream is the name under which it was registered, or
+ * NULL for the default stream.  The name, namelen and control
+ * are as for mtycb_ready().
+ */
+struct multty_inunit {
+	const char *stream;
+	void *userdata;
+	const uint8_t *ptr;
+	int len;
+	const char *name;
+	int namelen;
+	uint8_t control;
+};
+typedef struct multty_inunit MULTTY_INUNIT;
+
+
+/* When input is dispatched in batches, a callback receives an
+ * array of units after each read, rather than one callback per
+ * unit.  The units point into the buffer of the inflow, without
+ * copying, and they are valid until the next dispatch for the
+ * inflow.  The userdata in each unit is the one registered for
+ * its stream, the userdata parameter is the one registered with
+ * the batch callback.
+ *
+ * A batch holds up to MULTTY_INUNITS units, and more batches
+ * follow when a read brings in more.
+ */
+typedef void mtycb_batch (MULTTY_INFLOW *flow, void *userdata,
+		const MULTTY_INUNIT *units, int numunits);
+
+
 /* Register a callback function with arbitrary userdata
  * pointer, to be invoked when data arrives for the
  * named stream at the given inflow.
@@ -428,6 +753,199 @@ bool mtyregister_ready (MULTTY_INFLOW *flow, char *stream,
 			mtycb_ready *rdy, void *userdata);
 
 
+/* Register a callback function for a named stream of a program
+ * in an inflow, like mtyregister_ready() does for input that is
+ * not for a program.  Each program has its own streams.  The
+ * program must not have ended.
+ *
+ * Return true on success, else false/errno
+ */
+bool mtyregister_progready (MULTTY_INFLOW *flow, MULTTY_INPROG *prog, char *stream,
+			mtycb_ready *rdy, void *userdata);
+
+
+/* Callback for programs in the input of an inflow.  It is called
+ * when a program is first named, which is a good moment to use
+ * mtyregister_progready() on it, and when it ends.
+ *
+ * A program ends after <DC2> removes it, which is followed by an
+ * <EM> whose optional <SOH> name is passed as opt_reason.  Its
+ * children end with it, before it.  The program is freed after
+ * this call with ended set.
+ */
+typedef void mtycb_inprog (MULTTY_INFLOW *flow, void *userdata,
+		MULTTY_INPROG *prog, bool ended, const char *opt_reason);
+
+
+/* Register a callback function for programs that start and end
+ * in the input of an inflow, or NULL to stop it.
+ */
+void mtyregister_programs (MULTTY_INFLOW *flow,
+			mtycb_inprog *cb, void *userdata);
+
+
+/* Return the program that input of an inflow is currently for,
+ * or NULL when it is not for a program.  This can be used from
+ * a stream callback, but not with mtyinflow_workers().
+ */
+MULTTY_INPROG *mtyinflow_program (MULTTY_INFLOW *flow);
+
+
+/* Set whether an inflow accepts aliases for the names of streams
+ * and programs, see mtyoutflow_aliases().  While it does, a name
+ * "#N=name" binds alias number N to the name, and a later name
+ * "#N" stands for it.  Streams have aliases per program.  Stream
+ * aliases are forgotten when the stream ends with <EM>, and the
+ * aliases of programs when they are removed with <DC2>.
+ *
+ * Both sides must agree before aliases are used, for instance
+ * over the stdctl stream.  Names of streams and programs that
+ * start with '#' cannot be used while aliases are accepted.
+ */
+void mtyinflow_aliases (MULTTY_INFLOW *flow, bool aliases);
+
+
+/* Return the name of a program.  It ends in <US> when it was
+ * given with a description.
+ */
+const char *mtyinprog_name (MULTTY_INPROG *prog);
+
+
+/* Return the last description given for a program, or NULL.
+ */
+const char *mtyinprog_descr (MULTTY_INPROG *prog);
+
+
+/* Return the parent of a program, or NULL at the top level.
+ */
+MULTTY_INPROG *mtyinprog_parent (MULTTY_INPROG *prog);
+
+
+/* Register a callback function for batched dispatch of the
+ * input for an inflow.  While it is set, it is called instead
+ * of the callbacks for each stream, and it receives units for
+ * all streams registered with mtyregister_ready(), also when
+ * their callback is NULL.
+ *
+ * The callback function may be NULL to return to the
+ * callbacks for each stream.
+ */
+void mtyregister_batch (MULTTY_INFLOW *flow,
+			mtycb_batch *batch, void *userdata);
+
+
+/* Register an escape style for a stream at an inflow, so
+ * its input is delivered without escapes.  The inflow then
+ * validates, splits and unescapes the input in one pass,
+ * and the callbacks receive clean bytes that should not be
+ * passed through mtyunescape() again.  A <DLE> that is split
+ * over two reads is completed internally.  A <DLE> before a
+ * byte that the style would not escape is reported as bad.
+ *
+ * The stream must have been registered with mtyregister_ready()
+ * first.  The clean bytes are written to opt_buf, which holds
+ * buflen bytes, or to a buffer of the inflow if opt_buf is NULL.
+ * When input does not fit, it is delivered in parts.  A buffer
+ * of the input buffer size, as set with mtyinflow_atomic(),
+ * always fits.  With batched dispatch, the buffer fills up with
+ * the units of a batch until it is delivered.
+ *
+ * Use MULTTY_ESC_MULTTY as the escstyle to stop unescaping.
+ * Do not change this from a callback for the same stream.
+ *
+ * Return true on success, else false/errno
+ */
+bool mtyregister_unescape (MULTTY_INFLOW *flow, char *stream,
+			uint32_t escstyle, uint8_t *opt_buf, int buflen);
+
+
+/* Register an escape style for a named stream of a program in an
+ * inflow, like mtyregister_unescape() does for input that is not
+ * for a program.  The stream must have been registered with
+ * mtyregister_progready() first.
+ *
+ * Return true on success, else false/errno
+ */
+bool mtyregister_progunescape (MULTTY_INFLOW *flow, MULTTY_INPROG *prog, char *stream,
+			uint32_t escstyle, uint8_t *opt_buf, int buflen);
+
+
+/* Read input for an inflow and dispatch it to the callbacks
+ * for its streams, or to the batch callback for the inflow.
+ * Input is read once; if the inflow is blocking, then so is
+ * this call.
+ */
+void multty_vin_dispatch (MULTTY_INFLOW *flow);
+
+
+/* When the queue of a stream that is read with mtyread() fills
+ * up to its high-water mark, a callback may report this, so the
+ * application can ask the sender to hold off, for instance over
+ * the "stdctl" stream.  It is called with full set at the mark,
+ * and with full cleared when the queue drained to half of it.
+ */
+typedef void mtycb_pressure (MULTTY *mty, void *userdata, bool full);
+
+
+/* Register a stream at an inflow for reading with mtyread(),
+ * rather than with callbacks.  Its input is held in a queue,
+ * without or with escapes depending on mtyregister_unescape().
+ * It is not passed to callbacks, not even with batched dispatch.
+ *
+ * When the queue holds highwater bytes, the inflow stops reading
+ * until mtyread() drains it to half.  Other streams then stop
+ * too, as they share the input.  With a pressure callback, the
+ * queue reports this at highwater and the inflow stops at twice
+ * that, so other streams continue while the sender holds off.
+ * Use 0 for MULTTY_INQUEUE_HIGH.
+ *
+ * The stream is added if it was not registered yet.  Calling
+ * this again changes the settings.  After <EM>, the stream
+ * delivers what it holds and then reports its end.
+ *
+ * Returns the handle for mtyread() on success, else NULL/errno
+ */
+MULTTY *mtyregister_queue (MULTTY_INFLOW *flow, char *stream, size_t highwater,
+			mtycb_pressure *opt_pressure, void *userdata);
+
+
+/* Register a named stream of a program in an inflow for reading
+ * with mtyread(), like mtyregister_queue() does for input that
+ * is not for a program.  The program must not have ended.
+ *
+ * Returns the handle for mtyread() on success, else NULL/errno
+ */
+MULTTY *mtyregister_progqueue (MULTTY_INFLOW *flow, MULTTY_INPROG *prog, char *stream,
+			size_t highwater, mtycb_pressure *opt_pressure, void *userdata);
+
+
+/* Read input from a stream registered with mtyregister_queue().
+ * When its queue is empty, input is read and dispatched for the
+ * inflow until the stream has some; if the inflow is blocking,
+ * then so is this call.  Other streams receive their input as
+ * usual while this happens.
+ *
+ * Drop-in replacement for read() with FD changed to MULTTY*.
+ * Returns 0 at the end of the stream, marked with <EM>, once for
+ * each end and in its place between the input before and after
+ * it, or at the end of the input.  Returns -1/ENOBUFS when other
+ * queued streams are full, so no input can be read for this stream.
+ */
+ssize_t mtyread (MULTTY *mty, void *buf, size_t len);
+
+
+/* Wait until streams registered with mtyregister_queue() can
+ * be read without blocking.  Input is read and dispatched for
+ * their inflows while waiting, for up to timeout_ms, or without
+ * limit when it is negative.  The ready flags tell for each of
+ * the nmty handles whether mtyread() returns immediately.
+ *
+ * Returns the number of handles ready, 0 on timeout, or else
+ * -1/errno, which is ENOBUFS when full queues stop all inflows.
+ */
+int mtypoll (MULTTY **mtys, bool *ready, int nmty, int timeout_ms);
+
+
 /* Extract escaped data from a MULTTY handle, and place
  * it in the given buffer.  The return value is the
  * number of bytes actually retrieved.  The size of the
@@ -522,6 +1040,91 @@ void mtydispatch_programs (void);
 
 
 
+/********** FUNCTIONS FOR EVENT LOOPS **********/
+
+
+
+/* When a reactor finds the end of input for an inflow, or an
+ * error while reading it, the inflow is removed from the
+ * reactor and this callback is triggered.  The error is 0 at
+ * the end of input, or else an errno value.  The inflow is
+ * not closed; the callback may do that.
+ */
+typedef void mtycb_inflow_end (MULTTY_INFLOW *flow, void *userdata,
+		int error);
+
+
+/* Open a reactor, to serve many inflows from one thread.  It waits for input with epoll, and only dispatches
+ * the inflows that are ready.
+ *
+ * Returns non-NULL pointer or NULL/errno.
+ */
+MULTTY_REACTOR *mtyreactor (void);
+
+
+/* Close a reactor.  Its inflows are removed, but not closed.
+ */
+void mtyreactor_close (MULTTY_REACTOR *reactor);
+
+
+/* Return the epoll file descriptor of a reactor, so it can be
+ * embedded in another event loop.  When it is readable, call
+ * mtyreactor_run() with a timeout of 0.  Also call it after
+ * mtyreactor_timeout() milliseconds.
+ */
+int mtyreactor_fd (MULTTY_REACTOR *reactor);
+
+
+/* Set the number of bytes that a reactor reads from one inflow
+ * in one round, before it serves the other inflows.  Use 0 for
+ * the default, MULTTY_REACTOR_BUDGET.
+ */
+void mtyreactor_budget (MULTTY_REACTOR *reactor, size_t budget);
+
+
+/* Add an inflow to a reactor.  Its file descriptor is made
+ * non-blocking and is watched edge-triggered.  The optional
+ * callback reports the end of input, see mtycb_inflow_end.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyreactor_add_inflow (MULTTY_REACTOR *reactor, MULTTY_INFLOW *flow,
+			mtycb_inflow_end *opt_end, void *userdata);
+
+
+/* Remove an inflow from a reactor.  It is not closed.  This
+ * may be done from a callback.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyreactor_drop_inflow (MULTTY_REACTOR *reactor, MULTTY_INFLOW *flow);
+
+
+/* Return the number of milliseconds until a reactor needs to
+ * run, in the form used by poll().  This is 0 while inflows
+ * have input left over from the previous round, or else -1 as
+ * there is nothing to wait for but input.
+ *
+ * Outflows are not served by a reactor, because their writes
+ * block and a slow reader would stall all inflows.  Combine
+ * this with mtyoutflow_sync_timeout() and mtyoutflow_timerfd()
+ * in the event loop, or serve outflows from another thread.
+ */
+int mtyreactor_timeout (MULTTY_REACTOR *reactor);
+
+
+/* Run one round of a reactor.  It waits up to timeout_ms for
+ * input, as with epoll_wait(), and then reads and dispatches
+ * each inflow that is ready.  An inflow is drained until it has
+ * no more input, or until it used up its budget, in which case
+ * it continues in the next round.
+ *
+ * Returns the number of inflows served, or else -1/errno.
+ */
+int mtyreactor_run (MULTTY_REACTOR *reactor, int timeout_ms);
+
+
+
 /********** FUNCTIONS FOR PROGRAM MULTIPLEXING **********/
 
 
@@ -551,7 +1154,7 @@ MULTTY_PROG *mtyp_find (MULTTY_PROGSET *progset, const char id_us[33]);
  *
  * Returns a handle on success, or else NULL/errno.
  */
-MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const char *id, const char *opt_descr);
+MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const char id_us[33], const char *opt_descr);
 
 
 /* Describe a program with a new string.  This
@@ -574,7 +1177,7 @@ bool mtyp_describe (MULTTY_PROG *prog, const char *descr);
  * This is not a user command, it is intended for mulTTY internals.
  *
  * The content supplied is sent atomically, which means it should
- * not exceed PIPE_BUF.  If it does, errno is set to EMSGSIZE.
+ * not exceed ATOMIC_SEND_MAX.  If it does, errno is set to EMSGSIZE.
  *
  * The raw content is supplied as a sequence of pointer and length:
  *  - uint8_t *buf
@@ -586,32 +1189,296 @@ bool mtyp_describe (MULTTY_PROG *prog, const char *descr);
 bool mtyp_raw (int numbufs, ...);
 
 
+/* Send raw data for mulTTY program multiplexing to an outflow,
+ * as with mtyp_raw() for MULTTY_OUTFLOW_STDOUT.
+ *
+ * This returns true on success, or else false/errno.
+ */
+bool mtyp_rawflow (MULTTY_OUTFLOW *flow, int numbufs, ...);
+
+
+/* Bind a program set to an outflow, so program switches
+ * are sent there.  Program sets are bound to the standard
+ * outflow until this is called.  Each outflow has its own
+ * current and previous program, so each should have its
+ * own program set.  When the set moves to another outflow,
+ * its programs lose their aliases and the next switch is
+ * sent in full.
+ */
+void mtyp_bind (MULTTY_PROGSET *progset, MULTTY_OUTFLOW *flow);
+
+
 /* Switch to another program, and send the corresponding control code
- * over stdout.  The identity can be constructed with mtyp_mkid()
- * and hints at an optional description.
+ * over the outflow of its program set.  The identity can be
+ * constructed with mtyp_mkid() and hints at an optional description.
  *
  * It is assumed that the program switched to exists.
  *
- * TODO: Streams may need to claim until they release.
+ * Stream output that is bound to a program makes its switch with
+ * mtyp_switch_iov() instead, in the same unit as the stream data.
  *
  * Return 0 on success or else -1/errno.
  */
 int mtyp_switch (MULTTY_PROG *prog);
 
 
+/* The most iovec entries that mtyp_switch_iov() fills in, for
+ * <SOH>id<US>descr<DC4>.
+ */
+#define MULTTY_SWITCH_IOVS 4
+
+
+/* Prepare the switch to a program as iovec entries, so it can be
+ * sent in front of stream data, in the same atomic unit.  The
+ * program set does not change until mtyp_switch_commit() is
+ * called after sending, so a failed write leaves it as it was.
+ * Nothing is prepared when the program is current already.
+ * When the program set is bound to another outflow than the one
+ * given, the switch is sent there right away.  An outflow that
+ * uses aliases binds one in the full switch, and then switches
+ * with <SOH>#N<DC4> instead, see mtyoutflow_aliases().
+ *
+ * The iovec entries point into the program, which should not
+ * change until they are sent.
+ *
+ * Returns the number of entries filled in iov, at most
+ * MULTTY_SWITCH_IOVS, or else -1/errno.
+ */
+int mtyp_switch_iov (MULTTY_OUTFLOW *flow, MULTTY_PROG *prog,
+			struct iovec iov [MULTTY_SWITCH_IOVS]);
+
+
+/* Commit the switch to a program after it was sent, as prepared
+ * by mtyp_switch_iov(), also when that prepared nothing.  The
+ * program becomes current in its set, and the current one is
+ * pushed back to previous.  Switching to the current program
+ * forgets the previous one.  An alias that the switch bound is
+ * used from now on.  Nothing changes when the program set is
+ * bound to another outflow than the one given, as the switch
+ * was sent and committed there.
+ */
+void mtyp_switch_commit (MULTTY_OUTFLOW *flow, MULTTY_PROG *prog);
+
+
+/* Schedule the output to the outflow of a program set by program.
+ * The units that are held for coalescing, see mtyoutflow_coalesce(),
+ * are then sent in groups per program, to save on switches.  The
+ * current and previous program go first, because switching to
+ * them is cheapest.  The order of units for each program is kept,
+ * and units for no program in the set are not moved.  The units
+ * are held no longer than the latency set for coalescing.
+ *
+ * This only has effect while the outflow coalesces, and then for
+ * streams that are assigned to a program in the set.  Scheduling
+ * stops when called with schedule set to false.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyp_schedule (MULTTY_PROGSET *progset, bool schedule);
+
+
+/* Return the number of bytes for program switches that were saved
+ * by scheduling the output of a program set, see mtyp_schedule().
+ * This compares to sending the same units in the order in which
+ * they were written.
+ */
+long mtyp_schedule_saved (MULTTY_PROGSET *progset);
+
+
 
 /********** FUNCTIONS FOR GENERAL USE **********/
 
 
 
+/* Declare whether this process is the only writer to its output.
+ * This is the case for a socket or pipe that no other process or
+ * thread writes to, and then atomicity against other writers is
+ * moot.  In this mode, many complete units are gathered and sent
+ * with one writev() and short writes are continued instead of
+ * being treated as a broken connection.
+ *
+ * Units are still limited to ATOMIC_SEND_MAX and each returns to
+ * the default stream, so a reader sees the same units as before,
+ * unless output is made sticky with mtyoutflow_sticky().
+ * Only set this when you are sure there are no other writers.
+ */
+void mtyexclusive (bool exclusive);
+
+
+/* Declare whether this process is the only writer to an outflow,
+ * as with mtyexclusive() for MULTTY_OUTFLOW_STDOUT.
+ */
+void mtyoutflow_exclusive (MULTTY_OUTFLOW *flow, bool exclusive);
+
+
+/* Let the output to an outflow stay in a stream between units.
+ * Every unit normally shifts to its stream with <SOH>name<SO>
+ * and returns to the default stream with <SO>, so it stands on
+ * its own between the units of other writers.  With only one
+ * writer, that is a waste on a burst of units for one stream.
+ * Sticky output only shifts when the stream changes, and it
+ * returns to the default stream before a switch of program and
+ * before output to the default stream or from mtyp_raw().
+ *
+ * This only has effect while the outflow is exclusive, see
+ * mtyoutflow_exclusive(), and not while output is scheduled by
+ * program.  Otherwise, units stand on their own as before.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyoutflow_sticky (MULTTY_OUTFLOW *flow, bool sticky);
+
+
+/* Set whether an outflow names streams and programs by aliases.
+ * The first unit for a stream then binds a number to its name
+ * with <SOH>#N=name<SO> and later units start with <SOH>#N<SO>.
+ * Programs are switched to with <SOH>#N=id<US>descr<DC4> and
+ * then <SOH>#N<DC4>, until their description changes.  Aliases
+ * are only used where they are shorter than the name.
+ *
+ * The reader must accept aliases, see mtyinflow_aliases(), so
+ * both sides should agree on them first, for instance over the
+ * stdctl stream.  Numbers are never reused within an outflow,
+ * so other processes that write to the same output must not
+ * use aliases.  A stream that ends with <EM> loses its alias
+ * at the reader, so do not end a stream while another handle
+ * for the same name remains in use.
+ */
+void mtyoutflow_aliases (MULTTY_OUTFLOW *flow, bool aliases);
+
+
+/* Coalesce the output of all MULTTY handles that are bound to
+ * MULTTY_OUTFLOW_STDOUT in a shared queue.  Complete units are
+ * gathered and sent in one atomic writev() of at most
+ * ATOMIC_SEND_MAX bytes.  The queue is sent when another unit
+ * would not fit, on mtysync(), or once the oldest unit has
+ * waited for latency_usec microseconds.  The latency is only
+ * checked when output is sent; an idle program should call
+ * mtysync() after mtysync_timeout() milliseconds.
+ *
+ * Disabling coalescing sends what is in the queue; when that
+ * fails, coalescing continues.  Queued output is also sent when
+ * the program exits normally.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtycoalesce (bool coalesce, unsigned latency_usec);
+
+
+/* Coalesce the output to an outflow, as with mtycoalesce() for
+ * MULTTY_OUTFLOW_STDOUT.  Queued output to other outflows is
+ * not sent when the program exits, but in mtyoutflow_close().
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyoutflow_coalesce (MULTTY_OUTFLOW *flow, bool coalesce, unsigned latency_usec);
+
+
+/* Send any output that was queued for coalescing.  This is
+ * harmless to call when coalescing is not enabled.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtysync (void);
+
+
+/* Send any output that was queued for coalescing on an outflow,
+ * as with mtysync() for MULTTY_OUTFLOW_STDOUT.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_sync (MULTTY_OUTFLOW *flow);
+
+
+/* Return the number of milliseconds until queued output is due
+ * to be sent with mtysync(), in the form used by poll().  This
+ * is -1 when nothing is queued, and 0 when output is overdue.
+ */
+int mtysync_timeout (void);
+
+
+/* Return the number of milliseconds until output queued on an
+ * outflow is due, as with mtysync_timeout() for the standard
+ * outflow.  An event loop can take the minimum over outflows.
+ */
+int mtyoutflow_sync_timeout (MULTTY_OUTFLOW *flow);
+
+
+/* Return a timerfd that expires when buffered output on an outflow
+ * is due, see mtysetdeadline().  The application can poll it and
+ * call mtyoutflow_flushdue() when it is readable.  The timerfd is
+ * made on the first call, and closed with the outflow.
+ *
+ * Returns the file descriptor on success, or else -1/errno.
+ */
+int mtyoutflow_timerfd (MULTTY_OUTFLOW *flow);
+
+
+/* Send the buffered output on an outflow for which the deadline
+ * has passed, see mtysetdeadline().  The timerfd is reset for the
+ * next handle that will be due.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_flushdue (MULTTY_OUTFLOW *flow);
+
+
+/* Return the number of milliseconds until buffered output on an
+ * outflow is due to be sent with mtyoutflow_flushdue(), in the
+ * form used by poll().  This is -1 when nothing has a deadline,
+ * and 0 when output is overdue.
+ */
+int mtyoutflow_flushdue_timeout (MULTTY_OUTFLOW *flow);
+
+
+/* Set the ATOMIC_SEND_MAX for the output, which is the largest
+ * unit that will be written atomically.  Use 0 to detect it from
+ * the type of the output, which is also done when it is not set.
+ * The value must lie between _POSIX_PIPE_BUF and MULTTY_ATOMIC_MAX
+ * and it should not exceed what readers can receive atomically.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyatomic_send (int send_max);
+
+
+/* Set the ATOMIC_SEND_MAX for an outflow, as with mtyatomic_send()
+ * for MULTTY_OUTFLOW_STDOUT.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyoutflow_atomic (MULTTY_OUTFLOW *flow, int send_max);
+
+
+/* Set the number of idle buffers that each pool keeps for reuse.
+ * Buffers beyond this number are freed when they are released,
+ * and idle buffers beyond it are freed right away.  The default
+ * is MULTTY_POOL_IDLE.  A value of 0 frees buffers after every
+ * flush, which is cheapest for memory but not for time.
+ */
+void mtypool_setsize (unsigned idle_max);
+
+
+/* Report the usage of the pools.  The first entry describes the
+ * handles, with the size of a handle.  The other entries describe
+ * one buffer pool each, with its buffer size.  Up to maxpools
+ * entries are filled.
+ *
+ * Returns the number of entries that are available, which may
+ * be more than maxpools.
+ */
+int mtypool_usage (struct multty_poolusage *usage, int maxpools);
+
+
 /* INTERNAL ROUTINE for sending literaly bytes from an iovec
- * array to stdout.  This is used after composing a complete
+ * array to MULTTY_OUTFLOW_STDOUT.  This is used after composing a complete
  * structure intended to be sent.
  *
  * The primary function here is to send atomically, to
  * avoid one structure getting intertwined with another.
  * This is necessary for security and general correctness.
- * This requirement imposes a PIPE_BUF as maximum for len.
+ * This requirement imposes ATOMIC_SEND_MAX as maximum for len,
+ * which is PIPE_BUF unless mtyatomic_send() detects or sets it.
  *
  * Stream output should be sent such that it returns to
  * the default stream within the atomic unit, which is
@@ -619,13 +1486,26 @@ int mtyp_switch (MULTTY_PROG *prog);
  *
  * Returns true on succes, or false/errno.  Specifically
  * note EMSGSIZE, which is returned when the message is
- * too large (the limit is PIPE_BUF).  This might occur
+ * too large (the limit is ATOMIC_SEND_MAX).  This might occur
  * when writing "<SOH>id<US>very_long_description<XXX>"
  * or similar constructs that user input inside an atom.
  * It may then be possible to send "<SOH>id<US><XXX>".
+ *
+ * When the output is owned exclusively, see mtyexclusive(),
+ * the length is not limited and short writes are continued.
+ * When coalescing, see mtycoalesce(), small units may be
+ * queued and sent later, together with other units.
  */
 bool mtyv_out (int len, int ioc, const struct iovec *iov);
 
 
+/* INTERNAL ROUTINE for sending literaly bytes from an iovec
+ * array to an outflow, as mtyv_out() does for stdout.
+ *
+ * Returns true on succes, or false/errno.
+ */
+bool mtyv_outflow (MULTTY_OUTFLOW *flow, int len, int ioc, const struct iovec *iov);
+
+
 
 #endif /* ARPA2_MULTTY_H */
@@ -0,0 +1,126 @@
+/* mulTTY -> compact aliases for stream and program names
+ *
+ * Every unit names its stream in a <SOH>name<SO> prefix, and a
+ * switch to a program names it in full.  For short units, that
+ * adds up.  When the reader agrees, see mtyinflow_aliases(), the
+ * first unit binds a number with <SOH>#N=name<SO> and later ones
+ * only send <SOH>#N<SO>.  Programs do the same in their switch,
+ * see mtyp_switch_iov().
+ *
+ * Numbers are never reused within an outflow, so nothing needs
+ * to be taken back when a handle closes or a program is dropped.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdio.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* Set whether an outflow names streams and programs by aliases.
+ * The first unit for a stream then binds a number to its name
+ * with <SOH>#N=name<SO> and later units start with <SOH>#N<SO>.
+ * Programs are switched to with <SOH>#N=id<US>descr<DC4> and
+ * then <SOH>#N<DC4>, until their description changes.  Aliases
+ * are only used where they are shorter than the name.
+ *
+ * The reader must accept aliases, see mtyinflow_aliases(), so
+ * both sides should agree on them first, for instance over the
+ * stdctl stream.  Numbers are never reused within an outflow,
+ * so other processes that write to the same output must not
+ * use aliases.  A stream that ends with <EM> loses its alias
+ * at the reader, so do not end a stream while another handle
+ * for the same name remains in use.
+ */
+void mtyoutflow_aliases (MULTTY_OUTFLOW *flow, bool aliases) {
+	_MTY_FLOW (flow)->aliases = aliases;
+}
+
+
+/* INTERNAL ROUTINE to take a new alias number for an outflow.
+ * Numbers are never reused, and they start at 1.
+ */
+unsigned _mty_alias_next (MULTTY_OUTFLOW *flow) {
+	return atomic_fetch_add (&flow->nextalias, 1) + 1;
+}
+
+
+/* INTERNAL ROUTINE to bind an alias for the stream of a MULTTY
+ * handle in the next unit that it sends.  Returns the length of
+ * the head <SOH>#N= that replaces the <SOH> of the prefix, or
+ * 0 to send the prefix as it is.  The unitlen is used to keep
+ * the unit within ATOMIC_SEND_MAX.
+ *
+ * Handles without a shift or with a buffer of their own, like
+ * MULTTY_STDERR, keep their prefix.
+ */
+int _mty_alias_head (MULTTY *mty, MULTTY_OUTFLOW *flow, int unitlen,
+			char head [MULTTY_ALIAS_HEAD]) {
+	if (!flow->aliases || mty->aliased || (mty->shift == 0)) {
+		return 0;
+	}
+	if ((mty->buf != NULL) && !mty->bufpool) {
+		return 0;
+	}
+	if (!flow->exclusive && (unitlen + MULTTY_ALIAS_HEAD > _mty_atomic_send (flow))) {
+		return 0;
+	}
+	//
+	// The alias <SOH>#N<SO> must be shorter than <SOH>name<SO>
+	int headlen = snprintf (head, MULTTY_ALIAS_HEAD, "%c#%u=",
+				c_SOH, _mty_alias_next (flow));
+	if (headlen >= mty->shift) {
+		mty->aliased = true;
+		return 0;
+	}
+	return headlen;
+}
+
+
+/* INTERNAL ROUTINE to take the alias in the head as the prefix
+ * of a MULTTY handle, once the unit that binds it was sent.  Any
+ * pooled buffer holds no content yet, and it is released.  When
+ * memory runs out, the prefix stays as it was; the reader still
+ * accepts it.
+ */
+void _mty_alias_commit (MULTTY *mty, const char *head, int headlen) {
+	_mty_pool_release (mty);
+	mty->aliased = true;
+	uint8_t *prefix = malloc (headlen);
+	if (prefix == NULL) {
+		return;
+	}
+	memcpy (prefix, head, headlen - 1);
+	prefix [headlen - 1] = c_SO;
+	mty->fullprefix = mty->prefix;
+	mty->prefix = prefix;
+	mty->shift = headlen;
+	mty->fill = headlen;
+}
+
+
+/* INTERNAL ROUTINE to return a MULTTY handle to its <SOH>name<SO>
+ * prefix, because its alias is not known where it is going.  The
+ * handle must not hold a buffer.  It may bind a new alias later.
+ */
+void _mty_alias_drop (MULTTY *mty) {
+	mty->aliased = false;
+	if (mty->fullprefix == NULL) {
+		return;
+	}
+	free (mty->prefix);
+	mty->prefix = mty->fullprefix;
+	mty->fullprefix = NULL;
+	//
+	// The escaped name holds no <SO>, so the first one ends it
+	int shift = 1;
+	while (mty->prefix [shift - 1] != c_SO) {
+		shift++;
+	}
+	mty->shift = shift;
+	mty->fill = shift;
+}
@@ -0,0 +1,143 @@
+/* mulTTY -> atomic unit sizes for sending and receiving
+ *
+ * Units of mulTTY output are sent atomically, so they cannot
+ * mix with other writers.  For pipes, POSIX limits this to
+ * PIPE_BUF, but SOCK_SEQPACKET, SCTP and regular files allow
+ * larger writes that are just as safe.  We call the limit for
+ * sending ATOMIC_SEND_MAX, and the matching buffer size that a
+ * reader needs to hold a complete unit ATOMIC_RECV_MIN.  Both
+ * are detected from the file type or set explicitly.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* The largest UDP payload over IPv4 and IPv6, without jumbograms.
+ */
+#define MTY_UDP4_MAX (65535 - 20 - 8)
+#define MTY_UDP6_MAX (65535 - 8)
+
+
+/* INTERNAL ROUTINE to limit the atomic unit size of a packet
+ * socket to the largest packet that it can send.  Over UDP,
+ * that is below MULTTY_ATOMIC_MAX.  Any socket refuses packets
+ * beyond its send buffer, which the kernel reports at double
+ * its usable size.
+ */
+static int _mty_atomic_packet (int fd, int type) {
+	int size = MULTTY_ATOMIC_MAX;
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof (sa);
+	if ((type == SOCK_DGRAM) &&
+			(getsockname (fd, (struct sockaddr *) &sa, &salen) == 0)) {
+		if (sa.ss_family == AF_INET) {
+			size = MTY_UDP4_MAX;
+		} else if (sa.ss_family == AF_INET6) {
+			size = MTY_UDP6_MAX;
+		}
+	}
+	int sndbuf;
+	socklen_t sndbuflen = sizeof (sndbuf);
+	if ((getsockopt (fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &sndbuflen) == 0) &&
+			(sndbuf / 2 < size)) {
+		size = sndbuf / 2;
+	}
+	return (size > PIPE_BUF) ? size : PIPE_BUF;
+}
+
+
+/* INTERNAL ROUTINE to detect a suitable atomic unit size for a
+ * file descriptor.  Regular files get MULTTY_ATOMIC_MAX, and
+ * datagram and sequential packet sockets get up to that, as
+ * far as their address family and send buffer allow; pipes,
+ * stream sockets, terminals and anything unknown get PIPE_BUF.
+ */
+int _mty_atomic_detect (int fd) {
+	struct stat st;
+	if (fstat (fd, &st) != 0) {
+		return PIPE_BUF;
+	}
+	if (S_ISREG (st.st_mode)) {
+		return MULTTY_ATOMIC_MAX;
+	}
+	if (S_ISSOCK (st.st_mode)) {
+		int type;
+		socklen_t typelen = sizeof (type);
+		if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &typelen) == 0) {
+			if ((type == SOCK_SEQPACKET) || (type == SOCK_DGRAM)) {
+				return _mty_atomic_packet (fd, type);
+			}
+		}
+	}
+	return PIPE_BUF;
+}
+
+
+/* INTERNAL ROUTINE to test if a file descriptor is a datagram or
+ * sequential packet socket.  Every read takes one packet, and
+ * whatever does not fit in the buffer is lost.
+ */
+bool _mty_atomic_packets (int fd) {
+	struct stat st;
+	if ((fstat (fd, &st) != 0) || !S_ISSOCK (st.st_mode)) {
+		return false;
+	}
+	int type;
+	socklen_t typelen = sizeof (type);
+	if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &typelen) != 0) {
+		return false;
+	}
+	return (type == SOCK_SEQPACKET) || (type == SOCK_DGRAM);
+}
+
+
+/* INTERNAL ROUTINE to get the ATOMIC_SEND_MAX for an outflow,
+ * detecting it on first use.
+ */
+int _mty_atomic_send (MULTTY_OUTFLOW *flow) {
+	if (flow->send_max == 0) {
+		flow->send_max = _mty_atomic_detect (flow->outfd);
+	}
+	return flow->send_max;
+}
+
+
+/* Set the ATOMIC_SEND_MAX for the output, which is the largest
+ * unit that will be written atomically.  Use 0 to detect it from
+ * the type of the output, which is also done when it is not set.
+ * The value must lie between _POSIX_PIPE_BUF and MULTTY_ATOMIC_MAX
+ * and it should not exceed what readers can receive atomically.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyatomic_send (int send_max) {
+	return mtyoutflow_atomic (MULTTY_OUTFLOW_STDOUT, send_max);
+}
+
+
+/* Set the ATOMIC_SEND_MAX for an outflow, as with mtyatomic_send()
+ * for MULTTY_OUTFLOW_STDOUT.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyoutflow_atomic (MULTTY_OUTFLOW *flow, int send_max) {
+	if (send_max == 0) {
+		send_max = _mty_atomic_detect (flow->outfd);
+	}
+	if ((send_max < _POSIX_PIPE_BUF) || (send_max > MULTTY_ATOMIC_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	flow->send_max = send_max;
+	return send_max;
+}
@@ -0,0 +1,345 @@
+/* mulTTY -> vectorised byte scanning kernels
+ *
+ * Escaping, unescaping and parsing input spend most of their
+ * time looking for the few bytes that need special treatment.  The kernels
+ * in this file skip over clean runs 16 or 32 bytes at a time,
+ * with a plain C fallback for other processors.  The kernel
+ * is chosen once, at load time, based on the CPU features.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define MULTTY_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* Plain C kernel, scanning one byte at a time.  Also used for
+ * the tails that do not fill a complete vector.
+ */
+static size_t _mty_escscan_scalar (uint32_t style, const uint8_t *ptr, size_t len) {
+	const bool *table = mtyescape_register (style);
+	size_t ofs;
+	if (table == NULL) {
+		for (ofs = 0; ofs < len; ofs++) {
+			if (mtyescapewish (style, ptr [ofs])) {
+				break;
+			}
+		}
+		return ofs;
+	}
+	for (ofs = 0; ofs < len; ofs++) {
+		if (table [ptr [ofs]]) {
+			break;
+		}
+	}
+	return ofs;
+}
+
+
+/* Plain C kernel for control scanning.  Stops at control codes
+ * in the set, and at <DLE>, <DEL> and 0xff.
+ */
+static size_t _mty_ctlscan_scalar (uint32_t ctlset, const uint8_t *ptr, size_t len) {
+	ctlset |= (1 << c_DLE);
+	size_t ofs;
+	for (ofs = 0; ofs < len; ofs++) {
+		uint8_t ch = ptr [ofs];
+		if (ch < 0x20) {
+			if (ctlset & (((uint32_t) 1) << ch)) {
+				break;
+			}
+		} else if ((ch == 0x7f) || (ch == 0xff)) {
+			break;
+		}
+	}
+	return ofs;
+}
+
+
+/* Plain C kernel for input sizing, counting <DLE> up to <SOH>.
+ */
+static size_t _mty_inputscan_scalar (const uint8_t *ptr, size_t len, size_t *dles) {
+	size_t ofs;
+	size_t count = 0;
+	for (ofs = 0; ofs < len; ofs++) {
+		uint8_t ch = ptr [ofs];
+		if (ch == c_SOH) {
+			break;
+		} else if (ch == c_DLE) {
+			count++;
+		}
+	}
+	*dles += count;
+	return ofs;
+}
+
+
+#ifdef MULTTY_SIMD_X86
+
+/* SSE2 kernel.  Without a byte shuffle we cannot look up the
+ * style bit for each control code in parallel, so we find the
+ * candidates that might be escaped (control codes, plus <DEL>
+ * and <IAC> when their style bits are set) and look up just
+ * those in the style's table.  Clean text yields no candidates
+ * and <CR><LF> only cost a lookup each.
+ */
+__attribute__ ((target ("sse2")))
+static size_t _mty_escscan_sse2 (uint32_t style, const uint8_t *ptr, size_t len) {
+	if (style == MULTTY_ESC_MULTTY) {
+		return len;
+	}
+	const bool *table = mtyescape_register (style);
+	if (table == NULL) {
+		return _mty_escscan_scalar (style, ptr, len);
+	}
+	const __m128i ctlmax = _mm_set1_epi8 (0x1f);
+	// When their style bit is clear, <DEL> and <IAC> compare with
+	// <NUL> instead, which is a control code candidate anyway
+	const __m128i del = _mm_set1_epi8 ((style & (1 << 0x08)) ? 0x7f : 0x00);
+	const __m128i iac = _mm_set1_epi8 ((style & (1 << 0x00)) ? 0xff : 0x00);
+	size_t ofs = 0;
+	while (ofs + 16 <= len) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *) (ptr + ofs));
+		__m128i cand = _mm_cmpeq_epi8 (_mm_min_epu8 (v, ctlmax), v);
+		cand = _mm_or_si128 (cand, _mm_cmpeq_epi8 (v, del));
+		cand = _mm_or_si128 (cand, _mm_cmpeq_epi8 (v, iac));
+		unsigned mask = _mm_movemask_epi8 (cand);
+		while (mask != 0) {
+			int bit = __builtin_ctz (mask);
+			if (table [ptr [ofs + bit]]) {
+				return ofs + bit;
+			}
+			mask &= mask - 1;
+		}
+		ofs += 16;
+	}
+	while ((ofs < len) && !table [ptr [ofs]]) {
+		ofs++;
+	}
+	return ofs;
+}
+
+
+/* AVX2 kernel.  The style is split into two 16-entry lookup
+ * tables, for 0x00..0x0f and 0x10..0x1f, and a byte shuffle
+ * classifies 32 bytes exactly.  <DEL> and <IAC> are masked
+ * with the style bits for <BS> and <NUL> that they fold into.
+ */
+__attribute__ ((target ("avx2")))
+static size_t _mty_escscan_avx2 (uint32_t style, const uint8_t *ptr, size_t len) {
+	if (style == MULTTY_ESC_MULTTY) {
+		return len;
+	}
+	uint8_t lut [32];
+	int i;
+	for (i = 0; i < 32; i++) {
+		lut [i] = (style & (((uint32_t) 1) << i)) ? 0xff : 0x00;
+	}
+	const __m256i lut0 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) (lut +  0)));
+	const __m256i lut1 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) (lut + 16)));
+	const __m256i lonib = _mm256_set1_epi8 (0x0f);
+	const __m256i hinib = _mm256_set1_epi8 ((char) 0xf0);
+	const __m256i page1 = _mm256_set1_epi8 (0x10);
+	const __m256i zero  = _mm256_setzero_si256 ();
+	const __m256i del = _mm256_set1_epi8 (0x7f);
+	const __m256i iac = _mm256_set1_epi8 ((char) 0xff);
+	const __m256i delwish = _mm256_set1_epi8 (lut [0x08]);
+	const __m256i iacwish = _mm256_set1_epi8 (lut [0x00]);
+	size_t ofs = 0;
+	while (ofs + 32 <= len) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i *) (ptr + ofs));
+		__m256i lo = _mm256_and_si256 (v, lonib);
+		__m256i hi = _mm256_and_si256 (v, hinib);
+		__m256i esc0 = _mm256_and_si256 (_mm256_shuffle_epi8 (lut0, lo),
+		                                 _mm256_cmpeq_epi8 (hi, zero));
+		__m256i esc1 = _mm256_and_si256 (_mm256_shuffle_epi8 (lut1, lo),
+		                                 _mm256_cmpeq_epi8 (hi, page1));
+		__m256i esc = _mm256_or_si256 (esc0, esc1);
+		esc = _mm256_or_si256 (esc, _mm256_and_si256 (delwish, _mm256_cmpeq_epi8 (v, del)));
+		esc = _mm256_or_si256 (esc, _mm256_and_si256 (iacwish, _mm256_cmpeq_epi8 (v, iac)));
+		unsigned mask = _mm256_movemask_epi8 (esc);
+		if (mask != 0) {
+			return ofs + __builtin_ctz (mask);
+		}
+		ofs += 32;
+	}
+	return ofs + _mty_escscan_sse2 (style, ptr + ofs, len - ofs);
+}
+
+
+/* SSE2 kernel for control scanning.  Control codes, <DEL> and
+ * 0xff are candidates, and the control codes among them are
+ * tested against the set.  Plain text yields no candidates
+ * and <CR><LF> or <HT> only cost a bit test each.
+ */
+__attribute__ ((target ("sse2")))
+static size_t _mty_ctlscan_sse2 (uint32_t ctlset, const uint8_t *ptr, size_t len) {
+	ctlset |= (1 << c_DLE);
+	const __m128i ctlmax = _mm_set1_epi8 (0x1f);
+	const __m128i del = _mm_set1_epi8 (0x7f);
+	const __m128i iac = _mm_set1_epi8 ((char) 0xff);
+	size_t ofs = 0;
+	while (ofs + 16 <= len) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *) (ptr + ofs));
+		__m128i cand = _mm_cmpeq_epi8 (_mm_min_epu8 (v, ctlmax), v);
+		cand = _mm_or_si128 (cand, _mm_cmpeq_epi8 (v, del));
+		cand = _mm_or_si128 (cand, _mm_cmpeq_epi8 (v, iac));
+		unsigned mask = _mm_movemask_epi8 (cand);
+		while (mask != 0) {
+			int bit = __builtin_ctz (mask);
+			uint8_t ch = ptr [ofs + bit];
+			if ((ch >= 0x20) || (ctlset & (((uint32_t) 1) << ch))) {
+				return ofs + bit;
+			}
+			mask &= mask - 1;
+		}
+		ofs += 16;
+	}
+	return ofs + _mty_ctlscan_scalar (ctlset, ptr + ofs, len - ofs);
+}
+
+
+/* AVX2 kernel for control scanning.  The set is split into two
+ * 16-entry lookup tables, for 0x00..0x0f and 0x10..0x1f, and a
+ * byte shuffle classifies 32 bytes exactly.  Adding 0x70 with
+ * saturation moves the bytes for each table to 0x70..0x7f and
+ * all others to 0x80 or more, for which the shuffle yields 0.
+ */
+__attribute__ ((target ("avx2")))
+static size_t _mty_ctlscan_avx2 (uint32_t ctlset, const uint8_t *ptr, size_t len) {
+	ctlset |= (1 << c_DLE);
+	uint8_t lut [32];
+	int i;
+	for (i = 0; i < 32; i++) {
+		lut [i] = (ctlset & (((uint32_t) 1) << i)) ? 0xff : 0x00;
+	}
+	const __m256i lut0 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) (lut +  0)));
+	const __m256i lut1 = _mm256_broadcastsi128_si256 (_mm_loadu_si128 ((const __m128i *) (lut + 16)));
+	const __m256i page1 = _mm256_set1_epi8 (0x10);
+	const __m256i lift  = _mm256_set1_epi8 (0x70);
+	const __m256i del = _mm256_set1_epi8 (0x7f);
+	const __m256i iac = _mm256_set1_epi8 ((char) 0xff);
+#define _MTY_CTLSTOP(v) _mm256_or_si256 ( \
+		_mm256_or_si256 ( \
+			_mm256_shuffle_epi8 (lut0, _mm256_adds_epu8 ((v), lift)), \
+			_mm256_shuffle_epi8 (lut1, _mm256_adds_epu8 (_mm256_sub_epi8 ((v), page1), lift))), \
+		_mm256_or_si256 (_mm256_cmpeq_epi8 ((v), del), _mm256_cmpeq_epi8 ((v), iac)))
+	size_t ofs = 0;
+	//
+	// Test 64 bytes at a time while nothing is found
+	while (ofs + 64 <= len) {
+		__m256i stop0 = _MTY_CTLSTOP (_mm256_loadu_si256 ((const __m256i *) (ptr + ofs     )));
+		__m256i stop1 = _MTY_CTLSTOP (_mm256_loadu_si256 ((const __m256i *) (ptr + ofs + 32)));
+		if (!_mm256_testz_si256 (_mm256_or_si256 (stop0, stop1), _mm256_or_si256 (stop0, stop1))) {
+			uint64_t mask = ((uint64_t) (uint32_t) _mm256_movemask_epi8 (stop1) << 32) |
+			                           (uint32_t) _mm256_movemask_epi8 (stop0);
+			return ofs + __builtin_ctzll (mask);
+		}
+		ofs += 64;
+	}
+	while (ofs + 32 <= len) {
+		unsigned mask = _mm256_movemask_epi8 (_MTY_CTLSTOP (_mm256_loadu_si256 ((const __m256i *) (ptr + ofs))));
+		if (mask != 0) {
+			return ofs + __builtin_ctz (mask);
+		}
+		ofs += 32;
+	}
+#undef _MTY_CTLSTOP
+	return ofs + _mty_ctlscan_sse2 (ctlset, ptr + ofs, len - ofs);
+}
+
+
+/* SSE2 kernel for input sizing.  Every 16 bytes are compared
+ * with <SOH> and <DLE> at once, and the <DLE> are counted up to
+ * the first <SOH> by masking the bits beyond it.
+ */
+__attribute__ ((target ("sse2,popcnt")))
+static size_t _mty_inputscan_sse2 (const uint8_t *ptr, size_t len, size_t *dles) {
+	const __m128i soh = _mm_set1_epi8 (c_SOH);
+	const __m128i dle = _mm_set1_epi8 (c_DLE);
+	size_t count = 0;
+	size_t ofs = 0;
+	while (ofs + 16 <= len) {
+		__m128i v = _mm_loadu_si128 ((const __m128i *) (ptr + ofs));
+		unsigned sohmask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, soh));
+		unsigned dlemask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, dle));
+		if (sohmask != 0) {
+			int bit = __builtin_ctz (sohmask);
+			*dles += count + __builtin_popcount (dlemask & ((1u << bit) - 1));
+			return ofs + bit;
+		}
+		count += __builtin_popcount (dlemask);
+		ofs += 16;
+	}
+	*dles += count;
+	return ofs + _mty_inputscan_scalar (ptr + ofs, len - ofs, dles);
+}
+
+
+/* AVX2 kernel for input sizing, as for SSE2 but 32 bytes wide.
+ */
+__attribute__ ((target ("avx2,popcnt")))
+static size_t _mty_inputscan_avx2 (const uint8_t *ptr, size_t len, size_t *dles) {
+	const __m256i soh = _mm256_set1_epi8 (c_SOH);
+	const __m256i dle = _mm256_set1_epi8 (c_DLE);
+	size_t count = 0;
+	size_t ofs = 0;
+	while (ofs + 32 <= len) {
+		__m256i v = _mm256_loadu_si256 ((const __m256i *) (ptr + ofs));
+		unsigned sohmask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, soh));
+		unsigned dlemask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, dle));
+		if (sohmask != 0) {
+			int bit = __builtin_ctz (sohmask);
+			*dles += count + __builtin_popcount (dlemask & ((((uint64_t) 1) << bit) - 1));
+			return ofs + bit;
+		}
+		count += __builtin_popcount (dlemask);
+		ofs += 32;
+	}
+	*dles += count;
+	return ofs + _mty_inputscan_sse2 (ptr + ofs, len - ofs, dles);
+}
+
+#endif /* MULTTY_SIMD_X86 */
+
+
+/* The kernels in use, initially the plain C versions so they
+ * work even before the load-time selection has run.
+ */
+size_t (*_mty_escscan) (uint32_t style, const uint8_t *ptr, size_t len) = _mty_escscan_scalar;
+size_t (*_mty_inputscan) (const uint8_t *ptr, size_t len, size_t *dles) = _mty_inputscan_scalar;
+size_t (*_mty_ctlscan) (uint32_t ctlset, const uint8_t *ptr, size_t len) = _mty_ctlscan_scalar;
+
+
+#ifdef MULTTY_SIMD_X86
+
+/* Select the fastest kernels for this CPU when the library loads.
+ */
+__attribute__ ((constructor))
+static void _mty_bytescan_select (void) {
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2")) {
+		_mty_escscan = _mty_escscan_avx2;
+	} else if (__builtin_cpu_supports ("sse2")) {
+		_mty_escscan = _mty_escscan_sse2;
+	}
+	if (__builtin_cpu_supports ("avx2")) {
+		_mty_ctlscan = _mty_ctlscan_avx2;
+	} else if (__builtin_cpu_supports ("sse2")) {
+		_mty_ctlscan = _mty_ctlscan_sse2;
+	}
+	if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("popcnt")) {
+		_mty_inputscan = _mty_inputscan_avx2;
+	} else if (__builtin_cpu_supports ("sse2") && __builtin_cpu_supports ("popcnt")) {
+		_mty_inputscan = _mty_inputscan_sse2;
+	}
+}
+
+#endif /* MULTTY_SIMD_X86 */
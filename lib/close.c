@@ -6,16 +6,27 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 /* Close the MULTTY handle, after flushing any remaining
- * buffer contents.
+ * buffer contents.  The handle returns to its slab.
  *
  * Drop-in replacement for fclose() with FILE changed to MULTTY.
  * Returns 0 on success, else EOF+errno.
  */
 int mtyclose (MULTTY *mty) {
 	int retval = mtyflush (mty);
-	free (mty);
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (mty->flow);
+	if ((flow->wirestream == mty) && !_mty_sticky_end (flow)) {
+		retval = EOF;
+	}
+	_mty_due_drop (mty);
+	_mty_vbuf_drop (mty);
+	_mty_pool_release (mty);
+	free (mty->prefix);
+	free (mty->fullprefix);
+	_mty_pool_unhandle (mty);
 	return retval;
 }
 
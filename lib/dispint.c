@@ -43,10 +43,10 @@ bool mtydispatch_internal (MULTTY *current) {
 	 */
 	//
 	// Read available bytes if the buffer has room
-	if (current->fill < sizeof (current->buf)) {
+	if (current->fill < current->bufsize) {
 		ssize_t extra = read (1,
 				current->buf + current->fill,
-				sizeof (current->buf) - current->fill);
+				current->bufsize - current->fill);
 		if (extra < 0) {
 			//
 			// No idea what is wrong, or what to do
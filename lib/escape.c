@@ -6,6 +6,8 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 /* Check whether escaping is useful for a character under the
  * given escape style.  The style exists to minimise traffic
@@ -59,8 +61,17 @@ bool mtyescapewish (uint32_t style, uint8_t ch) {
  * accidentally or malicuously overtaking <US> or <XXX>.
  */
 bool mtyescapefree (uint32_t style, const uint8_t *ptr, int len) {
+	const bool *table = mtyescape_register (style);
+	if (table == NULL) {
+		while (len-- > 0) {
+			if (mtyescapewish (style, (uint8_t) *ptr++)) {
+				return false;
+			}
+		}
+		return true;
+	}
 	while (len-- > 0) {
-		if (mtyescapewish (style, (uint8_t) *ptr++)) {
+		if (table [*ptr++]) {
 			return false;
 		}
 	}
@@ -84,26 +95,61 @@ bool mtyescapefree (uint32_t style, const uint8_t *ptr, int len) {
  * then allow further use of this function.
  */
 size_t mtyescape (uint32_t style, MULTTY *mty, const uint8_t *ptr, size_t len) {
+	const bool *table = mtyescape_register (style);
 	size_t done = 0;
-	while (len-- > 0) {
+	bool dense = false;
+	//
+	// Attach a buffer from the pool, or grow it for ATOMIC_SEND_MAX
+	if ((len == 0) || !_mty_fitbuf (mty)) {
+		goto stophere;
+	}
+	int bufsize = _mty_atomic_send (_MTY_FLOW (mty->flow));
+	if (bufsize > mty->bufsize) {
+		bufsize = mty->bufsize;
+	}
+	while (done < len) {
 		//
-		// Try to find the room for one more character
-		uint8_t c = *ptr++;
-		bool esc = mtyescapewish (style, c);
-		if (mty->fill + (esc ? 2 : 1) >= sizeof (mty->buf) - 1) {
+		// Find the room that is left before the <SO> overflow position
+		int room = bufsize - 2 - mty->fill;
+		if (room <= 0) {
 			goto stophere;
 		}
 		//
-		// Given the room, place the extra character in the buffer
-		if (esc) {
-			mty->buf [mty->fill++] = c_DLE;
-			mty->buf [mty->fill++] = c ^ 0x40;
+		// Copy the clean run of characters that fits into the buffer
+		size_t run = len - done;
+		if (run > (size_t) room) {
+			run = room;
+		}
+		size_t clean;
+		if (dense && (table != NULL)) {
+			//
+			// Escapes came close together; try a few bytes by hand
+			// before paying for the setup of another vector scan
+			clean = 0;
+			while ((clean < run) && (clean < 16) && !table [ptr [done + clean]]) {
+				clean++;
+			}
+			if (clean == 16) {
+				clean += _mty_escscan (style, ptr + done + 16, run - 16);
+			}
 		} else {
-			mty->buf [mty->fill++] = c;
+			clean = _mty_escscan (style, ptr + done, run);
+		}
+		dense = (clean < 16);
+		memcpy (mty->buf + mty->fill, ptr + done, clean);
+		mty->fill += clean;
+		done += clean;
+		if (clean == run) {
+			continue;
+		}
+		//
+		// Stopped at a character to escape; it needs room for two
+		if (mty->fill + 2 >= bufsize - 1) {
+			goto stophere;
 		}
-		done++;
+		mty->buf [mty->fill++] = c_DLE;
+		mty->buf [mty->fill++] = ptr [done++] ^ 0x40;
 	}
 stophere:
 	return done;
 }
-
@@ -0,0 +1,125 @@
+/* mulTTY -> escape classification tables
+ *
+ * Each escape style is a mask of 32 bits for the control codes,
+ * with <DEL> and <IAC> folded onto <BS> and <NUL>.  Rather than
+ * redoing that folding for each byte, we look up the outcome of
+ * mtyescapewish() in a table of 256 entries.  Tables for the
+ * built-in styles are generated by the compiler; other styles
+ * get their table built when they are registered.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* Tables for the built-in styles, generated at compile time.
+ */
+const MULTTY_ESCTABLE _mty_esctable_multty = MULTTY_ESCTABLE_INIT (MULTTY_ESC_MULTTY);
+const MULTTY_ESCTABLE _mty_esctable_binary = MULTTY_ESCTABLE_INIT (MULTTY_ESC_BINARY);
+const MULTTY_ESCTABLE _mty_esctable_ascii  = MULTTY_ESCTABLE_INIT (MULTTY_ESC_ASCII );
+const MULTTY_ESCTABLE _mty_esctable_mixed  = MULTTY_ESCTABLE_INIT (MULTTY_ESC_MIXED );
+
+
+/* Registered tables for other styles, in a simple list.  There
+ * are not expected to be many, and they are never removed.  New
+ * entries are pushed with a release store, and lookups load the
+ * list with acquire, so a table is complete when it is found.
+ */
+struct multty_escreg {
+	struct multty_escreg *next;
+	uint32_t style;
+	MULTTY_ESCTABLE table;
+};
+static struct multty_escreg *_Atomic _mty_escreg = NULL;
+
+
+/* Find the escape table for a given style in a list of registered
+ * tables, or among the built-in ones.  This leaves errno alone.
+ *
+ * Returns the table, or NULL if the style has none yet.
+ */
+static const bool *_mty_escreg_find (uint32_t style, struct multty_escreg *reg) {
+	switch (style) {
+	case MULTTY_ESC_MULTTY:
+		return _mty_esctable_multty;
+	case MULTTY_ESC_BINARY:
+		return _mty_esctable_binary;
+	case MULTTY_ESC_ASCII:
+		return _mty_esctable_ascii;
+	case MULTTY_ESC_MIXED:
+		return _mty_esctable_mixed;
+	default:
+		break;
+	}
+	for (; reg != NULL; reg = reg->next) {
+		if (reg->style == style) {
+			return reg->table;
+		}
+	}
+	return NULL;
+}
+
+
+/* Find the escape table for a given style.  Tables exist for
+ * the built-in styles MULTTY_ESC_MULTTY, MULTTY_ESC_BINARY,
+ * MULTTY_ESC_ASCII and MULTTY_ESC_MIXED and for any style
+ * that was setup with mtyescape_register().
+ *
+ * The table holds the outcome of mtyescapewish() for each
+ * byte value, so a lookup replaces a call.
+ *
+ * Returns the table on success, or else NULL/errno=ENOENT.
+ */
+const bool *mtyescape_table (uint32_t style) {
+	const bool *table = _mty_escreg_find (style,
+			atomic_load_explicit (&_mty_escreg, memory_order_acquire));
+	if (table == NULL) {
+		errno = ENOENT;
+	}
+	return table;
+}
+
+
+/* Register a custom escape style, so it will have a table
+ * for quick lookups.  This is harmless to do for built-in
+ * styles or styles that were already registered.  Escaping
+ * routines register styles on first use, so doing it up
+ * front only moves the work to a convenient moment.
+ *
+ * Returns the table on success, or else NULL/errno.
+ */
+const bool *mtyescape_register (uint32_t style) {
+	struct multty_escreg *head = atomic_load_explicit (&_mty_escreg, memory_order_acquire);
+	const bool *table = _mty_escreg_find (style, head);
+	if (table != NULL) {
+		return table;
+	}
+	struct multty_escreg *reg = malloc (sizeof (struct multty_escreg));
+	if (reg == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	reg->style = style;
+	int ch;
+	for (ch = 0; ch < 256; ch++) {
+		reg->table [ch] = mtyescapewish (style, ch);
+	}
+	//
+	// Push the table, unless another thread registered it first
+	do {
+		reg->next = head;
+	} while (!atomic_compare_exchange_weak_explicit (&_mty_escreg, &head, reg,
+			memory_order_acq_rel, memory_order_acquire) &&
+		((table = _mty_escreg_find (style, head)) == NULL));
+	if (table != NULL) {
+		free (reg);
+		return table;
+	}
+	return reg->table;
+}
@@ -6,61 +6,138 @@
 
 #include <arpa2/multty.h>
 
-
-/* TODO: How to know if a stream mixes into a multi-program context?
- *       In a single-program context, such as an application, it is
- *       silly to switch to a program at this point.  For mixed
- *       programs it is downright convenient.  At least his set of
- *       declarations cause an error when mixing wrongly.
- */
-
-#ifndef MULTTY_MIXED
-/* Placeholder for mtyp_switch() in absense of program mixing.
- *
- * TODO: Streams may need to claim until they release.
- *
- * Return 0 for success.
- */
-inline int mtyp_switch (MULTTY_PROG *prog) {
-	return 0;
-}
-#endif
+#include "mty-int.h"
 
 
 /* Flush the MULTTY buffer to the output, using atomic
- * sending of up to PIPE_BUF bytes, so no interrupts with
+ * sending of up to ATOMIC_SEND_MAX bytes, so no interrupts with
  * other streams even in a multi-threading program.  Return
- * to the default stream in the same PIPE_BUF atomic unit.
+ * to the default stream in the same atomic unit.  When the
+ * stream is assigned to a program, the switch to it is made
+ * in that same unit too, unless that would not fit.  While the
+ * outflow schedules by program, the switch is left to the queue.
+ * When the outflow uses aliases, the first unit binds one.
+ *
+ * Sticky output, see mtyoutflow_sticky(), stays in the stream
+ * after the unit.  It only shifts to the stream when the output
+ * was elsewhere, and it returns to the default stream before a
+ * switch of program or output to the default stream.
  *
  * The buffer is assumed to already be escaped inasfar as
  * necessary.  This is usually assured by writing into it
  * with mtyescape()
  *
+ * A buffer taken from the pool is returned after sending.
+ *
  * Drop-in replacement for fflush() with FILE changed to MULTTY.
  * Returns 0 on success, else EOF/errno.
  */
 int mtyflush (MULTTY *mty) {
-	int retval = 0;
-	struct iovec io0;
-	io0.iov_base = mty->buf;
-	io0.iov_len  = mty->fill;
+	//
+	// Without a buffer, there is no pending output
+	if (mty->buf == NULL) {
+		return 0;
+	}
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (mty->flow);
+	bool sched = (mty->prog != NULL) && _mty_queue_scheduled (flow);
+	bool sticky = _MTY_STICKY (flow);
+	struct iovec io [MULTTY_SWITCH_IOVS + 3];
+	int ioc = 0;
+	int len = 0;
 	//
 	// If this stream is assigned to a program, switch to it
-	if (mty->prog != NULL) {
-		/*TODO:RETVAL*/
-		mtyp_switch (mty->prog);
+	struct iovec sw [MULTTY_SWITCH_IOVS];
+	int swc = 0;
+	if ((mty->prog != NULL) && !sched) {
+		swc = mtyp_switch_iov (flow, mty->prog, sw);
+		if (swc < 0) {
+			return EOF;
+		}
 	}
 	//
-	// We need to add <SO> to mty->buf for all stream shifters
-	if (mty->shift > 0) {
+	// Sticky output returns to the default stream before a
+	// switch, or before output to the default stream
+	if (sticky && (flow->wirestream != NULL) && ((swc > 0) || (mty->shift == 0))) {
+		io [ioc].iov_base = s_SO;
+		io [ioc].iov_len  = 1;
+		ioc++;
+		len++;
+		flow->wirestream = NULL;
+	}
+	int i;
+	for (i = 0; i < swc; i++) {
+		io [ioc++] = sw [i];
+		len += sw [i].iov_len;
+	}
+	struct iovec *data = &io [ioc];
+	int datac = 1;
+	int datalen = mty->fill;
+	data->iov_base = mty->buf;
+	data->iov_len  = mty->fill;
+	if (sticky && (flow->wirestream == mty)) {
+		//
+		// Sticky output is still in this stream, so skip the shift
+		data->iov_base = mty->buf + mty->shift;
+		data->iov_len  =
+		datalen        = mty->fill - mty->shift;
+	} else if ((mty->shift > 0) && !sticky) {
 		//
 		// Append c_SO; we declared an overflow position in MULTTY
-		mty->buf [io0.iov_len++] = c_SO;
+		mty->buf [datalen++] = c_SO;
+		data->iov_len++;
+	}
+	//
+	// The first unit of a stream may bind an alias for its name
+	char head [MULTTY_ALIAS_HEAD];
+	int headlen = 0;
+	if (data->iov_base == mty->buf) {
+		headlen = _mty_alias_head (mty, flow, datalen, head);
+	}
+	if (headlen > 0) {
+		data [0].iov_base = head;
+		data [0].iov_len  = headlen;
+		data [1].iov_base = mty->buf + 1;
+		data [1].iov_len  = datalen - 1;
+		datalen += headlen - 1;
+		datac = 2;
 	}
-	if (mtyv_out (io0.iov_len, 1, &io0)) {
+	//
+	// A switch that does not fit in the unit is sent before it
+	struct iovec *out = io;
+	bool switched = (mty->prog == NULL) || sched;
+	if ((ioc > 0) && !flow->exclusive &&
+			(len + datalen > _mty_atomic_send (flow))) {
+		if (!mtyv_outflow (flow, len, ioc, io)) {
+			return EOF;
+		}
+		mtyp_switch_commit (flow, mty->prog);
+		switched = true;
+		out = data;
+		ioc = 0;
+		len = 0;
+	}
+	len += datalen;
+	bool ok = (len == 0) || (sched
+		? _mty_queue_out (flow, mty->prog, len, datac, data)
+		: mtyv_outflow (flow, len, ioc + datac, out));
+	if (ok) {
+		//
+		// The program switch took effect with the data
+		if (!switched) {
+			mtyp_switch_commit (flow, mty->prog);
+		}
 		//
-		// Reset to the shift prefix, not to an empty buffer
-		mty->fill = mty->shift;
+		// Sticky output stays in this stream
+		if (sticky && (mty->shift > 0)) {
+			flow->wirestream = mty;
+		}
+		//
+		// Reset to the shift prefix, and return a pooled buffer
+		_mty_due_drop (mty);
+		_mty_pool_release (mty);
+		if (headlen > 0) {
+			_mty_alias_commit (mty, head, headlen);
+		}
 		return 0;
 	} else {
 		//
@@ -68,4 +145,3 @@ int mtyflush (MULTTY *mty) {
 		return EOF;
 	}
 }
-
@@ -0,0 +1,444 @@
+/* mulTTY -> internal include file for streams and escaping
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef MULTTY_INTERNAL_H
+#define MULTTY_INTERNAL_H
+
+
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <arpa2/multty.h>
+
+
+/* Compile-time construction of a MULTTY_ESCTABLE for a constant
+ * style, with the same outcome as mtyescapewish() for each byte.
+ * The shift is masked to keep the compiler quiet about branches
+ * that are never taken.
+ */
+#define _MTY_ESCWISH(s,c) ( \
+	((c) == 0x7f) ? ((((s) >> 0x08) & 1) != 0) : \
+	((c) == 0xff) ? ((((s) >> 0x00) & 1) != 0) : \
+	((c) <  0x20) ? ((((s) >> ((c) & 0x1f)) & 1) != 0) : false )
+#define _MTY_ESCWISH4(s,c) \
+	_MTY_ESCWISH (s, (c)+0), _MTY_ESCWISH (s, (c)+1), \
+	_MTY_ESCWISH (s, (c)+2), _MTY_ESCWISH (s, (c)+3)
+#define _MTY_ESCWISH16(s,c) \
+	_MTY_ESCWISH4 (s, (c)+0x0), _MTY_ESCWISH4 (s, (c)+0x4), \
+	_MTY_ESCWISH4 (s, (c)+0x8), _MTY_ESCWISH4 (s, (c)+0xc)
+#define MULTTY_ESCTABLE_INIT(s) { \
+	_MTY_ESCWISH16 (s, 0x00), _MTY_ESCWISH16 (s, 0x10), \
+	_MTY_ESCWISH16 (s, 0x20), _MTY_ESCWISH16 (s, 0x30), \
+	_MTY_ESCWISH16 (s, 0x40), _MTY_ESCWISH16 (s, 0x50), \
+	_MTY_ESCWISH16 (s, 0x60), _MTY_ESCWISH16 (s, 0x70), \
+	_MTY_ESCWISH16 (s, 0x80), _MTY_ESCWISH16 (s, 0x90), \
+	_MTY_ESCWISH16 (s, 0xa0), _MTY_ESCWISH16 (s, 0xb0), \
+	_MTY_ESCWISH16 (s, 0xc0), _MTY_ESCWISH16 (s, 0xd0), \
+	_MTY_ESCWISH16 (s, 0xe0), _MTY_ESCWISH16 (s, 0xf0) }
+
+
+/* The maximum number of iovec entries for one atomic unit.
+ * A unit may end early to stay within this limit.  When the
+ * output is owned exclusively, units are gathered in batches
+ * of up to MULTTY_BATCH_IOVS entries for a single writev().
+ */
+#define MULTTY_UNIT_IOVS 256
+#if defined (IOV_MAX) && (IOV_MAX < 1024)
+#define MULTTY_BATCH_IOVS IOV_MAX
+#else
+#define MULTTY_BATCH_IOVS 1024
+#endif
+
+
+/* The tables for built-in styles, generated at compile time.
+ * These are also returned by mtyescape_table() for the styles.
+ */
+extern const MULTTY_ESCTABLE _mty_esctable_multty;
+extern const MULTTY_ESCTABLE _mty_esctable_binary;
+extern const MULTTY_ESCTABLE _mty_esctable_ascii;
+extern const MULTTY_ESCTABLE _mty_esctable_mixed;
+
+
+/* Scan a byte string for the first character that wants to be
+ * escaped under the given style, so the clean run before it
+ * can be copied in bulk.  This is a function pointer, set at
+ * load time to the fastest kernel the CPU supports (AVX2,
+ * SSE2 or plain C) and it gives the same answer for each.
+ *
+ * Returns the offset of the first escapable character, or
+ * len when no character in the string needs escaping.
+ */
+extern size_t (*_mty_escscan) (uint32_t style, const uint8_t *ptr, size_t len);
+
+
+/* Scan escaped input for the first <SOH>, which ends the part
+ * that mtyinputsize() reports, and add the number of <DLE>
+ * characters before it to *dles.  Selected at load time, just
+ * like _mty_escscan().
+ *
+ * Returns the offset of the first <SOH>, or len if none.
+ */
+extern size_t (*_mty_inputscan) (const uint8_t *ptr, size_t len, size_t *dles);
+
+
+/* Scan input for the first byte that the parser must look at:
+ * a control code whose bit is set in ctlset, or <DLE>, <DEL>
+ * or 0xff.  Plain text in between can be skipped in bulk.
+ * Selected at load time, just like _mty_escscan().
+ *
+ * Returns the offset of the first such byte, or len if none.
+ */
+extern size_t (*_mty_ctlscan) (uint32_t ctlset, const uint8_t *ptr, size_t len);
+
+
+/* INTERNAL ROUTINE to escape data from an iovec array and send
+ * it to a MULTTY stream, without copying it into the buffer.
+ * Any data already in the buffer is flushed first, to keep the
+ * order of the stream intact.
+ *
+ * The output is cut into atomic units of at most ATOMIC_SEND_MAX,
+ * each with the stream's shift prefix and return to the default.
+ * A switch to the stream's program starts the first unit, or
+ * it is left to the queue while scheduling by program.
+ * When the output is owned exclusively, many units are sent
+ * together in one batch.
+ *
+ * Returns the number of bytes consumed from iov on success,
+ * or else -1/errno when nothing could be sent.
+ */
+ssize_t _mty_escwritev (uint32_t style, MULTTY *mty,
+			const struct iovec *iov, int iovcnt);
+
+
+/* A unit in the coalescing queue, as recorded while scheduling
+ * by program.  Units without a program are sent where they are.
+ */
+struct multty_qunit {
+	MULTTY_PROG *prog;
+	int ofs;
+	int len;
+};
+
+
+/* The function that sends the queue while scheduling by program,
+ * see mtyp_schedule().  It is called while the queue is locked,
+ * and may append a unit that is too large for the queue.
+ *
+ * Returns true on success, or false/errno.
+ */
+typedef bool _mty_scheduler (MULTTY_OUTFLOW *flow, MULTTY_PROG *opt_prog,
+			int len, int ioc, const struct iovec *iov);
+
+
+/* The coalescing queue of an outflow, see mtycoalesce().  The
+ * mutex is needed because handles in different threads share
+ * the queue.  The buffer is allocated when coalescing starts.
+ * While scheduling by program, units are also recorded.
+ */
+#define MULTTY_QUEUE_UNITS 256
+struct multty_queue {
+	pthread_mutex_t mutex;
+	bool enabled;
+	unsigned latency_usec;
+	struct timespec deadline;
+	int fill;
+	int bufsize;
+	uint8_t *buf;
+	_mty_scheduler *scheduler;	/* sends by program, if not NULL */
+	int numunits;
+	struct multty_qunit *units;	/* MULTTY_QUEUE_UNITS when scheduling */
+};
+
+
+/* Fill out the opaque type for an outflow.  The output is owned
+ * exclusively when set with mtyoutflow_exclusive(); atomic units
+ * may then be gathered into larger writes.
+ */
+struct multty_outflow {
+	int outfd;
+	int send_max;	/* ATOMIC_SEND_MAX, or 0 until detected */
+	bool exclusive;
+	MULTTY *stdstream;
+	MULTTY_PROGSET *progset;
+	struct multty_queue queue;
+	bool aliases;	/* bind names to numbers, see mtyoutflow_aliases() */
+	_Atomic unsigned nextalias;
+	bool sticky;	/* stay in streams, see mtyoutflow_sticky() */
+	MULTTY *wirestream;	/* stream that sticky output is in, or NULL */
+	MULTTY *duelist;	/* buffered output by deadline, under queue.mutex */
+	int timerfd;	/* expires for duelist, or -1 */
+};
+
+
+/* The longest head <SOH>#N= that binds an alias, for 32-bit N.
+ */
+#define MULTTY_ALIAS_HEAD 16
+
+
+/* A ring of records from a single producer thread to a single
+ * consumer thread.  Each offset is written by one side only, so
+ * no lock is taken while the ring is neither empty nor full.  A
+ * side that must wait sleeps on the condition, which the other
+ * side only signals when it sees it waiting.
+ */
+struct multty_spsc {
+	_Alignas (64) _Atomic unsigned head;	/* written by the consumer */
+	_Alignas (64) _Atomic unsigned tail;	/* written by the producer */
+	_Alignas (64) _Atomic bool waiting;
+	unsigned size;	/* power of two */
+	uint8_t *buf;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+
+/* The outflow for a handle or program set, where NULL stands
+ * for the standard outflow.
+ */
+#define _MTY_FLOW(f) (((f) != NULL) ? (f) : MULTTY_OUTFLOW_STDOUT)
+
+
+/* Whether output to an outflow may stay in a stream between units.
+ * This needs exclusive output, and units that are not reordered.
+ */
+#define _MTY_STICKY(f) ((f)->sticky && (f)->exclusive && !_mty_queue_scheduled (f))
+
+
+/* INTERNAL ROUTINE to write all bytes in an iovec array, for an
+ * output that is owned exclusively.  Short writes are continued,
+ * interrupts retried and a non-blocking output is waited for,
+ * so the data is never cut off halfway a unit.  Writing stops
+ * at the end of the array, even if len promised more.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_writev_all (int fd, int len, int ioc, const struct iovec *iov);
+
+
+/* INTERNAL ROUTINE for sending an iovec array to an outflow as
+ * in mtyv_outflow(), but bypassing the coalescing queue.
+ *
+ * Returns true on succes, or false/errno.
+ */
+bool _mty_vout_direct (MULTTY_OUTFLOW *flow, int len, int ioc, const struct iovec *iov);
+
+
+/* Test if coalescing is enabled, see mtycoalesce().
+ */
+bool _mty_queue_enabled (MULTTY_OUTFLOW *flow);
+
+
+/* Test if coalescing is enabled and schedules by program, see
+ * mtyp_schedule().  Output for a program then goes into the queue
+ * without the switch to its program.
+ */
+bool _mty_queue_scheduled (MULTTY_OUTFLOW *flow);
+
+
+/* INTERNAL ROUTINE to send a complete unit through the queue.
+ * Small units are copied into the queue, larger ones are sent
+ * directly after what was queued before them.  While scheduling,
+ * a unit may be for a program, and its switch is made later.
+ * When coalescing was disabled after the quick test, the unit
+ * is sent directly.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_queue_out (MULTTY_OUTFLOW *flow, MULTTY_PROG *opt_prog,
+			int len, int ioc, const struct iovec *iov);
+
+
+/* INTERNAL ROUTINE to escape data from an iovec array into the
+ * buffer of a MULTTY handle, for its buffering mode.
+ *
+ * Returns the number of bytes consumed from iov on success,
+ * or else -1/errno when nothing could be buffered.
+ */
+ssize_t _mty_vbufwritev (uint32_t style, MULTTY *mty,
+			const struct iovec *iov, int iovcnt);
+
+
+/* INTERNAL ROUTINE to remove a handle from the list of handles
+ * that are due on its outflow, after its output was sent.
+ */
+void _mty_due_drop (MULTTY *mty);
+
+
+/* INTERNAL ROUTINE to stop buffering for a MULTTY handle that is
+ * closed, after its output was sent.
+ */
+void _mty_vbuf_drop (MULTTY *mty);
+
+
+/* INTERNAL ROUTINE to return the output of an outflow to the
+ * default stream, when sticky output left it in another stream.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_sticky_end (MULTTY_OUTFLOW *flow);
+
+
+/* INTERNAL ROUTINE to take a new alias number for an outflow.
+ * Numbers are never reused, and they start at 1.
+ */
+unsigned _mty_alias_next (MULTTY_OUTFLOW *flow);
+
+
+/* INTERNAL ROUTINE to bind an alias for the stream of a MULTTY
+ * handle in the next unit that it sends.  Returns the length of
+ * the head <SOH>#N= that replaces the <SOH> of the prefix, or
+ * 0 to send the prefix as it is.  The unitlen is used to keep
+ * the unit within ATOMIC_SEND_MAX.
+ */
+int _mty_alias_head (MULTTY *mty, MULTTY_OUTFLOW *flow, int unitlen,
+			char head [MULTTY_ALIAS_HEAD]);
+
+
+/* INTERNAL ROUTINE to take the alias in the head as the prefix
+ * of a MULTTY handle, once the unit that binds it was sent.
+ */
+void _mty_alias_commit (MULTTY *mty, const char *head, int headlen);
+
+
+/* INTERNAL ROUTINE to return a MULTTY handle to its <SOH>name<SO>
+ * prefix, because its alias is not known where it is going.
+ */
+void _mty_alias_drop (MULTTY *mty);
+
+
+/* INTERNAL ROUTINE to detect a suitable atomic unit size for a
+ * file descriptor.  Regular files get MULTTY_ATOMIC_MAX, and
+ * datagram and sequential packet sockets get up to that, as
+ * far as their address family and send buffer allow; pipes,
+ * stream sockets, terminals and anything unknown get PIPE_BUF.
+ */
+int _mty_atomic_detect (int fd);
+
+
+/* INTERNAL ROUTINE to test if a file descriptor is a datagram or
+ * sequential packet socket.  Every read takes one packet, and
+ * whatever does not fit in the buffer is lost.
+ */
+bool _mty_atomic_packets (int fd);
+
+
+/* INTERNAL ROUTINE to get the ATOMIC_SEND_MAX for an outflow,
+ * detecting it on first use.
+ */
+int _mty_atomic_send (MULTTY_OUTFLOW *flow);
+
+
+/* INTERNAL ROUTINE to allocate a handle from a slab, without
+ * a buffer.  The handle is cleared.
+ *
+ * Returns the handle on success, or NULL/errno.
+ */
+MULTTY *_mty_pool_handle (void);
+
+
+/* INTERNAL ROUTINE to return a handle to its slab.  Any buffer
+ * must have been released.
+ */
+void _mty_pool_unhandle (MULTTY *mty);
+
+
+/* INTERNAL ROUTINE to make sure that a MULTTY handle has a buffer
+ * that can hold a complete unit of ATOMIC_SEND_MAX bytes for its
+ * outflow.  A buffer is taken from the pool when none is attached
+ * or when the one attached is too small.  The content is kept, or
+ * setup from the shift prefix when no buffer was attached.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_fitbuf (MULTTY *mty);
+
+
+/* INTERNAL ROUTINE to return the buffer of a MULTTY handle to
+ * its pool, dropping any content after the shift prefix.  This
+ * is done after a flush.  Buffers that are not from a pool stay
+ * attached.
+ */
+void _mty_pool_release (MULTTY *mty);
+
+
+/* INTERNAL ROUTINE to dispatch an input read event for an inflow,
+ * as multty_vin_dispatch() does, but reporting the read.
+ *
+ * Returns the number of bytes read, 0 at the end of input,
+ * or else -1/errno, which is EAGAIN when non-blocking and
+ * ENOBUFS while queued streams are full.
+ */
+ssize_t _mty_inflow_dispatch (MULTTY_INFLOW *flow);
+
+
+/* INTERNAL ROUTINE to get the file descriptor of an inflow.
+ */
+int _mty_inflow_fd (MULTTY_INFLOW *flow);
+
+
+/* INTERNAL ROUTINE to setup a ring of size bytes, a power of two,
+ * for records of up to half of that.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_spsc_init (struct multty_spsc *ring, unsigned size);
+
+
+/* INTERNAL ROUTINE to cleanup a ring.
+ */
+void _mty_spsc_fini (struct multty_spsc *ring);
+
+
+/* INTERNAL ROUTINE for the producer to reserve a record of len
+ * bytes.  This waits while the ring is full.
+ *
+ * Returns the record to fill, aligned for any structure.
+ */
+void *_mty_spsc_reserve (struct multty_spsc *ring, unsigned len);
+
+
+/* INTERNAL ROUTINE for the producer to pass the record reserved
+ * with the same len to the consumer.
+ */
+void _mty_spsc_commit (struct multty_spsc *ring, unsigned len);
+
+
+/* INTERNAL ROUTINE for the consumer to get the next record.  This
+ * waits while the ring is empty.
+ *
+ * Returns the record and sets its len.
+ */
+void *_mty_spsc_peek (struct multty_spsc *ring, unsigned *len);
+
+
+/* INTERNAL ROUTINE for the consumer to return a record with its
+ * len to the producer.
+ */
+void _mty_spsc_release (struct multty_spsc *ring, unsigned len);
+
+
+/* INTERNAL ROUTINE for the producer to wait until the consumer
+ * returned all records, so it is done with what they refer to.
+ */
+void _mty_spsc_drain (struct multty_spsc *ring);
+
+
+/* INTERNAL ROUTINE to test if full queues stop an inflow from
+ * reading, see mtyregister_queue().
+ */
+bool _mty_inflow_backlog (MULTTY_INFLOW *flow);
+
+
+/* INTERNAL ROUTINE to set a function that is called when an
+ * inflow may read again, after mtyread() drained the queues
+ * that stopped it.  Use NULL to remove it.
+ */
+void _mty_inflow_onresume (MULTTY_INFLOW *flow,
+			void (*resume) (void *resumedata), void *resumedata);
+
+
+#endif /* MULTTY_INTERNAL_H */
@@ -16,6 +16,11 @@ struct multty_prog {
 	MULTTY_PROGSET *set;
 	// descr points to a varying description if <US> was added
 	const char *descr;
+	// alias <SOH>#N= and its length, aliased when bound, see
+	// mtyoutflow_aliases()
+	char alias [14];
+	uint8_t aliaslen;
+	bool aliased;
 	// hash table data
 	UT_hash_handle hh;
 };
@@ -28,5 +33,9 @@ struct multty_progset {
 	struct multty_prog *programs;
 	// the current and previous programs for this set
 	struct multty_prog *current, *previous;
+	// the outflow for program switches, NULL for stdout
+	MULTTY_OUTFLOW *flow;
+	// switch bytes saved by mtyp_schedule()
+	long switch_saved;
 };
 
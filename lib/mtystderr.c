@@ -10,9 +10,16 @@
 #include <arpa2/multty.h>
 
 
+static uint8_t multty_stderr_buf [PIPE_BUF] = {
+	c_SOH, 's', 't', 'd', 'e', 'r', 'r', c_SO
+};
+
 struct multty multty_stderr = {
 	.shift = 8,
 	.fill  = 8,
-	.buf = { c_SOH, 's', 't', 'd', 'e', 'r', 'r', c_SO },
+	.bufsize = PIPE_BUF,
+	.vbufmode = _IONBF,
+	.buf = multty_stderr_buf,
+	.prefix = multty_stderr_buf,
 };
 
@@ -10,8 +10,13 @@
 #include <arpa2/multty.h>
 
 
+static uint8_t multty_stdin_buf [PIPE_BUF];
+
 struct multty multty_stdin = {
 	.shift = 0,
 	.fill  = 0,
+	.bufsize = PIPE_BUF,
+	.vbufmode = _IONBF,
+	.buf = multty_stdin_buf,
 };
 
@@ -11,6 +11,8 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 /* Open a MULTTY handle, and redirect it to stdout.
  *
@@ -23,7 +25,8 @@
  */
 MULTTY *mtyopen (const char *streamname, const char *mode) {
 	int streamnamelen = strlen (streamname);
-	if (2 + streamnamelen >= PIPE_BUF / 4) {
+	int bufsize = _mty_atomic_send (MULTTY_OUTFLOW_STDOUT);
+	if (2 + streamnamelen >= bufsize / 4) {
 		errno = EINVAL;
 		return NULL;
 	}
@@ -31,15 +34,30 @@ MULTTY *mtyopen (const char *streamname, const char *mode) {
 		errno = EINVAL;
 		return NULL;
 	}
-	struct multty *retval = malloc (sizeof (struct multty));
+	struct multty *retval = _mty_pool_handle ();
 	if (retval == NULL) {
 		return NULL;
 	}
-	memset (retval, 0, sizeof (struct multty));
+	//
+	// Escape the stream shift in a pooled buffer, then keep a copy
+	if (!_mty_fitbuf (retval)) {
+		goto fail;
+	}
 	retval->buf [retval->fill++] = c_SOH;
-	mtyescape (MULTTY_ESC_ASCII, retval, streamname, streamnamelen);
+	mtyescape (MULTTY_ESC_ASCII, retval, (const uint8_t *) streamname, streamnamelen);
 	retval->buf [retval->fill++] = c_SO;
 	retval->shift = retval->fill;
+	retval->prefix = malloc (retval->shift);
+	if (retval->prefix == NULL) {
+		errno = ENOMEM;
+		goto fail;
+	}
+	memcpy (retval->prefix, retval->buf, retval->shift);
+	_mty_pool_release (retval);
 	return retval;
+fail:
+	_mty_pool_release (retval);
+	_mty_pool_unhandle (retval);
+	return NULL;
 }
 
@@ -0,0 +1,130 @@
+/* mulTTY -> output flows, each for one mulTTY connection
+ *
+ * Output used to go to stdout only.  An outflow holds what is
+ * specific to one connection: its file descriptor, its limit
+ * ATOMIC_SEND_MAX, its coalescing queue, the program set for
+ * switching programs and the handle for its default stream.
+ * This allows one process to serve many connections.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* The standard outflow, for stdout.  Handles that are not bound
+ * to an outflow, including the pre-opened ones, send here.
+ */
+struct multty_outflow multty_outflow_stdout = {
+	.outfd = 1,
+	.stdstream = &multty_stdout,
+	.queue.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.timerfd = -1,
+};
+
+
+/* Open an outflow for a given file descriptor, to send
+ * a separate mulTTY connection than MULTTY_OUTFLOW_STDOUT.
+ * The outflow has its own ATOMIC_SEND_MAX, detected from
+ * the file descriptor, and its own settings for exclusive
+ * output and coalescing.  It also has its own handle for
+ * the default stream, see mtyoutflow_stdout().
+ *
+ * The file descriptor remains owned by the caller, but it
+ * is closed when output is found to be inconsistent.
+ *
+ * Returns non-NULL pointer or NULL/errno.
+ */
+MULTTY_OUTFLOW *mtyoutflow (int outfd) {
+	if (outfd < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	MULTTY_OUTFLOW *retval = malloc (sizeof (MULTTY_OUTFLOW));
+	if (retval == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset (retval, 0, sizeof (MULTTY_OUTFLOW));
+	retval->outfd = outfd;
+	retval->timerfd = -1;
+	//
+	// The default stream needs no shift, and gets a buffer when used
+	retval->stdstream = _mty_pool_handle ();
+	if (retval->stdstream == NULL) {
+		free (retval);
+		return NULL;
+	}
+	retval->stdstream->flow = retval;
+	pthread_mutex_init (&retval->queue.mutex, NULL);
+	return retval;
+}
+
+
+/* Close an outflow, after sending any output that it holds.
+ * Handles that are bound to it should be closed first.  The
+ * file descriptor is not closed.  Closing the standard outflow
+ * only sends what it holds.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_close (MULTTY_OUTFLOW *flow) {
+	int retval = mtyflush (flow->stdstream);
+	if (!_mty_sticky_end (flow)) {
+		retval = EOF;
+	}
+	if (mtyoutflow_sync (flow) != 0) {
+		retval = EOF;
+	}
+	if (flow == MULTTY_OUTFLOW_STDOUT) {
+		return retval;
+	}
+	_mty_pool_release (flow->stdstream);
+	_mty_pool_unhandle (flow->stdstream);
+	if (flow->timerfd >= 0) {
+		close (flow->timerfd);
+	}
+	free (flow->queue.buf);
+	free (flow->queue.units);
+	pthread_mutex_destroy (&flow->queue.mutex);
+	free (flow);
+	return retval;
+}
+
+
+/* Return the handle for the default stream of an outflow.
+ * This is MULTTY_STDOUT for MULTTY_OUTFLOW_STDOUT.  Output
+ * to the default stream needs no stream shifting.
+ */
+MULTTY *mtyoutflow_stdout (MULTTY_OUTFLOW *flow) {
+	return flow->stdstream;
+}
+
+
+/* Bind a MULTTY handle to an outflow, so its output will be
+ * sent there.  Any buffered output is first sent to the
+ * outflow that the handle was bound to before.  An alias
+ * for the stream is not taken along.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_bind (MULTTY *mty, MULTTY_OUTFLOW *flow) {
+	if ((mty->fill > mty->shift) && (mtyflush (mty) != 0)) {
+		return EOF;
+	}
+	MULTTY_OUTFLOW *oldflow = _MTY_FLOW (mty->flow);
+	if ((oldflow->wirestream == mty) && !_mty_sticky_end (oldflow)) {
+		return EOF;
+	}
+	if (oldflow != _MTY_FLOW (flow)) {
+		_mty_pool_release (mty);
+		_mty_alias_drop (mty);
+	}
+	mty->flow = (flow != MULTTY_OUTFLOW_STDOUT) ? flow : NULL;
+	return 0;
+}
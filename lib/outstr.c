@@ -8,6 +8,8 @@
 
 #include <errno.h>
 
+#include "mty-int.h"
+
 
 /* Open an MULTTY stream for output under the given stream
  * name.  TODO: Output is always shift-out based, using
@@ -40,23 +42,33 @@
  */
 MULTTY *mtyoutstream (const char *streamname) {
 	int nmlen = strlen (streamname);
-	if (!mtyescapefree (MULTTY_ESC_BINARY, streamname, nmlen)) {
+	if (!mtyescapefree (MULTTY_ESC_BINARY, (const uint8_t *) streamname, nmlen)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	int bufsize = _mty_atomic_send (MULTTY_OUTFLOW_STDOUT);
+	if (2 + nmlen >= bufsize / 4) {
 		errno = EINVAL;
 		return NULL;
 	}
-	MULTTY *mty = malloc (sizeof (MULTTY) + strlen (streamname) + 1);
+	MULTTY *mty = _mty_pool_handle ();
 	if (mty == NULL) {
+		return NULL;
+	}
+	mty->prefix = malloc (2 + nmlen);
+	if (mty->prefix == NULL) {
+		_mty_pool_unhandle (mty);
 		errno = ENOMEM;
 		return NULL;
 	}
-	memset (mty, 0, sizeof (MULTTY));
 	/* Insert a shift statement at the start */
 	/* Note: MULTTY_STDOUT and MULTTY_STDIN don't have this */
-	mty->buf [0] = c_SOH;
-	memcpy (mty->buf + 1, streamname, nmlen);
-	mty->buf [1 + nmlen] = c_SO;
+	mty->prefix [0] = c_SOH;
+	memcpy (mty->prefix + 1, streamname, nmlen);
+	mty->prefix [1 + nmlen] = c_SO;
 	mty->shift = 2 + nmlen;
-	/* Always start buffer filling after the shift */
+	/* Always start buffer filling after the shift; the buffer
+	 * itself is only attached while output is pending */
 	mty->fill = mty->shift;
 	/* Setup for reading as well */
 	mty->got_dle = false;
@@ -0,0 +1,266 @@
+/* mulTTY -> pooled handles and lazily attached buffers
+ *
+ * Multiplexers may hold many streams that are mostly idle.
+ * Rather than giving each handle its own buffer, handles come
+ * from slabs and a buffer is only attached while output is
+ * pending.  After a flush it returns to a pool, shared by all
+ * handles that need the same ATOMIC_SEND_MAX.  An idle handle
+ * costs its structure plus its <SOH>name<SO> prefix.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+#include <pthread.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* Handles are allocated in slabs of this many.  Slabs are never
+ * returned to the system, but their handles are reused.
+ */
+#define MULTTY_SLAB_HANDLES 64
+
+
+/* A slab of handles.  Free handles are linked through their
+ * next field.
+ */
+struct multty_slab {
+	struct multty_slab *next;
+	struct multty handles [MULTTY_SLAB_HANDLES];
+};
+
+
+/* A pool of buffers of one size.  Idle buffers are linked
+ * through their first bytes.  Pools are never removed.
+ */
+struct multty_bufpool {
+	struct multty_bufpool *next;
+	int bufsize;
+	unsigned busy;
+	unsigned idle;
+	void *free;
+};
+
+
+/* The slabs and pools, all under one mutex.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	unsigned idle_max;
+	struct multty_slab *slabs;
+	struct multty *free;
+	unsigned busy;
+	unsigned idle;
+	struct multty_bufpool *pools;
+} _mty_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.idle_max = MULTTY_POOL_IDLE,
+};
+
+
+/* INTERNAL ROUTINE to allocate a handle from a slab, without
+ * a buffer.  The handle is cleared.
+ *
+ * Returns the handle on success, or NULL/errno.
+ */
+MULTTY *_mty_pool_handle (void) {
+	pthread_mutex_lock (&_mty_pool.mutex);
+	if (_mty_pool.free == NULL) {
+		struct multty_slab *slab = malloc (sizeof (struct multty_slab));
+		if (slab == NULL) {
+			pthread_mutex_unlock (&_mty_pool.mutex);
+			errno = ENOMEM;
+			return NULL;
+		}
+		slab->next = _mty_pool.slabs;
+		_mty_pool.slabs = slab;
+		int i;
+		for (i = 0; i < MULTTY_SLAB_HANDLES; i++) {
+			slab->handles [i].next = _mty_pool.free;
+			_mty_pool.free = &slab->handles [i];
+		}
+		_mty_pool.idle += MULTTY_SLAB_HANDLES;
+	}
+	MULTTY *mty = _mty_pool.free;
+	_mty_pool.free = mty->next;
+	_mty_pool.idle--;
+	_mty_pool.busy++;
+	pthread_mutex_unlock (&_mty_pool.mutex);
+	memset (mty, 0, sizeof (MULTTY));
+	mty->vbufmode = _IONBF;
+	return mty;
+}
+
+
+/* INTERNAL ROUTINE to return a handle to its slab.  Any buffer
+ * must have been released.
+ */
+void _mty_pool_unhandle (MULTTY *mty) {
+	pthread_mutex_lock (&_mty_pool.mutex);
+	mty->next = _mty_pool.free;
+	_mty_pool.free = mty;
+	_mty_pool.busy--;
+	_mty_pool.idle++;
+	pthread_mutex_unlock (&_mty_pool.mutex);
+}
+
+
+/* Find the pool for a buffer size, while locked.  The pool is
+ * added when it does not exist yet.
+ *
+ * Returns the pool on success, or NULL/errno.
+ */
+static struct multty_bufpool *_mty_pool_find (int bufsize) {
+	struct multty_bufpool *pool;
+	for (pool = _mty_pool.pools; pool != NULL; pool = pool->next) {
+		if (pool->bufsize == bufsize) {
+			return pool;
+		}
+	}
+	pool = malloc (sizeof (struct multty_bufpool));
+	if (pool == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset (pool, 0, sizeof (struct multty_bufpool));
+	pool->bufsize = bufsize;
+	pool->next = _mty_pool.pools;
+	_mty_pool.pools = pool;
+	return pool;
+}
+
+
+/* INTERNAL ROUTINE to make sure that a MULTTY handle has a buffer
+ * that can hold a complete unit of ATOMIC_SEND_MAX bytes for its
+ * outflow.  A buffer is taken from the pool when none is attached
+ * or when the one attached is too small.  The content is kept, or
+ * setup from the shift prefix when no buffer was attached.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_fitbuf (MULTTY *mty) {
+	int send_max = _mty_atomic_send (_MTY_FLOW (mty->flow));
+	if ((mty->buf != NULL) && (mty->bufsize >= send_max)) {
+		return true;
+	}
+	pthread_mutex_lock (&_mty_pool.mutex);
+	struct multty_bufpool *pool = _mty_pool_find (send_max);
+	uint8_t *newbuf = NULL;
+	if (pool == NULL) {
+		;
+	} else if (pool->free != NULL) {
+		newbuf = pool->free;
+		pool->free = *(void **) newbuf;
+		pool->idle--;
+		pool->busy++;
+	} else if ((newbuf = malloc (send_max)) != NULL) {
+		pool->busy++;
+	} else {
+		errno = ENOMEM;
+	}
+	pthread_mutex_unlock (&_mty_pool.mutex);
+	if (newbuf == NULL) {
+		return false;
+	}
+	int fill = mty->shift;
+	if (mty->buf != NULL) {
+		fill = mty->fill;
+		memcpy (newbuf, mty->buf, fill);
+		_mty_pool_release (mty);
+	} else {
+		memcpy (newbuf, mty->prefix, mty->shift);
+	}
+	mty->buf = newbuf;
+	mty->bufsize = send_max;
+	mty->bufpool = true;
+	mty->fill = fill;
+	return true;
+}
+
+
+/* INTERNAL ROUTINE to return the buffer of a MULTTY handle to
+ * its pool, dropping any content after the shift prefix.  This
+ * is done after a flush.  Buffers that are not from a pool stay
+ * attached.
+ */
+void _mty_pool_release (MULTTY *mty) {
+	if (!mty->bufpool) {
+		mty->fill = mty->shift;
+		return;
+	}
+	pthread_mutex_lock (&_mty_pool.mutex);
+	struct multty_bufpool *pool = _mty_pool_find (mty->bufsize);
+	if (pool == NULL) {
+		;
+	} else if (pool->idle < _mty_pool.idle_max) {
+		*(void **) mty->buf = pool->free;
+		pool->free = mty->buf;
+		pool->busy--;
+		pool->idle++;
+	} else {
+		free (mty->buf);
+		pool->busy--;
+	}
+	pthread_mutex_unlock (&_mty_pool.mutex);
+	mty->buf = NULL;
+	mty->bufsize = 0;
+	mty->bufpool = false;
+	mty->fill = mty->shift;
+}
+
+
+/* Set the number of idle buffers that each pool keeps for reuse.
+ * Buffers beyond this number are freed when they are released,
+ * and idle buffers beyond it are freed right away.  The default
+ * is MULTTY_POOL_IDLE.  A value of 0 frees buffers after every
+ * flush, which is cheapest for memory but not for time.
+ */
+void mtypool_setsize (unsigned idle_max) {
+	pthread_mutex_lock (&_mty_pool.mutex);
+	_mty_pool.idle_max = idle_max;
+	struct multty_bufpool *pool;
+	for (pool = _mty_pool.pools; pool != NULL; pool = pool->next) {
+		while (pool->idle > idle_max) {
+			void *buf = pool->free;
+			pool->free = *(void **) buf;
+			pool->idle--;
+			free (buf);
+		}
+	}
+	pthread_mutex_unlock (&_mty_pool.mutex);
+}
+
+
+/* Report the usage of the pools.  The first entry describes the
+ * handles, with the size of a handle.  The other entries describe
+ * one buffer pool each, with its buffer size.  Up to maxpools
+ * entries are filled.
+ *
+ * Returns the number of entries that are available, which may
+ * be more than maxpools.
+ */
+int mtypool_usage (struct multty_poolusage *usage, int maxpools) {
+	int count = 0;
+	pthread_mutex_lock (&_mty_pool.mutex);
+	if (count < maxpools) {
+		usage [count].size = sizeof (MULTTY);
+		usage [count].busy = _mty_pool.busy;
+		usage [count].idle = _mty_pool.idle;
+	}
+	count++;
+	struct multty_bufpool *pool;
+	for (pool = _mty_pool.pools; pool != NULL; pool = pool->next) {
+		if (count < maxpools) {
+			usage [count].size = pool->bufsize;
+			usage [count].busy = pool->busy;
+			usage [count].idle = pool->idle;
+		}
+		count++;
+	}
+	pthread_mutex_unlock (&_mty_pool.mutex);
+	return count;
+}
@@ -0,0 +1,37 @@
+/* mulTTY -> bind a program set to an outflow
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+#include "mtyp-int.h"
+
+
+/* Bind a program set to an outflow, so program switches
+ * are sent there.  Program sets are bound to the standard
+ * outflow until this is called.  Each outflow has its own
+ * current and previous program, so each should have its
+ * own program set.  When the set moves to another outflow,
+ * its programs lose their aliases and the next switch is
+ * sent in full.
+ */
+void mtyp_bind (MULTTY_PROGSET *progset, MULTTY_OUTFLOW *flow) {
+	flow = _MTY_FLOW (flow);
+	//
+	// Program aliases and the current and previous program
+	// are not known at another outflow
+	if (_MTY_FLOW (progset->flow) != flow) {
+		progset->current  = NULL;
+		progset->previous = NULL;
+		MULTTY_PROG *prog, *tmp;
+		HASH_ITER (hh, progset->programs, prog, tmp) {
+			prog->aliased = false;
+			prog->aliaslen = 0;
+		}
+	}
+	progset->flow = (flow != MULTTY_OUTFLOW_STDOUT) ? flow : NULL;
+	flow->progset = progset;
+}
@@ -22,17 +22,21 @@
  * Returns true on success, or else false/errno.
  */
 bool mtyp_describe (MULTTY_PROG *prog, const char *descr) {
-	if ((descr == NULL) || !mtyescapefree (MULTTY_ESC_MIXED, descr, strlen (descr))) {
+	if ((descr == NULL) || !mtyescapefree (MULTTY_ESC_MIXED, (const uint8_t *) descr, strlen (descr))) {
 		errno = EINVAL;
-		return NULL;
+		return false;
 	}
 	//TODO// Possibly check the size of the description
 	const char *new_descr = strdup (descr);
-	if (new_descr != NULL) {
-		if (prog->descr) {
-			free ((void *) prog->descr);
-		}
-		prog->descr = new_descr;
+	if (new_descr == NULL) {
+		errno = ENOMEM;
+		return false;
 	}
+	if (prog->descr) {
+		free ((void *) prog->descr);
+	}
+	prog->descr = new_descr;
+	prog->aliased = false;
+	return true;
 }
 
@@ -25,10 +25,10 @@
  *
  * Returns a handle on success, or else NULL/errno.
  */
-MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const MULTTY_PROGID id_us, const char *opt_descr) {
+MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const char id_us[33], const char *opt_descr) {
 	//
 	// Any opt_descr provided must be free from ASCII escapables
-	if ((opt_descr != NULL) && !mtyescapefree (MULTTY_ESC_MIXED, opt_descr, strlen (opt_descr))) {
+	if ((opt_descr != NULL) && !mtyescapefree (MULTTY_ESC_MIXED, (const uint8_t *) opt_descr, strlen (opt_descr))) {
 		errno = EINVAL;
 		return NULL;
 	}
@@ -38,12 +38,12 @@ MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const MULTTY_PROGID id_us, cons
 	if (prog == NULL) {
 		//
 		// New program name; allocate and initialise
-		prog = malloc (sizeof (MULTTY_PROGSET));
+		prog = malloc (sizeof (MULTTY_PROG));
 		if (prog == NULL) {
 			errno = ENOMEM;
 			return NULL;
 		}
-		memset (prog, 0, sizeof (MULTTY_PROGSET));
+		memset (prog, 0, sizeof (MULTTY_PROG));
 		memcpy (prog->id_us, id_us, sizeof (MULTTY_PROGID));
 		prog->set = progset;
 		if (opt_descr != NULL) {
@@ -54,6 +54,7 @@ MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const MULTTY_PROGID id_us, cons
 				return NULL;
 			}
 		}
+		HASH_ADD (hh, progset->programs, id_us, sizeof (MULTTY_PROGID), prog);
 	} else {
 		//
 		// Existing program name; possibly change description
@@ -61,5 +62,6 @@ MULTTY_PROG *mtyp_have (MULTTY_PROGSET *progset, const MULTTY_PROGID id_us, cons
 			return NULL;
 		}
 	}
+	return prog;
 }
 
@@ -15,7 +15,7 @@
  */
 bool mtyp_mkid (const char *id, bool with_descr, MULTTY_PROGID prgid) {
 	int idlen = strlen (id);
-	if ((idlen > 32) || (!mtyescapefree (MULTTY_ESC_BINARY, id, idlen))) {
+	if ((idlen > 32) || (!mtyescapefree (MULTTY_ESC_BINARY, (const uint8_t *) id, idlen))) {
 		return false;
 	}
 	memcpy (prgid, id, idlen);
@@ -13,6 +13,32 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
+
+/* Send raw data from a va_list to an outflow, see mtyp_raw().
+ */
+static bool _mtyp_vraw (MULTTY_OUTFLOW *flow, int numbufs, va_list pairs) {
+	//
+	// Construct an iovec array to send
+	int totlen = 0;
+	struct iovec output [numbufs];
+	int i;
+	for (i = 0; i < numbufs; i++) {
+		output[i].iov_base = va_arg (pairs, uint8_t *);
+		totlen +=
+		output[i].iov_len  = va_arg (pairs, int      );
+	}
+	//
+	// Sticky output returns to the default stream first
+	if (!_mty_sticky_end (_MTY_FLOW (flow))) {
+		return false;
+	}
+	//
+	// Now send the iovec array, as atomically as it gets under POSIX
+	return mtyv_outflow (flow, totlen, numbufs, output);
+}
+
 
 /* Send raw data for mulTTY program multiplexing.  This stands above
  * the streams for individual programs.  STREAMS SHOULD NOT USE THIS
@@ -21,7 +47,7 @@
  * This is not a user command, it is intended for mulTTY internals.
  *
  * The content supplied is sent atomically, which means it should
- * not exceed PIPE_BUF.  If it does, errno is set to EMSGSIZE.
+ * not exceed ATOMIC_SEND_MAX.  If it does, errno is set to EMSGSIZE.
  *
  * The raw content is supplied as a sequence of pointer and length:
  *  - uint8_t *buf
@@ -31,21 +57,24 @@
  * This returns true on success, or else false/errno.
  */
 bool mtyp_raw (int numbufs, ...) {
-	//
-	// Construct an iovec array to send
-	int totlen;
-	struct iovec output [numbufs];
 	va_list pairs;
 	va_start (pairs, numbufs);
-	int i = 0;
-	while (i < numbufs) {
-		output[i].iov_base = va_arg (pairs, uint8_t *);
-		totlen +=
-		output[i].iov_len  = va_arg (pairs, int      );
-	}
+	bool ok = _mtyp_vraw (MULTTY_OUTFLOW_STDOUT, numbufs, pairs);
 	va_end (pairs);
-	//
-	// Now send the iovec array, as atomically as it gets under POSIX
-	return mtyv_out (totlen, numbufs, output);
+	return ok;
+}
+
+
+/* Send raw data for mulTTY program multiplexing to an outflow,
+ * as with mtyp_raw() for MULTTY_OUTFLOW_STDOUT.
+ *
+ * This returns true on success, or else false/errno.
+ */
+bool mtyp_rawflow (MULTTY_OUTFLOW *flow, int numbufs, ...) {
+	va_list pairs;
+	va_start (pairs, numbufs);
+	bool ok = _mtyp_vraw (flow, numbufs, pairs);
+	va_end (pairs);
+	return ok;
 }
 
@@ -0,0 +1,395 @@
+/* mulTTY -> schedule queued output to save on program switches
+ *
+ * A multiplexer that relays many programs to one outflow sees
+ * them write in turns.  Every unit then starts with a switch
+ * <SOH>id<US>descr<DC4> to its program; only the switch back to
+ * the previous program is as cheap as a bare <DC4>.
+ *
+ * While scheduling, the units in the coalescing queue are held
+ * with their program, and they are sent in groups per program.
+ * The current program goes first, then the previous one, then
+ * the others as they first appeared.  The order of the units
+ * of each program is kept, and units that are not for one of
+ * the programs in the set stay where they are.  Units are held
+ * no longer than the latency set with mtyoutflow_coalesce().
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+#include "mtyp-int.h"
+
+
+/* The number of bytes to switch to a program from the current
+ * and previous program, as mtyp_switch_iov() would make it.
+ */
+static int _mtyp_switchlen (MULTTY_PROG *current, MULTTY_PROG *previous, MULTTY_PROG *prog) {
+	if (prog == current) {
+		return 0;
+	}
+	if (prog == previous) {
+		return 1;
+	}
+	if (prog->aliased) {
+		return prog->aliaslen;
+	}
+	int len = 2 + strnlen (prog->id_us, sizeof (MULTTY_PROGID));
+	if (prog->descr != NULL) {
+		len += strlen (prog->descr);
+	}
+	return len;
+}
+
+
+/* The number of bytes for the switches that units need when they
+ * are sent in the order given, starting from the current and
+ * previous program of the set.
+ */
+static long _mtyp_switchcost (MULTTY_PROGSET *progset, MULTTY_PROG **progs, int numprogs) {
+	MULTTY_PROG *current  = progset->current;
+	MULTTY_PROG *previous = progset->previous;
+	long cost = 0;
+	int i;
+	for (i = 0; i < numprogs; i++) {
+		MULTTY_PROG *prog = progs [i];
+		if ((prog == NULL) || (prog->set != progset)) {
+			continue;
+		}
+		cost += _mtyp_switchlen (current, previous, prog);
+		if (prog == current) {
+			previous = NULL;
+		} else {
+			if (current != NULL) {
+				previous = current;
+			}
+			current = prog;
+		}
+	}
+	return cost;
+}
+
+
+/* Send iovec entries in pieces that may not be split, each given
+ * by the index of its first entry and its length.  They are sent
+ * in as few writes as possible, each of at most MULTTY_BATCH_IOVS
+ * entries and, unless the output is exclusive, ATOMIC_SEND_MAX.
+ * The number of pieces that were sent is stored in *done, also
+ * when a write fails.
+ *
+ * Returns true on success, or false/errno.
+ */
+static bool _mtyp_sched_write (MULTTY_OUTFLOW *flow, const struct iovec *out, int outc,
+			const int *piece, const int *piecelen, int numpieces, int *done) {
+	int send_max = flow->exclusive ? INT_MAX : _mty_atomic_send (flow);
+	int first = 0;
+	*done = 0;
+	while (first < numpieces) {
+		int last = first;
+		int len = piecelen [first];
+		while ((last + 1 < numpieces) && (len <= send_max - piecelen [last + 1])) {
+			int end = (last + 2 < numpieces) ? piece [last + 2] : outc;
+			if (end - piece [first] > MULTTY_BATCH_IOVS) {
+				break;
+			}
+			len += piecelen [++last];
+		}
+		int end = (last + 1 < numpieces) ? piece [last + 1] : outc;
+		if (!_mty_vout_direct (flow, len, end - piece [first], out + piece [first])) {
+			return false;
+		}
+		first = last + 1;
+		*done = first;
+	}
+	return true;
+}
+
+
+/* Remove the units that were sent from the queue, while locked,
+ * after a failed write.  The units that remain are moved to the
+ * front of the buffer, so they can be sent later.
+ */
+static void _mtyp_sched_keep (struct multty_queue *q, const bool *sent) {
+	int fill = 0;
+	int numunits = 0;
+	int i;
+	for (i = 0; i < q->numunits; i++) {
+		if (sent [i]) {
+			continue;
+		}
+		struct multty_qunit *unit = &q->units [numunits++];
+		memmove (q->buf + fill, q->buf + q->units [i].ofs, q->units [i].len);
+		*unit = q->units [i];
+		unit->ofs = fill;
+		fill += unit->len;
+	}
+	q->fill = fill;
+	q->numunits = numunits;
+}
+
+
+/* A program switch that was committed while scheduling, with the
+ * state of its program and set from before, and the piece that
+ * sends it, so it can be undone when that piece is not sent.
+ */
+struct mtyp_undo {
+	MULTTY_PROG *prog;
+	MULTTY_PROG *current;
+	MULTTY_PROG *previous;
+	bool aliased;
+	int piece;
+};
+
+
+/* Undo the program switches that were not sent, after a failed
+ * write that sent the pieces before done.  This works back from
+ * the last switch, so each program set ends as it was before its
+ * first switch that was not sent, and each program keeps an
+ * alias unbound when the switch that binds it was not sent.
+ */
+static void _mtyp_sched_undo (const struct mtyp_undo *undo, int numundo, int done) {
+	while ((numundo > 0) && (undo [numundo - 1].piece >= done)) {
+		numundo--;
+		MULTTY_PROG *prog = undo [numundo].prog;
+		prog->set->current  = undo [numundo].current;
+		prog->set->previous = undo [numundo].previous;
+		prog->aliased       = undo [numundo].aliased;
+	}
+}
+
+
+/* Send the queue of an outflow, while it is locked, in groups of
+ * units per program.  A unit that is too large for the queue may
+ * be appended; it is sent after the queued units of its program.
+ * The switch bytes that this saves are added to the program set.
+ *
+ * A switch is sent in the same write as the first unit after it,
+ * so no other writer can come in between.  Only when both do not
+ * fit in ATOMIC_SEND_MAX is the switch sent on its own, as in
+ * mtyflush().  When a write fails, the units that were not sent
+ * remain in the queue, and the switches for them are undone.
+ *
+ * Returns true on success, or false/errno.
+ */
+static bool _mtyp_sched_send (MULTTY_OUTFLOW *flow, MULTTY_PROG *opt_prog,
+			int len, int ioc, const struct iovec *iov) {
+	struct multty_queue *q = &flow->queue;
+	MULTTY_PROGSET *progset = flow->progset;
+	int send_max = _mty_atomic_send (flow);
+	//
+	// Collect the units, with the one appended at the end
+	int numunits = q->numunits + ((iov != NULL) ? 1 : 0);
+	if (numunits == 0) {
+		return true;
+	}
+	MULTTY_PROG *progs [numunits];
+	bool sent [numunits];
+	int i;
+	for (i = 0; i < q->numunits; i++) {
+		progs [i] = q->units [i].prog;
+		sent  [i] = false;
+	}
+	if (iov != NULL) {
+		progs [numunits - 1] = opt_prog;
+		sent  [numunits - 1] = false;
+	}
+	long arrival = (progset != NULL) ? _mtyp_switchcost (progset, progs, numunits) : 0;
+	long actual = 0;
+	//
+	// Each unit may take a switch and its own entries; the pieces
+	// for units note which one they hold, those for a switch -1
+	int maxout = numunits * (MULTTY_SWITCH_IOVS + 1) + ((iov != NULL) ? ioc : 0);
+	struct iovec out [maxout];
+	int piece [2 * numunits];
+	int piecelen [2 * numunits];
+	int pieceunit [2 * numunits];
+	int outc = 0;
+	int numpieces = 0;
+	//
+	// Switches are committed as they are made, so the next pick
+	// sees them; they are undone when their piece is not sent
+	struct mtyp_undo undo [numunits];
+	int numundo = 0;
+	//
+	// Work through segments of units for the programs in the set
+	int start = 0;
+	while (start < numunits) {
+		int end = start;
+		while ((end < numunits) && (progs [end] != NULL) &&
+				(progs [end]->set == progset)) {
+			end++;
+		}
+		if (end == start) {
+			end++;
+		}
+		int left = end - start;
+		while (left > 0) {
+			//
+			// Pick the current program, the previous, or the first
+			MULTTY_PROG *pick = NULL;
+			int first = -1;
+			for (i = start; i < end; i++) {
+				if (sent [i]) {
+					continue;
+				}
+				if (first < 0) {
+					first = i;
+				}
+				if ((progs [i] != NULL) && (progs [i] == progs [i]->set->current)) {
+					pick = progs [i];
+					break;
+				}
+				if ((progs [i] != NULL) && (progs [i] == progs [i]->set->previous)) {
+					pick = progs [i];
+				}
+			}
+			if (pick == NULL) {
+				pick = progs [first];
+			}
+			//
+			// Switch to the program, then send all its units
+			int swofs = outc;
+			int swc = 0;
+			int swlen = 0;
+			if (pick != NULL) {
+				swc = mtyp_switch_iov (flow, pick, out + outc);
+				if (swc < 0) {
+					_mtyp_sched_undo (undo, numundo, 0);
+					return false;
+				}
+				if (_MTY_FLOW (pick->set->flow) == flow) {
+					undo [numundo].prog     = pick;
+					undo [numundo].current  = pick->set->current;
+					undo [numundo].previous = pick->set->previous;
+					undo [numundo].aliased  = pick->aliased;
+					undo [numundo].piece    = numpieces;
+					numundo++;
+					mtyp_switch_commit (flow, pick);
+				}
+				for (i = 0; i < swc; i++) {
+					swlen += out [outc++].iov_len;
+				}
+				if (pick->set == progset) {
+					actual += swlen;
+				}
+			}
+			for (i = first; i < end; i++) {
+				if (sent [i] || (progs [i] != pick)) {
+					continue;
+				}
+				int unitc   = (i < q->numunits) ? 1 : ioc;
+				int unitlen = (i < q->numunits) ? q->units [i].len : len;
+				bool join = (swc > 0) && (swc + unitc <= MULTTY_BATCH_IOVS) &&
+						(flow->exclusive || (swlen <= send_max - unitlen));
+				if ((swc > 0) && !join) {
+					piece     [numpieces] = swofs;
+					piecelen  [numpieces] = swlen;
+					pieceunit [numpieces] = -1;
+					numpieces++;
+				}
+				piece    [numpieces] = join ? swofs : outc;
+				piecelen [numpieces] = join ? swlen : 0;
+				swc = 0;
+				if (i < q->numunits) {
+					out [outc].iov_base = q->buf + q->units [i].ofs;
+					out [outc].iov_len  = q->units [i].len;
+				} else {
+					memcpy (out + outc, iov, ioc * sizeof (struct iovec));
+				}
+				outc += unitc;
+				piecelen  [numpieces] += unitlen;
+				pieceunit [numpieces] = i;
+				numpieces++;
+				sent [i] = true;
+				left--;
+				if (pick == NULL) {
+					break;
+				}
+			}
+		}
+		start = end;
+	}
+	int done;
+	if (!_mtyp_sched_write (flow, out, outc, piece, piecelen, numpieces, &done)) {
+		for (i = 0; i < numunits; i++) {
+			sent [i] = false;
+		}
+		for (i = 0; i < done; i++) {
+			if (pieceunit [i] >= 0) {
+				sent [pieceunit [i]] = true;
+			}
+		}
+		_mtyp_sched_keep (q, sent);
+		_mtyp_sched_undo (undo, numundo, done);
+		return false;
+	}
+	q->fill = 0;
+	q->numunits = 0;
+	if (progset != NULL) {
+		progset->switch_saved += arrival - actual;
+	}
+	return true;
+}
+
+
+/* Schedule the output to the outflow of a program set by program.
+ * The units that are held for coalescing, see mtyoutflow_coalesce(),
+ * are then sent in groups per program, to save on switches.  The
+ * current and previous program go first, because switching to
+ * them is cheapest.  The order of units for each program is kept.
+ *
+ * This only has effect while the outflow coalesces, and then for
+ * streams that are assigned to a program in the set.  Scheduling
+ * stops when called with schedule set to false.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyp_schedule (MULTTY_PROGSET *progset, bool schedule) {
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (progset->flow);
+	struct multty_queue *q = &flow->queue;
+	//
+	// Sticky output stops while units are reordered
+	if (schedule && !_mty_sticky_end (flow)) {
+		return false;
+	}
+	bool ok = true;
+	pthread_mutex_lock (&q->mutex);
+	if (schedule && (q->units == NULL)) {
+		q->units = malloc (MULTTY_QUEUE_UNITS * sizeof (struct multty_qunit));
+		if (q->units == NULL) {
+			pthread_mutex_unlock (&q->mutex);
+			errno = ENOMEM;
+			return false;
+		}
+	}
+	if (schedule && (q->scheduler == NULL) && (q->fill > 0)) {
+		//
+		// What was queued before stays in front, as one unit
+		q->units [0].prog = NULL;
+		q->units [0].ofs  = 0;
+		q->units [0].len  = q->fill;
+		q->numunits = 1;
+	} else if (!schedule && (q->scheduler != NULL)) {
+		//
+		// Send what was scheduled, the queue continues without
+		ok = q->scheduler (flow, NULL, 0, 0, NULL);
+	}
+	flow->progset = progset;
+	q->scheduler = schedule ? _mtyp_sched_send : NULL;
+	pthread_mutex_unlock (&q->mutex);
+	return ok;
+}
+
+
+/* Return the number of bytes for program switches that were saved
+ * by scheduling the output of a program set, see mtyp_schedule().
+ * This compares to sending the same units in the order in which
+ * they were written.
+ */
+long mtyp_schedule_saved (MULTTY_PROGSET *progset) {
+	return progset->switch_saved;
+}
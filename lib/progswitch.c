@@ -1,62 +1,187 @@
 /* mulTTY -> send a PSW==DC4 to switch to a program in the current set.
+ *
+ * This is part of libmultty rather than libmulttyplex, because
+ * stream output that is assigned to a program makes its switch
+ * here, in the same unit as its data.
  *
  * From: Rick van Rein <rick@openfortress.nl>
  */
 
 
 #include <errno.h>
+#include <stdio.h>
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
 #include "mtyp-int.h"
 
 
 
-/* Switch to another program, and send the corresponding control code
- * over stdout.  The identity can be constructed with mtyp_mkid()
- * and hints at an optional description.
- *
- * It is assumed that the program switched to exists.
+/* Test if the alias <SOH>#N of a program is shorter than its
+ * <SOH>id<US>descr, so it is worth binding.
+ */
+static bool _mtyp_alias_shorter (MULTTY_PROG *prog) {
+	size_t namelen = strnlen (prog->id_us, sizeof (MULTTY_PROGID));
+	if (prog->descr != NULL) {
+		namelen += strlen (prog->descr);
+	}
+	return (prog->aliaslen > 0) && ((size_t) (prog->aliaslen - 1) < namelen);
+}
+
+
+/* Prepare the switch to a program as iovec entries, so it can be
+ * sent in front of stream data, in the same atomic unit.  The
+ * program set does not change until mtyp_switch_commit() is
+ * called after sending, so a failed write leaves it as it was.
+ * Nothing is prepared when the program is current already.
+ * When the program set is bound to another outflow than the one
+ * given, the switch is sent there right away.  An outflow that
+ * uses aliases binds one in the full switch, and then switches
+ * with <SOH>#N<DC4> instead, see mtyoutflow_aliases().
  *
- * TODO: Streams may need to claim until they release.
+ * The iovec entries point into the program, which should not
+ * change until they are sent.
  *
- * Return 0 on success or else -1/errno.
+ * Returns the number of entries filled in iov, at most
+ * MULTTY_SWITCH_IOVS, or else -1/errno.
  */
-int mtyp_switch (MULTTY_PROG *prog) {
+int mtyp_switch_iov (MULTTY_OUTFLOW *flow, MULTTY_PROG *prog,
+			struct iovec iov [MULTTY_SWITCH_IOVS]) {
 	MULTTY_PROGSET *progset = prog->set;
+	if (_MTY_FLOW (progset->flow) != _MTY_FLOW (flow)) {
+		return mtyp_switch (prog);
+	}
 	//
-	// Is this the current?  Then forget previous, but send nothing
+	// Is this the current?  Then send nothing
 	if (progset->current == prog) {
-		progset->previous = NULL;
 		return 0;
 	}
 	//
-	// Is this the previous?  Then simply swap with current
+	// Is this the previous?  Then make the nameless switch
 	if (progset->previous == prog) {
-		progset->previous = progset->current;
-		progset->current  = prog;
-		// Make the nameless switch to "previous"
-		mtyp_raw (1,
-			s_PSW, 1);
-		return 0;
+		iov [0].iov_base = s_PSW;
+		iov [0].iov_len  = 1;
+		return 1;
 	}
 	//
-	// Produce the full output message (no data, so no need to flush it out)
+	// Use the alias <SOH>#N<DC4> once it was bound
+	if (prog->aliased) {
+		iov [0].iov_base = prog->alias;
+		iov [0].iov_len  = prog->aliaslen - 1;
+		iov [1].iov_base = s_PSW;
+		iov [1].iov_len  = 1;
+		return 2;
+	}
+	//
+	// Produce the full switch, straight from the program
 	const char *descr = prog->descr;
 	if (descr == NULL) {
 		descr = "";
 	}
-	mtyp_raw (4,
-		s_SOH, 1,
-		prog->id_us, strnlen (prog->id_us, sizeof (MULTTY_PROGID)),
-		descr, strlen (descr),
-		s_PSW, 1);
+	iov [0].iov_base = s_SOH;
+	iov [0].iov_len  = 1;
+	iov [1].iov_base = prog->id_us;
+	iov [1].iov_len  = strnlen (prog->id_us, sizeof (MULTTY_PROGID));
+	iov [2].iov_base = (char *) descr;
+	iov [2].iov_len  = strlen (descr);
+	iov [3].iov_base = s_PSW;
+	iov [3].iov_len  = 1;
+	//
+	// Bind an alias <SOH>#N= in front, when it is shorter; it is
+	// used once mtyp_switch_commit() finds that it was sent
+	if (_MTY_FLOW (flow)->aliases) {
+		if (prog->aliaslen == 0) {
+			prog->aliaslen = snprintf (prog->alias, sizeof (prog->alias),
+					"%c#%u=", c_SOH, _mty_alias_next (_MTY_FLOW (flow)));
+		}
+		if (_mtyp_alias_shorter (prog)) {
+			iov [0].iov_base = prog->alias;
+			iov [0].iov_len  = prog->aliaslen;
+		}
+	}
+	return 4;
+}
+
+
+/* Commit the switch to a program after it was sent, as prepared
+ * by mtyp_switch_iov(), also when that prepared nothing.  The
+ * program becomes current in its set, and the current one is
+ * pushed back to previous.  Switching to the current program
+ * forgets the previous one.  An alias that the switch bound is
+ * used from now on.  Nothing changes when the program set is
+ * bound to another outflow than the one given, as the switch
+ * was sent and committed there.
+ */
+void mtyp_switch_commit (MULTTY_OUTFLOW *flow, MULTTY_PROG *prog) {
+	MULTTY_PROGSET *progset = prog->set;
+	if (_MTY_FLOW (progset->flow) != _MTY_FLOW (flow)) {
+		return;
+	}
+	//
+	// Is this the current?  Then forget previous
+	if (progset->current == prog) {
+		progset->previous = NULL;
+		return;
+	}
+	//
+	// Is this the previous?  Then simply swap with current
+	if (progset->previous == prog) {
+		progset->previous = progset->current;
+		progset->current  = prog;
+		return;
+	}
+	//
+	// A full switch that was sent with an alias has bound it
+	if (_MTY_FLOW (flow)->aliases && _mtyp_alias_shorter (prog)) {
+		prog->aliased = true;
+	}
 	//
 	// Normal handling pushes current (if set) back to previous
 	if (progset->current != NULL) {
 		progset->previous = progset->current;
 	}
 	progset->current = prog;
+}
+
+
+/* Switch to another program, and send the corresponding control code
+ * over the outflow of its program set.  The identity can be
+ * constructed with mtyp_mkid() and hints at an optional description.
+ *
+ * It is assumed that the program switched to exists.
+ *
+ * Stream output that is bound to a program makes its switch with
+ * mtyp_switch_iov() instead, in the same unit as the stream data.
+ *
+ * Return 0 on success or else -1/errno.
+ */
+int mtyp_switch (MULTTY_PROG *prog) {
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (prog->set->flow);
+	//
+	// Scheduled output switches when it is sent, so send it first
+	if (_mty_queue_scheduled (flow) && (mtyoutflow_sync (flow) != 0)) {
+		return -1;
+	}
+	//
+	// Sticky output returns to the default stream before a switch
+	if (!_mty_sticky_end (flow)) {
+		return -1;
+	}
+	struct iovec iov [MULTTY_SWITCH_IOVS];
+	int ioc = mtyp_switch_iov (flow, prog, iov);
+	if (ioc < 0) {
+		return -1;
+	}
+	int len = 0;
+	int i;
+	for (i = 0; i < ioc; i++) {
+		len += iov [i].iov_len;
+	}
+	if ((ioc > 0) && !mtyv_outflow (flow, len, ioc, iov)) {
+		return -1;
+	}
+	mtyp_switch_commit (flow, prog);
 	return 0;
 }
 
@@ -17,4 +17,5 @@ struct multty_progset MULTTY_PROGRAMSET_DEFAULT = {
 	.programs = NULL,
 	.current  = NULL,
 	.previous = NULL,
+	.flow     = NULL,
 };
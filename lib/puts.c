@@ -6,6 +6,8 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 /* Send an ASCII string to the given mulTTY steam.
  * Since it is ASCII, it will be escaped as seen fit.
@@ -24,16 +26,8 @@
  * Return true on success, else false/errno.
  */
 bool mtyputstrbuf (MULTTY *mty, const char *strbuf, int buflen) {
-	int retval = 0;
-	int esclen;
-	while (buflen > 0) {
-		esclen = mtyescape (MULTTY_ESC_MIXED, mty, strbuf, buflen);
-		strbuf += esclen;
-		buflen -= esclen;
-		if (mtyflush (mty) != 0) {
-			return false;
-		}
-	}
-	return true;
+	struct iovec iov;
+	iov.iov_base = (void *) strbuf;
+	iov.iov_len  = buflen;
+	return _mty_escwritev (MULTTY_ESC_MIXED, mty, &iov, 1) == buflen;
 }
-
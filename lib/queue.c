@@ -0,0 +1,276 @@
+/* mulTTY -> coalescing flush queue, shared by all handles of an outflow
+ *
+ * Chatty programs send many small units, each with its own
+ * writev() call.  With coalescing enabled, complete units are
+ * gathered in one queue per outflow, and sent together as
+ * soon as another unit would not fit, when mtysync() is called,
+ * or when the oldest unit has waited for the configured latency.
+ *
+ * The queue only ever holds complete units, each returning to
+ * the default stream, and it is sent as one writev() of at most
+ * ATOMIC_SEND_MAX bytes.  So the atomicity of units is the same
+ * as when they are sent one by one.  Since all output passes
+ * through mtyv_outflow(), the order of units is also unchanged.
+ *
+ * When scheduling by program, see mtyp_schedule(), the units
+ * are recorded and they are sent by a scheduler, which changes
+ * their order to save on program switches.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* Units of at least half ATOMIC_SEND_MAX are not worth copying
+ * into the queue; they are sent directly after the queue.
+ */
+#define MULTTY_QUEUE_BYPASS(send_max) ((send_max) / 2)
+
+
+/* The queue of the standard outflow is sent at exit, which is
+ * setup on first use.
+ */
+static bool _mty_queue_atexit_done = false;
+
+
+/* Test if coalescing is enabled.  Unlocked, for a quick test;
+ * _mty_queue_out() tests again while locked.
+ */
+bool _mty_queue_enabled (MULTTY_OUTFLOW *flow) {
+	return flow->queue.enabled;
+}
+
+
+/* Test if coalescing schedules by program.  Unlocked, for a
+ * quick test.
+ */
+bool _mty_queue_scheduled (MULTTY_OUTFLOW *flow) {
+	return flow->queue.enabled && (flow->queue.scheduler != NULL);
+}
+
+
+/* Send what is in the queue, while locked.
+ *
+ * Returns true on success, or false/errno.
+ */
+static bool _mty_queue_drain (MULTTY_OUTFLOW *flow) {
+	struct multty_queue *q = &flow->queue;
+	if (q->fill == 0) {
+		return true;
+	}
+	if (q->scheduler != NULL) {
+		return q->scheduler (flow, NULL, 0, 0, NULL);
+	}
+	struct iovec iov;
+	iov.iov_base = q->buf;
+	iov.iov_len  = q->fill;
+	if (!_mty_vout_direct (flow, iov.iov_len, 1, &iov)) {
+		return false;
+	}
+	q->fill = 0;
+	return true;
+}
+
+
+/* Test if the deadline for the oldest unit has passed, while locked.
+ */
+static bool _mty_queue_expired (struct multty_queue *q) {
+	if (q->fill == 0) {
+		return false;
+	}
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	if (now.tv_sec != q->deadline.tv_sec) {
+		return now.tv_sec > q->deadline.tv_sec;
+	}
+	return now.tv_nsec >= q->deadline.tv_nsec;
+}
+
+
+/* Flush the queue of the standard outflow when the program exits.
+ */
+static void _mty_queue_atexit (void) {
+	mtysync ();
+}
+
+
+/* INTERNAL ROUTINE to send a complete unit through the queue.
+ * Small units are copied into the queue, larger ones are sent
+ * directly after what was queued before them.  When coalescing
+ * was disabled after the quick test, the unit is sent directly.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_queue_out (MULTTY_OUTFLOW *flow, MULTTY_PROG *opt_prog,
+			int len, int ioc, const struct iovec *iov) {
+	struct multty_queue *q = &flow->queue;
+	bool ok = true;
+	int send_max = _mty_atomic_send (flow);
+	pthread_mutex_lock (&q->mutex);
+	if (!q->enabled) {
+		ok = _mty_vout_direct (flow, len, ioc, iov);
+		pthread_mutex_unlock (&q->mutex);
+		return ok;
+	}
+	int qmax = (q->bufsize < send_max) ? q->bufsize : send_max;
+	//
+	// Make room when the unit does not fit behind what is queued
+	if ((q->fill + len > qmax) ||
+			((q->scheduler != NULL) && (q->numunits == MULTTY_QUEUE_UNITS))) {
+		ok = _mty_queue_drain (flow);
+	}
+	//
+	// Send large units directly, append small ones to the queue
+	if (!ok) {
+		;
+	} else if ((len >= MULTTY_QUEUE_BYPASS (send_max)) || (len > qmax)) {
+		if (q->scheduler != NULL) {
+			ok = q->scheduler (flow, opt_prog, len, ioc, iov);
+		} else {
+			ok = _mty_queue_drain (flow) && _mty_vout_direct (flow, len, ioc, iov);
+		}
+	} else {
+		if (q->fill == 0) {
+			clock_gettime (CLOCK_MONOTONIC, &q->deadline);
+			long nsec = q->deadline.tv_nsec + 1000L * q->latency_usec;
+			q->deadline.tv_sec  += nsec / 1000000000L;
+			q->deadline.tv_nsec  = nsec % 1000000000L;
+		}
+		if (q->scheduler != NULL) {
+			struct multty_qunit *unit = &q->units [q->numunits++];
+			unit->prog = opt_prog;
+			unit->ofs  = q->fill;
+			unit->len  = len;
+		}
+		int i;
+		for (i = 0; i < ioc; i++) {
+			memcpy (q->buf + q->fill, iov [i].iov_base, iov [i].iov_len);
+			q->fill += iov [i].iov_len;
+		}
+		//
+		// Send the queue when it has waited long enough
+		if (_mty_queue_expired (q)) {
+			ok = _mty_queue_drain (flow);
+		}
+	}
+	pthread_mutex_unlock (&q->mutex);
+	return ok;
+}
+
+
+/* Coalesce the output of all MULTTY handles that are bound to
+ * MULTTY_OUTFLOW_STDOUT in a shared queue.  Complete units are
+ * gathered and sent in one atomic writev() of at most
+ * ATOMIC_SEND_MAX bytes.  The queue is sent when another unit
+ * would not fit, on mtysync(), or once the oldest unit has
+ * waited for latency_usec microseconds.  The latency is only
+ * checked when output is sent; an idle program should call
+ * mtysync() after mtysync_timeout() milliseconds.
+ *
+ * Disabling coalescing sends what is in the queue; when that
+ * fails, coalescing continues.  Queued output is also sent when
+ * the program exits normally.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtycoalesce (bool coalesce, unsigned latency_usec) {
+	return mtyoutflow_coalesce (MULTTY_OUTFLOW_STDOUT, coalesce, latency_usec);
+}
+
+
+/* Coalesce the output to an outflow, as with mtycoalesce() for
+ * MULTTY_OUTFLOW_STDOUT.  Queued output to other outflows is
+ * not sent when the program exits, but in mtyoutflow_close().
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyoutflow_coalesce (MULTTY_OUTFLOW *flow, bool coalesce, unsigned latency_usec) {
+	struct multty_queue *q = &flow->queue;
+	bool ok = true;
+	pthread_mutex_lock (&q->mutex);
+	if (coalesce && (q->buf == NULL)) {
+		int bufsize = _mty_atomic_send (flow);
+		q->buf = malloc (bufsize);
+		if (q->buf == NULL) {
+			pthread_mutex_unlock (&q->mutex);
+			errno = ENOMEM;
+			return false;
+		}
+		q->bufsize = bufsize;
+	}
+	if (coalesce && (flow == MULTTY_OUTFLOW_STDOUT) && !_mty_queue_atexit_done) {
+		if (atexit (_mty_queue_atexit) != 0) {
+			pthread_mutex_unlock (&q->mutex);
+			errno = ENOMEM;
+			return false;
+		}
+		_mty_queue_atexit_done = true;
+	}
+	if (!coalesce) {
+		ok = _mty_queue_drain (flow);
+	}
+	//
+	// What could not be sent stays queued, so keep coalescing
+	q->latency_usec = latency_usec;
+	q->enabled = coalesce || !ok;
+	pthread_mutex_unlock (&q->mutex);
+	return ok;
+}
+
+
+/* Send any output that was queued for coalescing.  This is
+ * harmless to call when coalescing is not enabled.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtysync (void) {
+	return mtyoutflow_sync (MULTTY_OUTFLOW_STDOUT);
+}
+
+
+/* Send any output that was queued for coalescing on an outflow,
+ * as with mtysync() for MULTTY_OUTFLOW_STDOUT.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_sync (MULTTY_OUTFLOW *flow) {
+	pthread_mutex_lock (&flow->queue.mutex);
+	bool ok = _mty_queue_drain (flow);
+	pthread_mutex_unlock (&flow->queue.mutex);
+	return ok ? 0 : EOF;
+}
+
+
+/* Return the number of milliseconds until queued output is due
+ * to be sent with mtysync(), in the form used by poll().  This
+ * is -1 when nothing is queued, and 0 when output is overdue.
+ */
+int mtysync_timeout (void) {
+	return mtyoutflow_sync_timeout (MULTTY_OUTFLOW_STDOUT);
+}
+
+
+/* Return the number of milliseconds until output queued on an
+ * outflow is due, as with mtysync_timeout() for the standard
+ * outflow.  An event loop can take the minimum over outflows.
+ */
+int mtyoutflow_sync_timeout (MULTTY_OUTFLOW *flow) {
+	struct multty_queue *q = &flow->queue;
+	int retval = -1;
+	pthread_mutex_lock (&q->mutex);
+	if (q->fill > 0) {
+		struct timespec now;
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		long msec = (q->deadline.tv_sec  - now.tv_sec ) * 1000L +
+		            (q->deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+		retval = (msec > 0) ? msec : 0;
+	}
+	pthread_mutex_unlock (&q->mutex);
+	return retval;
+}
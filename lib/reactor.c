@@ -0,0 +1,322 @@
+/* mulTTY -> reactor for many inflows in one thread
+ *
+ * A multiplexer may serve hundreds of inflows, such as one per
+ * container console.  Rather than blocking in read() for one of
+ * them, the reactor waits for all of them with epoll and only
+ * dispatches those that are ready.  Descriptors are watched
+ * edge-triggered, so an inflow is drained until read() reports
+ * EAGAIN.  A budget per round keeps one busy inflow from holding
+ * up the others; what it has left continues in the next round.
+ *
+ * The epoll descriptor can be embedded in another event loop.
+ * Outflows are not served here.  Their writes block, so a slow
+ * reader on one would stall all inflows.  Their queues and
+ * deadlines are served with mtyoutflow_sync_timeout() and
+ * mtyoutflow_timerfd(), from the same or another thread.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/epoll.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* The number of events taken from epoll in one call.
+ */
+#define MULTTY_REACTOR_EVENTS 64
+
+
+/* An inflow in a reactor.  Inflows that have input left are
+ * linked in a ready list.  An inflow that is dropped while it
+ * is in the ready list or being served is freed later.
+ */
+struct multty_reactin {
+	struct multty_reactin *next;
+	struct multty_reactin *nextready;
+	MULTTY_REACTOR *reactor;
+	MULTTY_INFLOW *flow;
+	mtycb_inflow_end *cb_end;
+	void *cb_enddata;
+	bool ready;
+	bool busy;
+	bool dropped;
+};
+
+
+/* Fill out the opaque type for a reactor.
+ */
+struct multty_reactor {
+	int epfd;
+	size_t budget;
+	struct multty_reactin *inflows;
+	struct multty_reactin *readyhead;
+	struct multty_reactin **readytail;
+	int numready;
+};
+
+
+/* Append an inflow to the ready list.
+ */
+static void _mty_reactor_ready (MULTTY_REACTOR *reactor, struct multty_reactin *in) {
+	if (in->ready) {
+		return;
+	}
+	in->ready = true;
+	in->nextready = NULL;
+	*reactor->readytail = in;
+	reactor->readytail = &in->nextready;
+	reactor->numready++;
+}
+
+
+/* Take the first inflow from the ready list.
+ */
+static struct multty_reactin *_mty_reactor_next (MULTTY_REACTOR *reactor) {
+	struct multty_reactin *in = reactor->readyhead;
+	reactor->readyhead = in->nextready;
+	if (reactor->readyhead == NULL) {
+		reactor->readytail = &reactor->readyhead;
+	}
+	reactor->numready--;
+	in->ready = false;
+	return in;
+}
+
+
+/* Make an inflow ready again when mtyread() drained the queues
+ * that stopped it from reading.
+ */
+static void _mty_reactor_resume (void *resumedata) {
+	struct multty_reactin *in = resumedata;
+	_mty_reactor_ready (in->reactor, in);
+}
+
+
+/* Open a reactor, to serve many inflows from one thread.  It waits for input with epoll, and only dispatches
+ * the inflows that are ready.
+ *
+ * Returns non-NULL pointer or NULL/errno.
+ */
+MULTTY_REACTOR *mtyreactor (void) {
+	MULTTY_REACTOR *retval = malloc (sizeof (MULTTY_REACTOR));
+	if (retval == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset (retval, 0, sizeof (MULTTY_REACTOR));
+	retval->epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (retval->epfd < 0) {
+		free (retval);
+		return NULL;
+	}
+	retval->budget = MULTTY_REACTOR_BUDGET;
+	retval->readytail = &retval->readyhead;
+	return retval;
+}
+
+
+/* Close a reactor.  Its inflows are removed, but not closed.
+ */
+void mtyreactor_close (MULTTY_REACTOR *reactor) {
+	while (reactor->readyhead != NULL) {
+		struct multty_reactin *in = _mty_reactor_next (reactor);
+		if (in->dropped) {
+			free (in);
+		}
+	}
+	while (reactor->inflows != NULL) {
+		struct multty_reactin *in = reactor->inflows;
+		reactor->inflows = in->next;
+		_mty_inflow_onresume (in->flow, NULL, NULL);
+		free (in);
+	}
+	close (reactor->epfd);
+	free (reactor);
+}
+
+
+/* Return the epoll file descriptor of a reactor, so it can be
+ * embedded in another event loop.
+ */
+int mtyreactor_fd (MULTTY_REACTOR *reactor) {
+	return reactor->epfd;
+}
+
+
+/* Set the number of bytes that a reactor reads from one inflow
+ * in one round.  Use 0 for the default, MULTTY_REACTOR_BUDGET.
+ */
+void mtyreactor_budget (MULTTY_REACTOR *reactor, size_t budget) {
+	reactor->budget = (budget > 0) ? budget : MULTTY_REACTOR_BUDGET;
+}
+
+
+/* Add an inflow to a reactor.  Its file descriptor is made
+ * non-blocking and is watched edge-triggered.  It starts out
+ * as ready, because input may have arrived before.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyreactor_add_inflow (MULTTY_REACTOR *reactor, MULTTY_INFLOW *flow,
+			mtycb_inflow_end *opt_end, void *userdata) {
+	int fd = _mty_inflow_fd (flow);
+	int flags = fcntl (fd, F_GETFL);
+	if ((flags < 0) || (fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		return false;
+	}
+	struct multty_reactin *in = malloc (sizeof (struct multty_reactin));
+	if (in == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	memset (in, 0, sizeof (struct multty_reactin));
+	in->reactor = reactor;
+	in->flow = flow;
+	in->cb_end = opt_end;
+	in->cb_enddata = userdata;
+	struct epoll_event evt = {
+		.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+		.data.ptr = in,
+	};
+	if (epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, fd, &evt) < 0) {
+		free (in);
+		return false;
+	}
+	in->next = reactor->inflows;
+	reactor->inflows = in;
+	_mty_inflow_onresume (flow, _mty_reactor_resume, in);
+	_mty_reactor_ready (reactor, in);
+	return true;
+}
+
+
+/* Remove an inflow from a reactor.  It is not closed.  This
+ * may be done from a callback.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyreactor_drop_inflow (MULTTY_REACTOR *reactor, MULTTY_INFLOW *flow) {
+	struct multty_reactin **herep = &reactor->inflows;
+	while ((*herep != NULL) && ((*herep)->flow != flow)) {
+		herep = &(*herep)->next;
+	}
+	struct multty_reactin *in = *herep;
+	if (in == NULL) {
+		errno = ENOENT;
+		return false;
+	}
+	*herep = in->next;
+	epoll_ctl (reactor->epfd, EPOLL_CTL_DEL, _mty_inflow_fd (flow), NULL);
+	_mty_inflow_onresume (flow, NULL, NULL);
+	if (in->ready || in->busy) {
+		in->dropped = true;
+	} else {
+		free (in);
+	}
+	return true;
+}
+
+
+/* Return the number of milliseconds until a reactor needs to
+ * run, in the form used by poll().
+ */
+int mtyreactor_timeout (MULTTY_REACTOR *reactor) {
+	return (reactor->readyhead != NULL) ? 0 : -1;
+}
+
+
+/* Serve an inflow that is ready, until it has no more input or
+ * used up its budget.  An inflow that ends is dropped and its
+ * end is reported.
+ */
+static void _mty_reactor_serve (MULTTY_REACTOR *reactor, struct multty_reactin *in) {
+	size_t used = 0;
+	ssize_t gotten;
+	in->busy = true;
+	while ((gotten = _mty_inflow_dispatch (in->flow)) > 0) {
+		used += gotten;
+		if ((used >= reactor->budget) || in->dropped) {
+			break;
+		}
+	}
+	int error = (gotten < 0) ? errno : 0;
+	in->busy = false;
+	if (in->dropped) {
+		free (in);
+	} else if (gotten > 0) {
+		//
+		// Budget used up, continue in the next round
+		_mty_reactor_ready (reactor, in);
+	} else if ((error == EAGAIN) || (error == EWOULDBLOCK)) {
+		//
+		// Drained, epoll reports when more input arrives
+		;
+	} else if ((error == ENOBUFS) && _mty_inflow_backlog (in->flow)) {
+		//
+		// Queues are full, mtyread() makes it ready again
+		;
+	} else if ((error == EINTR) || (error == ENOBUFS)) {
+		//
+		// Try again in the next round
+		_mty_reactor_ready (reactor, in);
+	} else {
+		//
+		// End of input or an error; drop the inflow and report
+		MULTTY_INFLOW *flow = in->flow;
+		mtycb_inflow_end *cb_end = in->cb_end;
+		void *cb_enddata = in->cb_enddata;
+		mtyreactor_drop_inflow (reactor, flow);
+		if (cb_end != NULL) {
+			cb_end (flow, cb_enddata, error);
+		}
+	}
+}
+
+
+/* Run one round of a reactor.  It waits up to timeout_ms for
+ * input, and then reads and dispatches each inflow that is
+ * ready.
+ *
+ * Returns the number of inflows served, or else -1/errno.
+ */
+int mtyreactor_run (MULTTY_REACTOR *reactor, int timeout_ms) {
+	//
+	// Do not wait beyond the first thing that needs doing
+	int due = mtyreactor_timeout (reactor);
+	if ((due >= 0) && ((timeout_ms < 0) || (due < timeout_ms))) {
+		timeout_ms = due;
+	}
+	//
+	// Collect the inflows that epoll reports as ready
+	struct epoll_event evts [MULTTY_REACTOR_EVENTS];
+	int numevts = epoll_wait (reactor->epfd, evts, MULTTY_REACTOR_EVENTS, timeout_ms);
+	if (numevts < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+		numevts = 0;
+	}
+	int i;
+	for (i = 0; i < numevts; i++) {
+		_mty_reactor_ready (reactor, evts [i].data.ptr);
+	}
+	//
+	// Serve the inflows that were ready at the start of the round
+	int served = reactor->numready;
+	for (i = 0; i < served; i++) {
+		struct multty_reactin *in = _mty_reactor_next (reactor);
+		if (in->dropped) {
+			free (in);
+			continue;
+		}
+		_mty_reactor_serve (reactor, in);
+	}
+	return served;
+}
@@ -0,0 +1,180 @@
+/* mulTTY -> rings from one thread to another
+ *
+ * Input is split over worker threads through rings that each
+ * have one producer and one consumer.  The producer only moves
+ * the tail and the consumer only moves the head, so records
+ * pass without a lock.  Only a side that runs out of records
+ * or space goes to sleep, and it is only woken when the other
+ * side sees that it is waiting.
+ *
+ * Records are held in one piece.  One that would wrap around
+ * the end of the ring starts at its beginning, and a marker is
+ * left at the end for the consumer to skip.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+#include <sched.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* Each record starts with its length in a header that keeps the
+ * record aligned.  The marker length skips to the start.
+ */
+#define MTY_SPSC_HEAD 8
+#define MTY_SPSC_WRAP 0xffffffff
+#define _MTY_SPSC_NEED(len) (MTY_SPSC_HEAD + (((len) + 7) & ~7))
+
+
+/* The number of times to yield before going to sleep.
+ */
+#define MTY_SPSC_SPINS 64
+
+
+/* INTERNAL ROUTINE to setup a ring of size bytes, a power of two,
+ * for records of up to half of that.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_spsc_init (struct multty_spsc *ring, unsigned size) {
+	memset (ring, 0, sizeof (struct multty_spsc));
+	ring->buf = malloc (size);
+	if (ring->buf == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	ring->size = size;
+	pthread_mutex_init (&ring->mutex, NULL);
+	pthread_cond_init (&ring->cond, NULL);
+	return true;
+}
+
+
+/* INTERNAL ROUTINE to cleanup a ring.
+ */
+void _mty_spsc_fini (struct multty_spsc *ring) {
+	pthread_cond_destroy (&ring->cond);
+	pthread_mutex_destroy (&ring->mutex);
+	free (ring->buf);
+}
+
+
+/* Wait until the ring holds at least the given number of bytes
+ * for the consumer, or has that much space for the producer.
+ * After a few turns, sleep until the other side signals.
+ */
+static void _mty_spsc_wait (struct multty_spsc *ring, bool consumer, unsigned want) {
+	int spins = 0;
+	while (true) {
+		unsigned held = atomic_load (&ring->tail) - atomic_load (&ring->head);
+		unsigned have = consumer ? held : (ring->size - held);
+		if (have >= want) {
+			return;
+		}
+		if (spins++ < MTY_SPSC_SPINS) {
+			sched_yield ();
+			continue;
+		}
+		pthread_mutex_lock (&ring->mutex);
+		atomic_store (&ring->waiting, true);
+		held = atomic_load (&ring->tail) - atomic_load (&ring->head);
+		have = consumer ? held : (ring->size - held);
+		if (have < want) {
+			pthread_cond_wait (&ring->cond, &ring->mutex);
+		}
+		atomic_store (&ring->waiting, false);
+		pthread_mutex_unlock (&ring->mutex);
+	}
+}
+
+
+/* Wake the other side if it is waiting.
+ */
+static void _mty_spsc_wake (struct multty_spsc *ring) {
+	if (atomic_load (&ring->waiting)) {
+		pthread_mutex_lock (&ring->mutex);
+		pthread_cond_signal (&ring->cond);
+		pthread_mutex_unlock (&ring->mutex);
+	}
+}
+
+
+/* INTERNAL ROUTINE for the producer to reserve a record of len
+ * bytes.  This waits while the ring is full.
+ *
+ * Returns the record to fill, aligned for any structure.
+ */
+void *_mty_spsc_reserve (struct multty_spsc *ring, unsigned len) {
+	unsigned need = _MTY_SPSC_NEED (len);
+	unsigned tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+	unsigned at = tail & (ring->size - 1);
+	//
+	// Leave a marker and start over when the record would wrap
+	if (at + need > ring->size) {
+		unsigned skip = ring->size - at;
+		_mty_spsc_wait (ring, false, skip);
+		* (uint32_t *) (ring->buf + at) = MTY_SPSC_WRAP;
+		atomic_store (&ring->tail, tail + skip);
+		_mty_spsc_wake (ring);
+		at = 0;
+	}
+	_mty_spsc_wait (ring, false, need);
+	return ring->buf + at + MTY_SPSC_HEAD;
+}
+
+
+/* INTERNAL ROUTINE for the producer to pass the record reserved
+ * with the same len to the consumer.
+ */
+void _mty_spsc_commit (struct multty_spsc *ring, unsigned len) {
+	unsigned tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+	* (uint32_t *) (ring->buf + (tail & (ring->size - 1))) = len;
+	atomic_store (&ring->tail, tail + _MTY_SPSC_NEED (len));
+	_mty_spsc_wake (ring);
+}
+
+
+/* INTERNAL ROUTINE for the consumer to get the next record.  This
+ * waits while the ring is empty.
+ *
+ * Returns the record and sets its len.
+ */
+void *_mty_spsc_peek (struct multty_spsc *ring, unsigned *len) {
+	while (true) {
+		_mty_spsc_wait (ring, true, MTY_SPSC_HEAD);
+		unsigned head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+		unsigned at = head & (ring->size - 1);
+		uint32_t reclen = * (uint32_t *) (ring->buf + at);
+		if (reclen != MTY_SPSC_WRAP) {
+			*len = reclen;
+			return ring->buf + at + MTY_SPSC_HEAD;
+		}
+		atomic_store (&ring->head, head + (ring->size - at));
+		_mty_spsc_wake (ring);
+	}
+}
+
+
+/* INTERNAL ROUTINE for the consumer to return a record with its
+ * len to the producer.
+ */
+void _mty_spsc_release (struct multty_spsc *ring, unsigned len) {
+	unsigned head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+	atomic_store (&ring->head, head + _MTY_SPSC_NEED (len));
+	_mty_spsc_wake (ring);
+}
+
+
+/* INTERNAL ROUTINE for the producer to wait until the consumer
+ * returned all records, so it is done with what they refer to.
+ * Records are released after they were handled, so an empty
+ * ring means that nothing is in progress.
+ */
+void _mty_spsc_drain (struct multty_spsc *ring) {
+	_mty_spsc_wait (ring, false, ring->size);
+}
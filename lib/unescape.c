@@ -11,6 +11,8 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 
 /* Given the number of bytes to be extracted from the
@@ -21,21 +23,18 @@
  * the remaining bytes.
  */
 int mtyinputsize (uint32_t escstyle, MULTTY *mty) {
-	int outsz = 0;
-	int ofs;
-	for (ofs = mty->rdofs; ofs < mty->fill; ofs++) {
-		uint8_t ch = mty->buf [ofs];
-		if (ch == c_DLE) {
-			/* <DLE> only occurs unescaped */
-			/* TODO: <DLE> before funnies? */
-			continue;
-		} else if (ch == c_SOH) {
-			break;
-		} else {
-			/* TODO: <NUL> and <IAC>? */
-			outsz++;
-		}
+	(void) escstyle;
+	if (mty->rdofs >= mty->fill) {
+		return 0;
 	}
+	//
+	// Every <DLE> is dropped and every other byte is delivered
+	/* TODO: <DLE> before funnies? */
+	/* TODO: <NUL> and <IAC>? */
+	size_t dles = 0;
+	size_t upto = _mty_inputscan (mty->buf + mty->rdofs,
+				mty->fill - mty->rdofs, &dles);
+	return upto - dles;
 }
 
 
@@ -71,20 +70,68 @@ int mtyinputsize (uint32_t escstyle, MULTTY *mty) {
  */
 int mtyunescape (uint32_t escstyle, MULTTY *mty,
 		uint8_t *dest, int destlen) {
+	(void) escstyle;
 	int destout = 0;
+	int rdofs = mty->rdofs;
+	int fill  = mty->fill;
+	const uint8_t *buf = mty->buf;
 	bool got_dle = mty->got_dle;
-	while ((destout < destlen) && (mty->rdofs < mty->fill)) {
-		uint8_t bufc = mty->buf [mty->rdofs++];
+	bool dense = false;
+	while ((destout < destlen) && (rdofs < fill)) {
+		//
+		// Escapes came close together; unescape a stretch by
+		// hand before calling on a vectorised search again
+		if (dense) {
+			int stretch = fill - rdofs;
+			if (stretch > destlen - destout) {
+				stretch = destlen - destout;
+			}
+			if (stretch > 64) {
+				stretch = 64;
+			}
+			int dles = 0;
+			while (stretch-- > 0) {
+				uint8_t bufc = buf [rdofs++];
+				if (got_dle) {
+					dest [destout++] = bufc ^ 0x40;
+					got_dle = false;
+				} else if (bufc == c_DLE) {
+					got_dle = true;
+					dles++;
+				} else {
+					dest [destout++] = bufc;
+				}
+			}
+			dense = (dles > 0);
+			continue;
+		}
+		//
+		// Complete a <DLE> escape, possibly from a previous call
 		if (got_dle) {
-			dest [destout++] = bufc ^ 0x40;
+			dest [destout++] = buf [rdofs++] ^ 0x40;
 			got_dle = false;
-		} else if (bufc == c_DLE) {
+			continue;
+		}
+		//
+		// Copy the clean span up to the next <DLE> in one go
+		int span = fill - rdofs;
+		if (span > destlen - destout) {
+			span = destlen - destout;
+		}
+		const uint8_t *dle = memchr (buf + rdofs, c_DLE, span);
+		int clean = (dle != NULL) ? (dle - (buf + rdofs)) : span;
+		memcpy (dest + destout, buf + rdofs, clean);
+		destout += clean;
+		rdofs   += clean;
+		//
+		// Consume the <DLE> and escape the next byte
+		if (dle != NULL) {
+			rdofs++;
 			got_dle = true;
-		} else {
-			dest [destout++] = bufc;
+			dense = (clean < 16);
 		}
 	}
+	mty->rdofs = rdofs;
 	mty->got_dle = got_dle;
 	return destout;
 }
-
@@ -0,0 +1,365 @@
+/* mulTTY -> buffered output modes for handles
+ *
+ * Output to a MULTTY handle is normally sent right away, so every
+ * mtyputs() or mtywrite() costs a system call, even for a single
+ * character.  Like setvbuf() for a FILE, a handle may instead
+ * collect output in its buffer.  Fully buffered output is sent
+ * when the buffer reaches ATOMIC_SEND_MAX, line buffered output
+ * also up to the end of a line.  What is left is sent when the
+ * program exits.
+ *
+ * A deadline sends pending output after a number of microseconds,
+ * so interactive streams keep a low latency.  Handles with output
+ * pending for a deadline are listed with their outflow, in the
+ * order in which they are due.  A timerfd that expires for the
+ * first can be polled by the application.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/timerfd.h>
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* Handles with a buffering mode are listed, so their output can
+ * be sent when the program exits.  That is setup on first use.
+ */
+static pthread_mutex_t _mty_vbuf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MULTTY *_mty_vbuf_handles = NULL;
+static bool _mty_vbuf_atexit_done = false;
+
+
+/* Send the buffered output of all handles when the program exits.
+ * Their outflows are synced, in case the output was queued.
+ */
+static void _mty_vbuf_atexit (void) {
+	pthread_mutex_lock (&_mty_vbuf_mutex);
+	MULTTY *mty;
+	for (mty = _mty_vbuf_handles; mty != NULL; mty = mty->nextvbuf) {
+		if (mty->fill > mty->shift) {
+			mtyflush (mty);
+			mtyoutflow_sync (_MTY_FLOW (mty->flow));
+		}
+	}
+	pthread_mutex_unlock (&_mty_vbuf_mutex);
+}
+
+
+/* Remove a handle from the list of buffered handles, while locked.
+ */
+static void _mty_vbuf_unlist (MULTTY *mty) {
+	MULTTY **herep = &_mty_vbuf_handles;
+	while ((*herep != NULL) && (*herep != mty)) {
+		herep = &(*herep)->nextvbuf;
+	}
+	if (*herep == mty) {
+		*herep = mty->nextvbuf;
+	}
+	mty->nextvbuf = NULL;
+}
+
+
+/* Set the buffering mode of a MULTTY handle to _IONBF, _IOLBF or
+ * _IOFBF.  Unbuffered output, the default, is sent right away.
+ * Fully buffered output is collected until it fills a unit of
+ * ATOMIC_SEND_MAX, and line buffered output is sent up to the
+ * last <LF> of every call that writes one.  Buffered output is
+ * sent on mtyflush() and mtyclose(), and when the program exits
+ * normally.  See mtysetdeadline() to send it after a given time.
+ *
+ * Buffers come from a pool, so buf must be NULL and the size is
+ * ignored.  Setting _IONBF sends any pending output.
+ *
+ * Drop-in replacement for setvbuf() with FILE changed to MULTTY.
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtysetvbuf (MULTTY *mty, char *buf, int mode, size_t size) {
+	(void) size;
+	if ((buf != NULL) || ((mode != _IONBF) && (mode != _IOLBF) && (mode != _IOFBF))) {
+		errno = EINVAL;
+		return EOF;
+	}
+	if ((mode == _IONBF) && (mty->fill > mty->shift) && (mtyflush (mty) != 0)) {
+		return EOF;
+	}
+	pthread_mutex_lock (&_mty_vbuf_mutex);
+	if ((mode != _IONBF) && !_mty_vbuf_atexit_done) {
+		if (atexit (_mty_vbuf_atexit) != 0) {
+			pthread_mutex_unlock (&_mty_vbuf_mutex);
+			errno = ENOMEM;
+			return EOF;
+		}
+		_mty_vbuf_atexit_done = true;
+	}
+	if ((mode != _IONBF) && (mty->vbufmode == _IONBF)) {
+		mty->nextvbuf = _mty_vbuf_handles;
+		_mty_vbuf_handles = mty;
+	} else if ((mode == _IONBF) && (mty->vbufmode != _IONBF)) {
+		_mty_vbuf_unlist (mty);
+	}
+	mty->vbufmode = mode;
+	pthread_mutex_unlock (&_mty_vbuf_mutex);
+	return 0;
+}
+
+
+/* INTERNAL ROUTINE to stop buffering for a MULTTY handle that is
+ * closed, after its output was sent.
+ */
+void _mty_vbuf_drop (MULTTY *mty) {
+	if (mty->vbufmode == _IONBF) {
+		return;
+	}
+	pthread_mutex_lock (&_mty_vbuf_mutex);
+	_mty_vbuf_unlist (mty);
+	mty->vbufmode = _IONBF;
+	pthread_mutex_unlock (&_mty_vbuf_mutex);
+}
+
+
+/* Set a deadline for the buffered output of a MULTTY handle, so
+ * output that is pending is sent deadline_usec microseconds after
+ * it was first written.  The value 0 removes the deadline.
+ *
+ * Deadlines are met by mtyoutflow_flushdue(), which is called by
+ * the application when the timer from mtyoutflow_timerfd()
+ * expires.
+ * Handles with a deadline should be written from the thread that
+ * makes this call.
+ */
+void mtysetdeadline (MULTTY *mty, unsigned deadline_usec) {
+	mty->deadline_usec = deadline_usec;
+}
+
+
+/* Set the timer of an outflow, while locked, to expire when the
+ * first handle is due, or stop it when none are.
+ */
+static void _mty_due_arm (MULTTY_OUTFLOW *flow) {
+	if (flow->timerfd < 0) {
+		return;
+	}
+	struct itimerspec its;
+	memset (&its, 0, sizeof (its));
+	if (flow->duelist != NULL) {
+		its.it_value = flow->duelist->due;
+	}
+	timerfd_settime (flow->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+
+/* Test if a time lies after another.
+ */
+static bool _mty_after (const struct timespec *t1, const struct timespec *t2) {
+	return (t1->tv_sec != t2->tv_sec) ? (t1->tv_sec > t2->tv_sec) : (t1->tv_nsec > t2->tv_nsec);
+}
+
+
+/* List a handle with pending output with its outflow, to be sent
+ * when its deadline passes.
+ */
+static void _mty_due_add (MULTTY *mty) {
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (mty->flow);
+	clock_gettime (CLOCK_MONOTONIC, &mty->due);
+	mty->due.tv_sec  += mty->deadline_usec / 1000000;
+	mty->due.tv_nsec += (mty->deadline_usec % 1000000) * 1000;
+	if (mty->due.tv_nsec >= 1000000000) {
+		mty->due.tv_sec++;
+		mty->due.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock (&flow->queue.mutex);
+	MULTTY **herep = &flow->duelist;
+	while ((*herep != NULL) && !_mty_after (&(*herep)->due, &mty->due)) {
+		herep = &(*herep)->nextdue;
+	}
+	mty->nextdue = *herep;
+	*herep = mty;
+	mty->duelisted = true;
+	if (flow->duelist == mty) {
+		_mty_due_arm (flow);
+	}
+	pthread_mutex_unlock (&flow->queue.mutex);
+}
+
+
+/* INTERNAL ROUTINE to remove a handle from the list of handles
+ * that are due on its outflow, after its output was sent.
+ */
+void _mty_due_drop (MULTTY *mty) {
+	if (!mty->duelisted) {
+		return;
+	}
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (mty->flow);
+	pthread_mutex_lock (&flow->queue.mutex);
+	MULTTY **herep = &flow->duelist;
+	while ((*herep != NULL) && (*herep != mty)) {
+		herep = &(*herep)->nextdue;
+	}
+	if (*herep == mty) {
+		*herep = mty->nextdue;
+		if (herep == &flow->duelist) {
+			_mty_due_arm (flow);
+		}
+	}
+	mty->duelisted = false;
+	pthread_mutex_unlock (&flow->queue.mutex);
+}
+
+
+/* Escape bytes into the buffer of a MULTTY handle, and send the
+ * buffer whenever it fills up.  The bytes consumed are added to
+ * *done, also when this fails.
+ *
+ * Returns true on success, or else false/errno.
+ */
+static bool _mty_vbufput (uint32_t style, MULTTY *mty,
+			const uint8_t *ptr, size_t len, ssize_t *done) {
+	while (len > 0) {
+		size_t esc = mtyescape (style, mty, ptr, len);
+		*done += esc;
+		ptr   += esc;
+		len   -= esc;
+		if (len == 0) {
+			break;
+		}
+		//
+		// The buffer is full, or none could be attached
+		if ((esc == 0) && ((mty->buf == NULL) || (mty->fill == mty->shift))) {
+			return false;
+		}
+		if (mtyflush (mty) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/* INTERNAL ROUTINE to escape data from an iovec array into the
+ * buffer of a MULTTY handle, for its buffering mode.  A buffer
+ * that is full is sent.  A line buffer is sent up to the last
+ * <LF>, and what follows it stays in the buffer.  Output that
+ * remains may wait for the deadline of the handle.
+ *
+ * Returns the number of bytes consumed from iov on success,
+ * or else -1/errno when nothing could be buffered.
+ */
+ssize_t _mty_vbufwritev (uint32_t style, MULTTY *mty,
+			const struct iovec *iov, int iovcnt) {
+	ssize_t done = 0;
+	//
+	// Find the last <LF> for line buffering
+	int lastlf = -1;
+	size_t uptolf = 0;
+	int i;
+	for (i = iovcnt - 1; (i >= 0) && (lastlf < 0) && (mty->vbufmode == _IOLBF); i--) {
+		const uint8_t *ptr = iov [i].iov_base;
+		size_t len = iov [i].iov_len;
+		while ((len > 0) && (ptr [len - 1] != '\n')) {
+			len--;
+		}
+		if (len > 0) {
+			lastlf = i;
+			uptolf = len;
+		}
+	}
+	for (i = 0; i < iovcnt; i++) {
+		const uint8_t *ptr = iov [i].iov_base;
+		size_t len = iov [i].iov_len;
+		if (i == lastlf) {
+			if (!_mty_vbufput (style, mty, ptr, uptolf, &done) || (mtyflush (mty) != 0)) {
+				return (done > 0) ? done : -1;
+			}
+			ptr += uptolf;
+			len -= uptolf;
+		}
+		if (!_mty_vbufput (style, mty, ptr, len, &done)) {
+			return (done > 0) ? done : -1;
+		}
+	}
+	if ((mty->fill > mty->shift) && (mty->deadline_usec > 0) && !mty->duelisted) {
+		_mty_due_add (mty);
+	}
+	return done;
+}
+
+
+/* Return a timerfd that expires when buffered output on an outflow
+ * is due, see mtysetdeadline().  The application can poll it and
+ * call mtyoutflow_flushdue() when it is readable.  The timerfd is
+ * made on the first call, and closed with the outflow.
+ *
+ * Returns the file descriptor on success, or else -1/errno.
+ */
+int mtyoutflow_timerfd (MULTTY_OUTFLOW *flow) {
+	pthread_mutex_lock (&flow->queue.mutex);
+	if (flow->timerfd < 0) {
+		flow->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		_mty_due_arm (flow);
+	}
+	int retval = flow->timerfd;
+	pthread_mutex_unlock (&flow->queue.mutex);
+	return retval;
+}
+
+
+/* Send the buffered output on an outflow for which the deadline
+ * has passed, see mtysetdeadline().  The timerfd is reset for the
+ * next handle that will be due.
+ *
+ * Returns 0 on success, else EOF/errno.
+ */
+int mtyoutflow_flushdue (MULTTY_OUTFLOW *flow) {
+	int retval = 0;
+	if (flow->timerfd >= 0) {
+		uint64_t expired;
+		if (read (flow->timerfd, &expired, sizeof (expired)) < 0) {
+			;
+		}
+	}
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	while (true) {
+		pthread_mutex_lock (&flow->queue.mutex);
+		MULTTY *mty = flow->duelist;
+		if ((mty == NULL) || _mty_after (&mty->due, &now)) {
+			_mty_due_arm (flow);
+			pthread_mutex_unlock (&flow->queue.mutex);
+			break;
+		}
+		flow->duelist = mty->nextdue;
+		mty->duelisted = false;
+		pthread_mutex_unlock (&flow->queue.mutex);
+		if (mtyflush (mty) != 0) {
+			retval = EOF;
+		}
+	}
+	return retval;
+}
+
+
+/* Return the number of milliseconds until buffered output on an
+ * outflow is due to be sent with mtyoutflow_flushdue(), in the
+ * form used by poll().  This is -1 when nothing has a deadline,
+ * and 0 when output is overdue.
+ */
+int mtyoutflow_flushdue_timeout (MULTTY_OUTFLOW *flow) {
+	int retval = -1;
+	pthread_mutex_lock (&flow->queue.mutex);
+	if (flow->duelist != NULL) {
+		struct timespec now;
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		long msec = (flow->duelist->due.tv_sec  - now.tv_sec ) * 1000L +
+		            (flow->duelist->due.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+		retval = (msec > 0) ? msec : 0;
+	}
+	pthread_mutex_unlock (&flow->queue.mutex);
+	return retval;
+}
@@ -5,53 +5,359 @@
  *  - after <SOH> take in naming, possible <US>, up to control; treat name as an opt_param
  *  - accept application sequences; not <DCx>, <SI>, <SO>, <EM>, <DLE>funnies, non<DLE>mixed
  *  - accept stream processing; <SI>, <SO>, <EM> with current stream
- *  - accept program multiplexing; <DCx>, <EM> without current stream
+ *  - accept program multiplexing; <DCx>, <EM> after <DC2>, each program with its own streams
+ *
+ * The grammar is parsed by a state machine that is fed byte
+ * ranges as they arrive, and keeps its state between reads so
+ * every byte is looked at once.  In Ragel notation, with "mixed"
+ * and "binary" for the bytes that these styles escape:
+ *
+ *   name    = ( any - binary )* ( US ( any - mixed - SO - SI )* )? ;
+ *   text    = ( ( any - mixed - SO - SI ) | DLE escaped )+ ;
+ *   control = SO | SI | EM | DC1 | DC2 | DC3 | DC4 ;
+ *   main   := ( ( SOH name )? ( control | text ) )* ;
+ *
+ * The input is held in a ring buffer.  Offsets count all input
+ * ever read, and the buffer position is the offset modulo the
+ * buffer size, which is a power of two.  This way, reading more,
+ * parsing and skipping bad bytes never move data around, and a
+ * byte string may wrap around the end of the buffer.
  *
  * From: Rick van Rein <rick@openfortress.nl>
  */
  
 
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <syslog.h>
+#include <time.h>
+
+#include <sys/uio.h>
 
 #include <arpa2/multty.h>
 
-#ifdef MULTTY_MIXED
-#incude "mtyp-int.h"
-#endif
+#include "mty-int.h"
+#include "uthash.h"
 
 
 struct multty_instream {
 	char *name;
-	struct multty_instream *next;
-	void (*cb_ready) ();
+	int namelen;
+	mtycb_ready *cb_ready;
 	void *cb_userdata;
+	MULTTY input;	/* view on input during cb_ready */
+	const bool *unesc;	/* escapes accepted, if unescaping */
+	uint8_t *unbuf;	/* unescaped input, if unescaping */
+	int unbufsize;
+	int unstart;	/* start of unbuf not yet delivered */
+	int unfill;
+	unsigned unbatch;	/* batch that unbuf content is for */
+	bool unbuf_own;
 	uint8_t shiftctl;
+	MULTTY_INFLOW *flow;	/* for mtyread(), if queued */
+	size_t qhigh;	/* high-water mark, if queued */
+	mtycb_pressure *cb_pressure;
+	void *cb_pressuredata;
+	bool queued;	/* input held in input.buf for mtyread() */
+	bool qfull;	/* reported as full to cb_pressure */
+	bool qstop;	/* counted in the backlog of the inflow */
+	size_t qin;	/* bytes queued in total, if queued */
+	size_t qout;	/* bytes read with mtyread() in total */
+	size_t *qends;	/* qin at each <EM> not yet read */
+	int numqends;
+	bool wk_dle;	/* <DLE> ends the last work item */
+	unsigned shard;	/* selects a worker, by program and name */
+	UT_hash_handle hh;
 };
 typedef struct multty_instream MULTTY_INSTREAM;
 
 
-struct multty_inflow {
-	int infd;
-	char buf [PIPE_BUF];
-	int wrofs;	/* where to write next */
-	int rdofs;	/* where to read  next */
-	int rdend;	/* where reading stopped */
-	int prenm;	/* points at name start, or is -1 */
-	int postnm;	/* points at control beyond name, or 0 */
-	int usofs;	/* points at optional <US> in name, or is 0 */
-#ifdef MULTTY_MIXED
-	MULTTY_PROG *curprog;
-#define default_stream curprog->TODO_INPUT_STREAM_LIST
-#define current_stream curprog->TODO_CURRENT_INPUT_STREAM
-#else
+/* The stream that holds a MULTTY handle for queued input, as
+ * returned by mtyregister_queue().
+ */
+#define _MTY_QUEUED(mty) ((MULTTY_INSTREAM *) (((uint8_t *) (mty)) - offsetof (MULTTY_INSTREAM, input)))
+
+
+/* Well-known stream names from doc/STREAMS.MD are placed by a
+ * perfect hash on their last two characters.  Their streams are
+ * found in a slot of the inflow, without hashing the full name.
+ */
+#define MTY_WELLKNOWN_SLOTS 32
+static const char *_mty_wellknown [MTY_WELLKNOWN_SLOTS] = {
+	[ 1] = "zmodem",
+	[ 8] = "stdout",
+	[11] = "sftp-s2c",
+	[18] = "stdin",
+	[20] = "stdopt",
+	[24] = "sasl",
+	[26] = "stderr",
+	[27] = "sftp-c2s",
+	[28] = "stdctl",
+};
+
+
+/* An alias for a stream or program name, see mtyinflow_aliases().
+ * Stream aliases are kept with their program, program aliases
+ * with their program set.
+ */
+struct multty_inalias {
+	unsigned num;
+	int namelen;
+	char name [35];
+	UT_hash_handle hh;
+};
+typedef struct multty_inalias MULTTY_INALIAS;
+
+
+/* A set of programs in input, with the program that is its
+ * parent.  Programs are found by name in a hash table, and the
+ * set remembers the current and previous program for <DC4>.
+ */
+struct multty_inprogset {
+	MULTTY_INPROG *programs;	/* hash table by name */
+	MULTTY_INALIAS *aliases;	/* hash table by number */
+	MULTTY_INPROG *current;
+	MULTTY_INPROG *previous;
+	MULTTY_INPROG *parent;
+};
+typedef struct multty_inprogset MULTTY_INPROGSET;
+
+
+/* A program in input, with its own streams.  Its name includes
+ * a trailing <US> if it was given with a description.  It may
+ * be the parent of a set of programs.
+ */
+struct multty_inprog {
+	char *name;
+	int namelen;
+	char *descr;
+	MULTTY_INPROGSET *set;	/* that holds this program */
+	MULTTY_INPROGSET *children;	/* with this program as parent */
 	MULTTY_INSTREAM  default_stream;
 	MULTTY_INSTREAM *current_stream;
-#endif
+	MULTTY_INSTREAM *named_streams;	/* hash table by name */
+	MULTTY_INSTREAM *wellknown [MTY_WELLKNOWN_SLOTS];
+	MULTTY_INALIAS *aliases;	/* hash table by number */
+	UT_hash_handle hh;
+};
+
+
+struct multty_inflow {
+	int infd;
+	unsigned bufsize;	/* ATOMIC_RECV_MIN, as a power of two */
+	unsigned pktmin;	/* ATOMIC_RECV_MIN for packet input, or 0 */
+	uint8_t *buf;
+	unsigned wrofs;	/* where to write next */
+	unsigned rdofs;	/* where to read  next */
+	unsigned rdend;	/* where reading stopped */
+	unsigned prenm;	/* points at name start, if named */
+	unsigned postnm;	/* points at control beyond name, or at rdofs */
+	unsigned usofs;	/* points at optional <US> in name, if has_us */
+	unsigned scan;	/* where the state machine continues */
+	unsigned nmmax;	/* longest name accepted, including <US> part */
+	uint8_t state;	/* state machine state, MTY_IN_xxx */
+	bool named;
+	bool has_us;
+	bool drop_name;	/* scanning a name that is too long */
+	bool aliases;	/* names may be "#N" or "#N=name" */
+	mtycb_batch *cb_batch;	/* batched dispatch, if not NULL */
+	void *cb_batchdata;
+	int numunits;	/* units collected for cb_batch */
+	unsigned batchnr;	/* counts batches delivered */
+	MULTTY_INUNIT units [MULTTY_INUNITS];
+	struct multty_instream *textstream;	/* stream for text being parsed */
+	struct multty_instream *unstream;	/* textstream, if unescaping */
+	unsigned unofs;	/* where unescaping continues */
+	int backlog;	/* queues that stop reading */
+	bool eof;	/* end of input was read */
+	void (*cb_resume) (void *resumedata);	/* when backlog clears */
+	void *cb_resumedata;
+	struct multty_worker *workers;	/* run callbacks, if not NULL */
+	int numworkers;
+	MULTTY_INPROG *curprog;	/* program that input is for */
+	MULTTY_INPROGSET *curset;	/* program set for <DCx> */
+	MULTTY_INPROG *endprog;	/* removed with <DC2>, awaits <EM> */
+	mtycb_inprog *cb_inprog;
+	void *cb_inprogdata;
+	MULTTY_INPROG rootprog;	/* input without program multiplexing */
+	MULTTY_INPROGSET topset;	/* programs with rootprog as parent */
 };
 typedef struct multty_inflow MULTTY_INFLOW;
 
 
+/* A worker thread runs the callbacks for a share of the streams
+ * of an inflow, see mtyinflow_workers().  It receives work items
+ * over a ring from the thread that reads and parses the input.
+ * Streams are spread over the workers by their program and name.
+ */
+#define MTY_WORKER_RING (1 << 20)
+struct multty_worker {
+	pthread_t thread;
+	struct multty_spsc ring;
+};
+
+
+/* A work item for a stream, followed by len bytes of escaped
+ * input for a callback.  Other items free an instream that was
+ * ended with <EM>, or stop the worker.
+ */
+enum {
+	MTY_WK_TEXT,
+	MTY_WK_FREE,
+	MTY_WK_STOP,
+};
+struct multty_workitem {
+	MULTTY_INSTREAM *mis;
+	int len;
+	int namelen;
+	uint8_t control;
+	uint8_t op;
+};
+
+
+/* The byte at an input offset, and the number of bytes from
+ * one offset up to another.
+ */
+#define _MTY_AT(flow,ofs) ((flow)->buf [(ofs) & ((flow)->bufsize - 1)])
+#define _MTY_UPTO(from,to) ((unsigned) ((to) - (from)))
+
+
+/* States of the inflow state machine, kept between reads.
+ * While running, the state is the position in the code of
+ * multty_vin_dispatch(), so the processor can predict the
+ * transitions.
+ */
+enum {
+	MTY_IN_UNIT,	/* at the start of a unit */
+	MTY_IN_NAME,	/* in a name after <SOH> */
+	MTY_IN_DESCR,	/* in a name after <US> */
+	MTY_IN_NAMED,	/* at the control after a name */
+	MTY_IN_TEXT,	/* in application text */
+	MTY_IN_TEXTDLE,	/* in application text, after <DLE> */
+	MTY_IN_STATES
+};
+
+
+/* Classes of input bytes, each treated alike in all states.
+ * Plain text may be skipped in bulk, see _mty_skiptext().
+ */
+enum {
+	MTY_CL_TEXT,	/* plain text */
+	MTY_CL_ESCD,	/* plain text that may follow <DLE> */
+	MTY_CL_CTL,	/* control code passed as text, ends name */
+	MTY_CL_SOH,	/* name prefix */
+	MTY_CL_US,	/* name description */
+	MTY_CL_SHIFT,	/* <SO> or <SI> stream shift */
+	MTY_CL_EM,	/* end of media */
+	MTY_CL_DCX,	/* program multiplexing, <DC1> to <DC4> */
+	MTY_CL_DLE,	/* escape */
+	MTY_CL_BAD,	/* always escaped, bad when it occurs */
+	MTY_CL_CLASSES
+};
+
+
+/* The class of each byte value, generated at compile time.
+ */
+#define _MTY_INCLASS(c) ( \
+	((c) == c_SOH) ? MTY_CL_SOH : \
+	((c) == c_US ) ? MTY_CL_US  : \
+	((c) == c_SO ) ? MTY_CL_SHIFT : \
+	((c) == c_SI ) ? MTY_CL_SHIFT : \
+	((c) == c_EM ) ? MTY_CL_EM  : \
+	(((c) >= c_DC1) && ((c) <= c_DC4)) ? MTY_CL_DCX : \
+	((c) == c_DLE) ? MTY_CL_DLE : \
+	_MTY_ESCWISH (MULTTY_ESC_MIXED,  (c)) ? MTY_CL_BAD : \
+	_MTY_ESCWISH (MULTTY_ESC_BINARY, (c)) ? MTY_CL_CTL : \
+	_MTY_ESCWISH (MULTTY_ESC_BINARY, (c) ^ 0x40) ? MTY_CL_ESCD : MTY_CL_TEXT )
+#define _MTY_INCLASS4(c) \
+	_MTY_INCLASS ((c)+0), _MTY_INCLASS ((c)+1), \
+	_MTY_INCLASS ((c)+2), _MTY_INCLASS ((c)+3)
+#define _MTY_INCLASS16(c) \
+	_MTY_INCLASS4 ((c)+0x0), _MTY_INCLASS4 ((c)+0x4), \
+	_MTY_INCLASS4 ((c)+0x8), _MTY_INCLASS4 ((c)+0xc)
+static const uint8_t _mty_inclass [256] = {
+	_MTY_INCLASS16 (0x00), _MTY_INCLASS16 (0x10),
+	_MTY_INCLASS16 (0x20), _MTY_INCLASS16 (0x30),
+	_MTY_INCLASS16 (0x40), _MTY_INCLASS16 (0x50),
+	_MTY_INCLASS16 (0x60), _MTY_INCLASS16 (0x70),
+	_MTY_INCLASS16 (0x80), _MTY_INCLASS16 (0x90),
+	_MTY_INCLASS16 (0xa0), _MTY_INCLASS16 (0xb0),
+	_MTY_INCLASS16 (0xc0), _MTY_INCLASS16 (0xd0),
+	_MTY_INCLASS16 (0xe0), _MTY_INCLASS16 (0xf0),
+};
+
+
+/* Round up a buffer size to a power of two.
+ */
+static unsigned _mty_ringsize (unsigned size) {
+	unsigned ringsize = 1;
+	while (ringsize < size) {
+		ringsize <<= 1;
+	}
+	return ringsize;
+}
+
+
+/* Describe len bytes of the ring buffer from offset ofs in
+ * one or two iovec entries, the second one for the part that
+ * wraps around to the start of the buffer.
+ *
+ * Returns the number of entries used.
+ */
+static int _mty_ringview (MULTTY_INFLOW *flow, unsigned ofs, unsigned len,
+			struct iovec view [2]) {
+	unsigned pos = ofs & (flow->bufsize - 1);
+	unsigned head = flow->bufsize - pos;
+	view [0].iov_base = flow->buf + pos;
+	if (len <= head) {
+		view [0].iov_len = len;
+		return 1;
+	}
+	view [0].iov_len = head;
+	view [1].iov_base = flow->buf;
+	view [1].iov_len = len - head;
+	return 2;
+}
+
+
+/* Skip plain text from an input offset, up to the first byte
+ * in the control set or <DLE>, <DEL> or 0xff, which are left
+ * for the parser to look at.  Text that wraps around the end
+ * of the ring buffer is scanned in two runs.
+ *
+ * Returns the offset of that byte, or flow->wrofs if none.
+ */
+static unsigned _mty_skiptext (MULTTY_INFLOW *flow, uint32_t ctlset, unsigned pos) {
+	//
+	// Short runs are not worth the setup of a vector kernel
+	if (_MTY_UPTO (pos, flow->wrofs) < 32) {
+		ctlset |= (1 << c_DLE);
+		while (pos != flow->wrofs) {
+			uint8_t c = _MTY_AT (flow, pos);
+			if ((c < 0x20) ? ((ctlset >> c) & 1) : ((c == 0x7f) || (c == 0xff))) {
+				break;
+			}
+			pos++;
+		}
+		return pos;
+	}
+	struct iovec view [2];
+	int viewc = _mty_ringview (flow, pos, _MTY_UPTO (pos, flow->wrofs), view);
+	int i;
+	for (i = 0; i < viewc; i++) {
+		size_t skip = _mty_ctlscan (ctlset, view [i].iov_base, view [i].iov_len);
+		pos += skip;
+		if (skip < view [i].iov_len) {
+			break;
+		}
+	}
+	return pos;
+}
+
+
 /* Open an inflow for a given file descriptor.
  *
  * Returns non-NULL pointer or NULL/errno.
@@ -68,375 +374,902 @@ MULTTY_INFLOW *mtyinflow (int infd) {
 	}
 	memset (retval, 0, sizeof (MULTTY_INFLOW));
 	retval->infd = infd;
-	retval->prenm = -1;
+	retval->nmmax = MULTTY_INNAME_MAX;
+	retval->rootprog.children = &retval->topset;
+	retval->rootprog.default_stream.shiftctl = c_SO;
+	retval->rootprog.current_stream = &retval->rootprog.default_stream;
+	retval->topset.parent = &retval->rootprog;
+	retval->curprog = &retval->rootprog;
+	retval->curset = &retval->topset;
+	//
+	// Packets are read whole, so the ring holds one behind a partial unit
+	unsigned recv_min = _mty_atomic_detect (infd);
+	if (_mty_atomic_packets (infd)) {
+		retval->pktmin = recv_min;
+		recv_min *= 2;
+	}
+	retval->bufsize = _mty_ringsize (recv_min);
+	retval->buf = malloc (retval->bufsize);
+	if (retval->buf == NULL) {
+		free (retval);
+		errno = ENOMEM;
+		return NULL;
+	}
 	return retval;
 }
 
 
-/* Close an inflow.
+/* Set the ATOMIC_RECV_MIN for an inflow, which is the buffer
+ * size needed to hold the largest atomic unit that senders may
+ * write.  Use 0 to detect it from the type of the input, which
+ * is also done by mtyinflow().  The value must lie between
+ * _POSIX_PIPE_BUF and MULTTY_ATOMIC_MAX, and it is rounded up
+ * to a power of two.  Datagram and sequential packet sockets
+ * get twice the size, so a whole packet fits behind a partial
+ * unit.  The buffer cannot shrink below the data it holds,
+ * which fails with EBUSY.
+ *
+ * Returns the new value on success, or else -1/errno.
  */
-void mtyinflow_close (MULTTY_INFLOW *flow) {
-	"TODO_CLOSE";
-	free (flow);
+int mtyinflow_atomic (MULTTY_INFLOW *flow, int recv_min) {
+	if (recv_min == 0) {
+		recv_min = _mty_atomic_detect (flow->infd);
+	}
+	if ((recv_min < _POSIX_PIPE_BUF) || (recv_min > MULTTY_ATOMIC_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	bool packets = _mty_atomic_packets (flow->infd);
+	unsigned ringsize = _mty_ringsize (packets ? 2 * recv_min : recv_min);
+	unsigned held = _MTY_UPTO (flow->rdofs, flow->wrofs);
+	if (ringsize < held) {
+		errno = EBUSY;
+		return -1;
+	}
+	uint8_t *newbuf = malloc (ringsize);
+	if (newbuf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	//
+	// Move the data held to the same offsets in the new ring
+	struct iovec view [2];
+	int viewc = _mty_ringview (flow, flow->rdofs, held, view);
+	unsigned ofs = flow->rdofs;
+	int i;
+	for (i = 0; i < viewc; i++) {
+		unsigned j;
+		for (j = 0; j < view [i].iov_len; j++) {
+			newbuf [ofs++ & (ringsize - 1)] = ((uint8_t *) view [i].iov_base) [j];
+		}
+	}
+	free (flow->buf);
+	flow->buf = newbuf;
+	flow->bufsize = ringsize;
+	flow->pktmin = packets ? recv_min : 0;
+	return ringsize;
+}
+
+
+/* Set the longest <SOH> name prefix that an inflow accepts,
+ * including any <US> and description.  Use 0 for the default,
+ * MULTTY_INNAME_MAX.  A longer name is reported and dropped,
+ * and so is a name that fills the input buffer.  The control
+ * code after a dropped name is dropped too, and so is the text
+ * that follows, up to a nameless shift or <EM>.
+ *
+ * Returns the new value on success, or else -1/errno.
+ */
+int mtyinflow_namemax (MULTTY_INFLOW *flow, int namemax) {
+	if (namemax == 0) {
+		namemax = MULTTY_INNAME_MAX;
+	}
+	if (namemax < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	flow->nmmax = namemax;
+	return namemax;
 }
 
 
-/* Reset the inflow to prepare it to process the next chunk.
- * This also enables pushing back content upon next read.
+/* Drop the aliases for a name, when its stream or program ends.
  */
-static void _mty_reset_inflow (MULTTY_INFLOW *flow) {
-	flow->prenm = -1;
-	flow->postnm = 0;
-	flow->usofs = 0;
-	flow->rdofs = flow->rdend;
+static void _mty_unalias (MULTTY_INALIAS **aliases, const char *name, int namelen) {
+	MULTTY_INALIAS *alias, *tmp;
+	HASH_ITER (hh, *aliases, alias, tmp) {
+		if ((alias->namelen == namelen) && (memcmp (alias->name, name, namelen) == 0)) {
+			HASH_DEL (*aliases, alias);
+			free (alias);
+		}
+	}
 }
 
 
-/* Remove togo characters at ofs in flow->buf.
- * Update flow->wrofs.
+/* Drop all the aliases in a table.
  */
-static void _mty_cutback (MULTTY_INFLOW *flow, int ofs, int togo) {
-	//TODO// if (flow->prenm >= 0) { ...syslog..."ignored <SOH> name prefix"... }
-	if (flow->wrofs > ofs+togo) {
-		memmove (flow->buf+ofs, flow->buf+ofs+togo, flow->wrofs-ofs-togo);
+static void _mty_unalias_all (MULTTY_INALIAS **aliases) {
+	MULTTY_INALIAS *alias, *tmp;
+	HASH_ITER (hh, *aliases, alias, tmp) {
+		HASH_DEL (*aliases, alias);
+		free (alias);
 	}
-	flow->wrofs -= togo;
 }
 
 
-/* Read additional bytes into buffer.
- *
- * Returns true on success, or false/errno.
+/* Free what an input stream holds, and the stream itself unless
+ * it is the default stream that is part of its program.
  */
-static bool _mty_readmore (MULTTY_INFLOW *flow) {
-	//
-	// Push back the memory buffer
-	//TODO// We can probably cut back if prenm==-1 too
-	if ((flow->prenm == -1) && (flow->rdofs > 0)) {
-		_mty_cutback (flow, 0, flow->rdofs);
-		flow->rdend -= flow->rdofs;
-		flow->rdofs = 0;
+static void _mty_instream_free (MULTTY_INSTREAM *mis, bool is_default) {
+	if (mis->unbuf_own) {
+		free (mis->unbuf);
 	}
-	//
-	// Check if any buffer space is available
-	if (flow->wrofs >= sizeof (flow->buf)) {
-		errno = ENOBUFS;
-		return false;
+	if (mis->queued) {
+		free (mis->input.buf);
+		free (mis->qends);
 	}
-	//
-	// Try to read from the file as much as we can store
-	ssize_t gotten = read (flow->infd, flow->buf + flow->wrofs, sizeof (flow->buf) - flow->wrofs);
-	if (gotten < 0) {
-		return false;
+	if (!is_default) {
+		free (mis);
 	}
-	flow->wrofs += gotten;
-	//
-	// Return success
-	return true;
 }
 
 
-/* Report a bad character by position (may be <DLE> prefixed).
- * Return the number of characters that would have to be skipped.
+/* Free a program that was taken out of its set, along with the
+ * programs below it, which end first.  The root program of the
+ * inflow only has its content freed.  Workers must be done with
+ * the streams.
  */
-static int _mty_badchar (MULTTY_INFLOW *flow, int badpos) {
-	//
-	// Log an error
-	int badlen = (flow->buf [badpos] == c_DLE) ? 2 : 1;
-	if (badlen == 2) {
-		syslog (LOG_ERR, "Bad escaped character 0x%02x in mulTTY input\n", flow->buf [badpos+1] ^ 0x40);
-	} else {
-		syslog (LOG_ERR, "Bad character 0x%02x in mulTTY input\n", flow->buf [badpos]);
+static void _mty_inprog_free (MULTTY_INFLOW *flow, MULTTY_INPROG *prog,
+			bool report, const char *opt_reason) {
+	if (prog->children != NULL) {
+		MULTTY_INPROG *child, *ctmp;
+		HASH_ITER (hh, prog->children->programs, child, ctmp) {
+			HASH_DEL (prog->children->programs, child);
+			_mty_inprog_free (flow, child, report, NULL);
+		}
+		_mty_unalias_all (&prog->children->aliases);
+		if (prog->children != &flow->topset) {
+			free (prog->children);
+		}
+	}
+	if (report && (flow->cb_inprog != NULL)) {
+		flow->cb_inprog (flow, flow->cb_inprogdata, prog, true, opt_reason);
+	}
+	MULTTY_INSTREAM *mis, *tmp;
+	HASH_ITER (hh, prog->named_streams, mis, tmp) {
+		HASH_DEL (prog->named_streams, mis);
+		_mty_instream_free (mis, false);
 	}
-	return badlen;
+	_mty_instream_free (&prog->default_stream, true);
+	_mty_unalias_all (&prog->aliases);
+	if (prog != &flow->rootprog) {
+		free (prog->name);
+		free (prog->descr);
+		free (prog);
+	}
+}
+
+
+/* Close an inflow, and free the streams and programs that it
+ * holds.  The file descriptor is not closed.
+ */
+void mtyinflow_close (MULTTY_INFLOW *flow) {
+	//TODO// Review what else needs to be closed
+	mtyinflow_workers (flow, 0);
+	if (flow->endprog != NULL) {
+		_mty_inprog_free (flow, flow->endprog, false, NULL);
+	}
+	_mty_inprog_free (flow, &flow->rootprog, false, NULL);
+	free (flow->buf);
+	free (flow);
 }
 
 
-/* Parse a potential <SOH> name prefix, setting postnm to the following control.
+/* Read additional bytes into buffer.  Everything before rdofs
+ * has been processed, so the ring can be filled up to there.
+ * Packet input is only read with room for ATOMIC_RECV_MIN, as
+ * the part of a packet that does not fit would be lost.
  *
- * Return true when sufficient information was available, false to defer.
- * The value flow->postnm is not set if false is returned.
+ * Returns the number of bytes read, 0 at the end of input,
+ * or else -1/errno.
  */
-static bool _mty_getname (MULTTY_INFLOW *flow) {
+static ssize_t _mty_readmore (MULTTY_INFLOW *flow) {
 	//
-	// We do need to see the first character
-	if (flow->wrofs <= flow->rdofs) {
-		return false;
+	// Check if enough buffer space is available
+	unsigned space = flow->bufsize - _MTY_UPTO (flow->rdofs, flow->wrofs);
+	if ((space == 0) || (space < flow->pktmin)) {
+		errno = ENOBUFS;
+		return -1;
 	}
 	//
-	// Done when there is no initial name
-	if (flow->buf [flow->rdofs] != c_SOH) {
-		flow->prenm = -1;
-		flow->postnm = 0;
-		return true;
+	// Try to read from the file as much as we can store
+	struct iovec view [2];
+	int viewc = _mty_ringview (flow, flow->wrofs, space, view);
+	ssize_t gotten = readv (flow->infd, view, viewc);
+	if (gotten > 0) {
+		flow->wrofs += gotten;
 	}
+	return gotten;
+}
+
+
+/* Report a bad character by position (may be <DLE> prefixed).
+ */
+static void _mty_badchar (MULTTY_INFLOW *flow, unsigned badpos) {
 	//
-	// Chase for a non-<US> control
-	int i = flow->rdofs + 1;
-	static const uint32_t ctl_no_us [2] = { MULTTY_ESC_BINARY, MULTTY_ESC_MIXED };
-	int phase = 0;
-	while (i < flow->wrofs) {
-		uint8_t c = flow->buf [i++];
-		if ((c == c_US) && (phase == 0)) {
-			//
-			// This character is <US> for the next phase of the name
-			flow->usofs = i - 1;
-			phase++;
-		} else if (mtyescapewish (ctl_no_us [phase], flow->buf [i])) {
-			//
-			// This is a control character, and not part of the name
-			// (Before <US> be really tight; after, avoid mulTTY confusion)
-			flow->prenm = flow->rdofs + 1;
-			flow->postnm = i - 1;
-			if (phase == 0) {
-				flow->usofs = 0;
-			}
-			return true;
-		}
+	// Log an error
+	if (_MTY_AT (flow, badpos) == c_DLE) {
+		syslog (LOG_ERR, "Bad escaped character 0x%02x in mulTTY input\n", _MTY_AT (flow, badpos+1) ^ 0x40);
+	} else {
+		syslog (LOG_ERR, "Bad character 0x%02x in mulTTY input\n", _MTY_AT (flow, badpos));
 	}
-	//
-	// We need more characters to determine the end of the name
-	return false;
 }
 
 
-/* Find an application byte string length in the input flow.
- * This stops at the end of wrbuf.  And at codes it cannot use.
- * Reasons to stop accepting characters are:
- *  - Things we always escape: MULTTY_ESC_MIXED
- *  - Things after <DLE> we never escape: MULTTY_ESC_BINARY
- *  - Control codes <SOH>, <EM>, <DCx>, <SI>, <SO>.
+/* Find the slot for a well-known stream name.
  *
- * Returns if bytes found after optional <SOH> name prefix.
- * Bytes include <DLE>.  Return value false for no appbytes.
- * Sole <DLE> is never returned, then always false/wait.  The
- * offset flow->rdend is set after the accepted byte string.
- *
- * Note that a returned app string length of 0 signals either
- * too little data or unsuitable data for app processing.
- * Further layers (stream splitting, program multiplexing)
- * will help to determine what is going on.  If nothing works,
- * report a bad character if there is enough content, then
- * wait for additional input and try again.  Locally detected
- * bad characters will be repaired with _mty_badchar().
+ * Returns the slot, or -1 if the name is not well-known.
  */
-static bool _mty_appstring (MULTTY_INFLOW *flow) {
-	int pos = flow->postnm;
-	int retval = 0;
-	uint8_t c, c2;
-	//
-	// Iterate over characters until we break
-	while (flow->wrofs > pos) {
-		c = flow->buf [pos];
-		//
-		// Special characters that are never acceptable
-		static const uint32_t higher_level_controls = (
-			(1<<c_SOH) | (1<<c_SI ) | (1<<c_SO ) | (1<<c_EM ) |
-			(1<<c_DC1) | (1<<c_DC2) | (1<<c_DC3) | (1<<c_DC4)
-		);
-		static const uint32_t always_esc_controls = MULTTY_ESC_MIXED;
-		if (mtyescapewish (higher_level_controls, c)) {
-			if (mtyescapewish (always_esc_controls, c)) {
-				//
-				// c is a bad character -- repair
-				// (This also removes <NUL> from the stream)
-				_mty_badchar (flow, pos);
-				_mty_cutback (flow, pos, 1);
-				continue;
-			} else {
-				//
-				// c may be for an upper layer
-				// (Stream switching or application multiplexing)
-				// (Though not a *higher* level, <SOH> breaks here too)
-				break;
-			}
-		}
-		//
-		// Special cases after <DLE>
-		if (c == c_DLE) {
-			if (flow->wrofs <= pos) {
-				//
-				// <DLE> in end position, leave it be
-				break;
-			}
-			//
-			// Test character after <DLE>
-			c2 = flow->buf [pos+1];
-			static const uint32_t tolerated_with_escape = MULTTY_ESC_BINARY;
-			if (!mtyescapewish (tolerated_with_escape, c2 ^ 0x40)) {
-				//
-				// <DLE>,c2 sequence is bad -- repair
-				// (Overzealously escaped, possibly evil)
-				_mty_badchar (flow, pos);
-				_mty_cutback (flow, pos, 2);
-				continue;
-			}
-			//
-			// Approve of <DLE>,c2
-			pos += 2;
-			continue;
-		}
+static int _mty_wellknown_slot (const char *name, int namelen) {
+	if (namelen < 2) {
+		return -1;
 	}
-	//
-	// Return the length found suitable as app string
-	flow->rdend = pos;
-	return pos > flow->postnm;
+	int slot = ((uint8_t) name [namelen-1] + 4 * (uint8_t) name [namelen-2])
+			& (MTY_WELLKNOWN_SLOTS - 1);
+	const char *known = _mty_wellknown [slot];
+	if ((known == NULL) || (strlen (known) != (size_t) namelen) || (memcmp (known, name, namelen) != 0)) {
+		return -1;
+	}
+	return slot;
 }
 
 
-/* Look for the input stream, by name or, if that is NULL,
- * by returning the default.  When opt_namelen<0 it will
+/* Look for the input stream of a program, by name or, if that
+ * is NULL, by returning the default.  When opt_namelen<0 it will
  * be determined with strlen(), otherwise it is considered
  * an actual string length.
  *
- * TODO: Flag to bypass creation if not found?
+ * Well-known names are found in their slot, other names in
+ * the hash table of the program.
  *
  * Returns the stream if it exists, else NULL/errno=ENOENT.
- * Errors are ENOMEM for allocation error or (TODO)
  */
-static MULTTY_INSTREAM *_mty_instream_byname (MULTTY_INFLOW *flow,
+static MULTTY_INSTREAM *_mty_instream_byname (MULTTY_INPROG *prog,
 			char *opt_name, int opt_namelen) {
-	MULTTY_INSTREAM *instream = &flow->default_stream;
-	bool notfound = (opt_name != NULL);
-	if (notfound && (opt_namelen < 0)) {
+	if (opt_name == NULL) {
+		return &prog->default_stream;
+	}
+	if (opt_namelen < 0) {
 		opt_namelen = strlen (opt_name);
 	}
-	while (notfound && (instream != NULL)) {
-		instream = instream->next;
-		notfound = (strncmp (instream->name, opt_name, opt_namelen) != 0)
-				|| (instream->name [opt_namelen] != '\0');
+	MULTTY_INSTREAM *instream;
+	int slot = _mty_wellknown_slot (opt_name, opt_namelen);
+	if (slot >= 0) {
+		instream = prog->wellknown [slot];
+	} else {
+		HASH_FIND (hh, prog->named_streams, opt_name, (unsigned) opt_namelen, instream);
 	}
-	if (notfound) {
+	if (instream == NULL) {
 		errno = ENOENT;
 	}
 	return instream;
 }
 
 
-/* Look for the input stream, named as in the flow, and otherwise
- * the current stream.  Update the current stream if one by its
- * name is found.
+/* Copy bytes from the ring, where they may wrap around, and
+ * end them with a <NUL> character.
+ */
+static void _mty_ringcopy (MULTTY_INFLOW *flow, unsigned ofs, unsigned len, char *dest) {
+	struct iovec view [2];
+	int viewc = _mty_ringview (flow, ofs, len, view);
+	memcpy (dest, view [0].iov_base, view [0].iov_len);
+	if (viewc > 1) {
+		memcpy (dest + view [0].iov_len, view [1].iov_base, view [1].iov_len);
+	}
+	dest [len] = '\0';
+}
+
+
+/* Copy the <SOH> name from the ring, without any <US> and
+ * description, into a buffer of 35 bytes.  With with_us, a <US>
+ * is appended if one was given, as in the name of a program.
+ *
+ * When aliases are enabled, a name "#N=name" binds the alias N
+ * to the name that follows it, and "#N" stands for that name.
  *
- * If it does not exist yet, create a new instream with the name.
+ * Returns the length of the name, or -1 for an unknown alias.
+ */
+static int _mty_name (MULTTY_INFLOW *flow, MULTTY_INALIAS **aliases,
+			bool with_us, char *name) {
+	unsigned from = flow->prenm;
+	unsigned end = flow->has_us ? flow->usofs : flow->postnm;
+	//
+	// Look for "#N" or "#N=" when aliases are enabled
+	bool bind = false;
+	unsigned num = 0;
+	if (flow->aliases && (from != end) && (_MTY_AT (flow, from) == '#')) {
+		unsigned pos = from + 1;
+		while ((pos != end) && (_MTY_AT (flow, pos) >= '0') && (_MTY_AT (flow, pos) <= '9')
+				&& (num < UINT_MAX / 10)) {
+			num = 10 * num + (_MTY_AT (flow, pos++) - '0');
+		}
+		if (pos == from + 1) {
+			;
+		} else if (pos == end) {
+			//
+			// Use the name bound to the alias
+			MULTTY_INALIAS *alias;
+			HASH_FIND (hh, *aliases, &num, sizeof (num), alias);
+			if (alias == NULL) {
+				return -1;
+			}
+			memcpy (name, alias->name, alias->namelen + 1);
+			return alias->namelen;
+		} else if (_MTY_AT (flow, pos) == '=') {
+			bind = true;
+			from = pos + 1;
+		}
+	}
+	unsigned nmlen = _MTY_UPTO (from, end);
+	unsigned nmlen_max = flow->has_us ? 33 : 32;
+	//
+	// Limit the name to 32 identifying characters
+	// of accept <US> for an extra length of 33.
+	if (nmlen > nmlen_max) {
+		//
+		// <US> lies too far off, stick to 32
+		nmlen = 32;
+	}
+	_mty_ringcopy (flow, from, nmlen, name);
+	if (with_us && flow->has_us) {
+		name [nmlen++] = c_US;
+		name [nmlen  ] = '\0';
+	}
+	//
+	// Bind the alias, replacing any name it had before
+	if (bind) {
+		MULTTY_INALIAS *alias;
+		HASH_FIND (hh, *aliases, &num, sizeof (num), alias);
+		if (alias == NULL) {
+			alias = malloc (sizeof (MULTTY_INALIAS));
+			if (alias != NULL) {
+				alias->num = num;
+				HASH_ADD (hh, *aliases, num, sizeof (num), alias);
+			}
+		}
+		if (alias != NULL) {
+			memcpy (alias->name, name, nmlen + 1);
+			alias->namelen = nmlen;
+		}
+	}
+	return nmlen;
+}
+
+
+/* Look for the input stream, named as in the flow, and otherwise
+ * the current stream of the current program.  A name updates the
+ * current stream, to NULL if no stream by its name is registered,
+ * so text without a name that follows it is dropped too.  Text
+ * without a name is for the current stream, until a nameless
+ * <SO>, <SI> or <EM> returns to the default stream.
  */
 static MULTTY_INSTREAM *_mty_instream (MULTTY_INFLOW *flow) {
+	MULTTY_INPROG *prog = flow->curprog;
 	MULTTY_INSTREAM *retval;
-	if (flow->prenm == -1) {
+	if (!flow->named) {
 		//
 		// Assume the current stream as unnamed default
-		retval = flow->current_stream;
+		retval = prog->current_stream;
 	} else {
 		//
 		// We have a name, so we should look for it
-		int nmlen, nmlen_max;
-		if (flow->usofs > 0) {
-			nmlen = flow->usofs  - flow->prenm;
-			nmlen_max = 33;
-		} else {
-			nmlen = flow->postnm -  flow->prenm;
-			nmlen_max = 32;
-		}
-		//
-		// Limit the name to 32 identifying characters
-		// of accept <US> for an extra length of 33.
-		if (nmlen > nmlen_max) {
-			//
-			// <US> lies too far off, stick to 32
-			nmlen = 32;
-		}
-		//
-		// Use the name to locate a stream
-		retval = _mty_instream_byname (flow, flow->buf + flow->prenm, nmlen);
-		if (retval != NULL) {
-			flow->current_stream = retval;
-		}
+		char name [35];
+		int nmlen = _mty_name (flow, &prog->aliases, false, name);
+		retval = (nmlen >= 0) ? _mty_instream_byname (prog, name, nmlen) : NULL;
+		prog->current_stream = retval;
 	}
 	return retval;
 }
 
 
-/* Handle application byte sequence by callback invocation.
+/* Deliver the units collected for batched dispatch.
  */
-static void _mty_appcb (MULTTY_INFLOW *flow) {
-	MULTTY_INSTREAM *mis = _mty_instream (flow);
-	//
-	// Only continue when the (named) flow exists
-	if (mis == NULL) {
-		return;
+static void _mty_batchcb (MULTTY_INFLOW *flow) {
+	if (flow->numunits > 0) {
+		flow->cb_batch (flow, flow->cb_batchdata, flow->units, flow->numunits);
+		flow->numunits = 0;
+		flow->batchnr++;
 	}
-	//
-	// Only continue when a callback is registered
-	if (mis->cb_ready == NULL) {
-		return;
-	}
-	//
-	// Invoke the callback (trust it to unescape data)
-	char ctl = flow->buf [flow->postnm];
-	mis->cb_ready (flow, mis->cb_userdata, ctl);
 }
 
 
-/* Process stream commands: <SI>, <SO>, and <EM> with current stream.
- * There may or may not have been a preceding <SOH> name prefix.
- *
- * Return if suitable control codes were found.
+/* The number of bytes at which a queued stream stops reading
+ * from the inflow.  With a pressure callback, there is room for
+ * the sender to react before this happens.
  */
-static bool _mty_streamctl (MULTTY_INFLOW *flow) {
-	//
-	// Fetch the control character
-	if (flow->rdend >= flow->wrofs) {
-		return false;
+static size_t _mty_qstop (MULTTY_INSTREAM *mis) {
+	return (mis->cb_pressure != NULL) ? (2 * mis->qhigh) : mis->qhigh;
+}
+
+
+/* Update the pressure of a queued stream after it grew or shrunk.
+ * Marks are set at their level and cleared below half of it, so
+ * small reads do not make them flip back and forth.
+ */
+static void _mty_qpressure (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis) {
+	size_t held = mis->input.fill - mis->input.rdofs;
+	size_t stop = _mty_qstop (mis);
+	if ((mis->cb_pressure != NULL) && (mis->qfull != (held >= mis->qhigh))) {
+		if (!mis->qfull || (held < mis->qhigh / 2)) {
+			mis->qfull = !mis->qfull;
+			mis->cb_pressure (&mis->input, mis->cb_pressuredata, mis->qfull);
+		}
 	}
-	uint8_t ctl = flow->buf [flow->rdend];
-	//
-	// Handle <SI> or <SO> codes, with or without <SOH> name
-	if ((ctl == c_SO) || (ctl == c_SI)) {
-		MULTTY_INSTREAM *newcur = _mty_instream (flow);
-		if (newcur->shiftctl == ctl) {
-			//
-			// The shift matches current status, so discard it
-			flow->rdend++;
-		} else {
-			//
-			// Include <SI> or <SO> in the application string
-			// and for now, take note of its new value
-			newcur->shiftctl = ctl;
+	if (!mis->qstop && (held >= stop)) {
+		mis->qstop = true;
+		flow->backlog++;
+	} else if (mis->qstop && (held < stop / 2)) {
+		mis->qstop = false;
+		if ((--flow->backlog == 0) && (flow->cb_resume != NULL)) {
+			flow->cb_resume (flow->cb_resumedata);
 		}
-		return true;
 	}
-	//
-	// Refuse to consider <EM> if there is no current stream
-	if (flow->current_stream == NULL) {
-		return false;
+}
+
+
+/* Add input bytes to the queue of a stream.  The queue may grow
+ * beyond its high-water mark by what was already read, but the
+ * inflow stops reading more until it is drained.
+ */
+static void _mty_enqueue (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis,
+			const uint8_t *ptr, int len) {
+	MULTTY *mty = &mis->input;
+	if ((mty->fill + len > mty->bufsize) && (mty->rdofs > 0)) {
+		memmove (mty->buf, mty->buf + mty->rdofs, mty->fill - mty->rdofs);
+		mty->fill -= mty->rdofs;
+		mty->rdofs = 0;
 	}
-	//
-	// Handle the <EM> stream control, with or without <SOH> report
-	if (ctl == c_EM) {
-		flow->rdend++;
-		// LL_DELETE (flow->input_streams, flow->current_stream);
-		MULTTY_INSTREAM **herep = &flow->default_stream.next;
-		while (*herep != NULL) {
-			if (flow->current_stream == *herep) {
-				*herep = flow->current_stream->next;
-				break;
-			}
-			herep = &(*herep)->next;
+	if (mty->fill + len > mty->bufsize) {
+		int newsize = 2 * mty->bufsize;
+		if (newsize < mty->fill + len) {
+			newsize = mty->fill + len;
 		}
-		//
-		// Remove and forget the current stream
-		free (flow->current_stream);
-		flow->current_stream = NULL;
-		return true;
+		uint8_t *newbuf = realloc (mty->buf, newsize);
+		if (newbuf == NULL) {
+			syslog (LOG_ERR, "Dropped %d bytes of mulTTY input for lack of memory\n", len);
+			return;
+		}
+		mty->buf = newbuf;
+		mty->bufsize = newsize;
 	}
-	//
-	// No recognised control codes
-	return false;
+	memcpy (mty->buf + mty->fill, ptr, len);
+	mty->fill += len;
+	mis->qin += len;
+	_mty_qpressure (flow, mis);
 }
 
 
-#ifdef MULTTY_MIXED
+/* Add an end marker to the queue of a stream, after the input
+ * that it holds, so mtyread() reports it in that position.
+ */
+static void _mty_enqueue_end (MULTTY_INSTREAM *mis) {
+	size_t *newends = realloc (mis->qends, (mis->numqends + 1) * sizeof (size_t));
+	if (newends == NULL) {
+		syslog (LOG_ERR, "Dropped <EM> of mulTTY input for lack of memory\n");
+		return;
+	}
+	mis->qends = newends;
+	mis->qends [mis->numqends++] = mis->qin;
+}
+
+
+/* Test if the input for a stream is passed to a worker.  This
+ * is not done for batched dispatch or queued streams, which are
+ * served by the thread that reads the input.
+ */
+static bool _mty_inworker (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis) {
+	return (flow->numworkers > 0) && (flow->cb_batch == NULL) && !mis->queued;
+}
+
+
+/* Pass a work item for a stream to its worker.  The items for
+ * one stream always go to the same worker, so they are handled
+ * in order.
+ */
+static void _mty_workput (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis,
+			uint8_t op, const uint8_t *ptr, int len) {
+	struct multty_worker *wk = &flow->workers [mis->shard % flow->numworkers];
+	unsigned itemlen = sizeof (struct multty_workitem) + len;
+	struct multty_workitem *item = _mty_spsc_reserve (&wk->ring, itemlen);
+	item->mis = mis;
+	item->op = op;
+	item->len = len;
+	item->namelen = -1;
+	item->control = c_NUL;
+	if ((op == MTY_WK_TEXT) && flow->named) {
+		item->namelen = mis->namelen;
+		item->control = _MTY_AT (flow, flow->postnm);
+	}
+	if (len > 0) {
+		memcpy (item + 1, ptr, len);
+	}
+	_mty_spsc_commit (&wk->ring, itemlen);
+}
+
+
+/* Deliver input bytes to a stream.  The callback for the
+ * stream receives them in its MULTTY handle.  For batched
+ * dispatch, they are collected as a unit instead.  Queued
+ * streams hold them for mtyread(), and with workers they are
+ * passed to the worker for the stream.
+ */
+static void _mty_deliver (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis,
+			uint8_t *ptr, int len) {
+	if (mis->queued) {
+		_mty_enqueue (flow, mis, ptr, len);
+		return;
+	}
+	if (_mty_inworker (flow, mis)) {
+		_mty_workput (flow, mis, MTY_WK_TEXT, ptr, len);
+		return;
+	}
+	//
+	// Pass the name and its control, if any
+	char *name = NULL;
+	int namelen = -1;
+	uint8_t ctl = c_NUL;
+	if (flow->named) {
+		name = mis->name;
+		namelen = mis->namelen;
+		ctl = _MTY_AT (flow, flow->postnm);
+	}
+	//
+	// Invoke the callback or add a unit to the batch
+	if (flow->cb_batch != NULL) {
+		if (flow->numunits == MULTTY_INUNITS) {
+			_mty_batchcb (flow);
+		}
+		MULTTY_INUNIT *unit = &flow->units [flow->numunits++];
+		unit->stream   = mis->name;
+		unit->userdata = mis->cb_userdata;
+		unit->ptr      = ptr;
+		unit->len      = len;
+		unit->name     = name;
+		unit->namelen  = namelen;
+		unit->control  = ctl;
+	} else {
+		mis->input.buf     = ptr;
+		mis->input.bufsize =
+		mis->input.fill    = len;
+		mis->input.rdofs   = 0;
+		mis->cb_ready (&mis->input, mis->cb_userdata, name, namelen, ctl);
+	}
+}
+
+
+/* Deliver the unescaped input that a stream holds.  For batched
+ * dispatch, the buffer fills up until the batch is delivered.
+ */
+static void _mty_undeliver (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis) {
+	if (mis->unfill > mis->unstart) {
+		_mty_deliver (flow, mis, mis->unbuf + mis->unstart, mis->unfill - mis->unstart);
+	}
+	if (flow->cb_batch != NULL) {
+		mis->unbatch = flow->batchnr;
+		mis->unstart = mis->unfill;
+	} else {
+		mis->unstart =
+		mis->unfill  = 0;
+	}
+}
+
+
+/* Make room in the unescape buffer of a stream.  It is reset
+ * when the batch that it was filled for was delivered.  When
+ * full, its content is delivered, along with the batch.
+ *
+ * Returns the number of bytes free.
+ */
+static int _mty_unroom (MULTTY_INFLOW *flow, MULTTY_INSTREAM *mis) {
+	if (mis->unbatch != flow->batchnr) {
+		mis->unbatch = flow->batchnr;
+		mis->unstart =
+		mis->unfill  = 0;
+	}
+	if (mis->unfill == mis->unbufsize) {
+		_mty_undeliver (flow, mis);
+		if (flow->cb_batch != NULL) {
+			_mty_batchcb (flow);
+			mis->unbatch = flow->batchnr;
+			mis->unstart =
+			mis->unfill  = 0;
+		}
+	}
+	return mis->unbufsize - mis->unfill;
+}
+
+
+/* Copy plain text from the ring to the unescape buffer of the
+ * stream that it is for, up to the given offset.
+ */
+static void _mty_uncopy (MULTTY_INFLOW *flow, unsigned ofs) {
+	MULTTY_INSTREAM *mis = flow->unstream;
+	while (flow->unofs != ofs) {
+		unsigned len = _MTY_UPTO (flow->unofs, ofs);
+		unsigned at  = flow->unofs & (flow->bufsize - 1);
+		if (len > flow->bufsize - at) {
+			len = flow->bufsize - at;
+		}
+		unsigned room = _mty_unroom (flow, mis);
+		if (len > room) {
+			len = room;
+		}
+		memcpy (mis->unbuf + mis->unfill, flow->buf + at, len);
+		mis->unfill += len;
+		flow->unofs += len;
+	}
+}
+
+
+/* Unescape the byte after a <DLE> into the unescape buffer of
+ * the stream that it is for.  The style of the stream must
+ * want to escape it.
+ *
+ * Returns true on success, or false for a bad escape.
+ */
+static bool _mty_unescd (MULTTY_INFLOW *flow, unsigned ofs) {
+	MULTTY_INSTREAM *mis = flow->unstream;
+	uint8_t c = _MTY_AT (flow, ofs) ^ 0x40;
+	if (!mis->unesc [c]) {
+		return false;
+	}
+	_mty_unroom (flow, mis);
+	mis->unbuf [mis->unfill++] = c;
+	flow->unofs = ofs + 1;
+	return true;
+}
+
+
+/* Start application text at the given offset, and find the
+ * stream that it is for.
+ */
+static void _mty_textstart (MULTTY_INFLOW *flow, unsigned ofs) {
+	flow->postnm = ofs;
+	flow->unofs = ofs;
+	MULTTY_INSTREAM *mis = _mty_instream (flow);
+	flow->textstream = mis;
+	flow->unstream = ((mis != NULL) && (mis->unesc != NULL) && !_mty_inworker (flow, mis)) ? mis : NULL;
+}
+
+
+/* Handle application byte sequence by callback invocation.
+ * The callback receives the input where it is in the ring,
+ * in two parts when it wraps around, or unescaped if the
+ * stream has an escape style.  For batched dispatch, the
+ * parts are collected as units instead.
+ */
+static void _mty_appcb (MULTTY_INFLOW *flow) {
+	MULTTY_INSTREAM *mis = flow->textstream;
+	//
+	// Only continue when the (named) flow exists
+	if (mis == NULL) {
+		return;
+	}
+	//
+	// Only continue when a callback is registered or input is queued
+	if ((mis->cb_ready == NULL) && (flow->cb_batch == NULL) && !mis->queued) {
+		return;
+	}
+	//
+	// Unescaped input was collected while parsing
+	if (mis == flow->unstream) {
+		_mty_undeliver (flow, mis);
+		return;
+	}
+	//
+	// Invoke the callback (trust it to unescape data)
+	struct iovec view [2];
+	int viewc = _mty_ringview (flow, flow->postnm, _MTY_UPTO (flow->postnm, flow->rdend), view);
+	int i;
+	for (i = 0; i < viewc; i++) {
+		_mty_deliver (flow, mis, view [i].iov_base, view [i].iov_len);
+	}
+}
+
+
+/* Process stream commands: <SI>, <SO>, and <EM> with current stream.
+ * There may or may not have been a preceding <SOH> name prefix.
+ *
+ * Return if suitable control codes were found.
+ */
+static bool _mty_streamctl (MULTTY_INFLOW *flow) {
+	//
+	// Fetch the control character
+	if (flow->rdend == flow->wrofs) {
+		return false;
+	}
+	uint8_t ctl = _MTY_AT (flow, flow->rdend);
+	//
+	// Handle <SI> or <SO> codes, with or without <SOH> name
+	if ((ctl == c_SO) || (ctl == c_SI)) {
+		MULTTY_INSTREAM *newcur;
+		if (flow->named) {
+			newcur = _mty_instream (flow);
+		} else {
+			//
+			// Without a name, return to the default stream
+			newcur = &flow->curprog->default_stream;
+			flow->curprog->current_stream = newcur;
+		}
+		if (newcur == NULL) {
+			return false;
+		}
+		if (newcur->shiftctl == ctl) {
+			//
+			// The shift matches current status, so discard it
+			flow->rdend++;
+		} else {
+			//
+			// Include <SI> or <SO> in the application string
+			// and for now, take note of its new value
+			newcur->shiftctl = ctl;
+		}
+		return true;
+	}
+	//
+	// Refuse to consider <EM> if it ends a program removed with <DC2>
+	MULTTY_INPROG *prog = flow->curprog;
+	if (flow->endprog != NULL) {
+		return false;
+	}
+	//
+	// Handle the <EM> stream control, with or without <SOH> report;
+	// the program returns to its default stream
+	if (ctl == c_EM) {
+		flow->rdend++;
+		MULTTY_INSTREAM *gone = prog->current_stream;
+		prog->current_stream = &prog->default_stream;
+		if (gone == NULL) {
+			//
+			// The stream was not registered
+			return true;
+		}
+		if (gone != &prog->default_stream) {
+			_mty_unalias (&prog->aliases, gone->name, gone->namelen);
+		}
+		if (gone->queued) {
+			//
+			// Queued input is kept for mtyread(), up to its end
+			_mty_enqueue_end (gone);
+			return true;
+		}
+		if (gone == &prog->default_stream) {
+			//
+			// The default stream is part of the program
+			return true;
+		}
+		HASH_DEL (prog->named_streams, gone);
+		if (flow->textstream == gone) {
+			flow->textstream =
+			flow->unstream = NULL;
+		}
+		int slot = _mty_wellknown_slot (gone->name, strlen (gone->name));
+		if ((slot >= 0) && (prog->wellknown [slot] == gone)) {
+			prog->wellknown [slot] = NULL;
+		}
+		//
+		// Forget the stream, after its worker is done with it
+		if (flow->numworkers > 0) {
+			_mty_workput (flow, gone, MTY_WK_FREE, NULL, 0);
+			return true;
+		}
+		_mty_instream_free (gone, false);
+		return true;
+	}
+	//
+	// No recognised control codes
+	return false;
+}
 
-/* Process multiplexing commands: <DCx>, and <EM> without current stream.
+
+/* Find the program named by <SOH> in a set, or add it when it
+ * is new.  A description after <US> is stored with it.
+ *
+ * Returns the program on success, or NULL/errno.
+ */
+static MULTTY_INPROG *_mty_inprog_have (MULTTY_INFLOW *flow, MULTTY_INPROGSET *set) {
+	char name [35];
+	int nmlen = _mty_name (flow, &set->aliases, true, name);
+	if (nmlen < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+	MULTTY_INPROG *prog;
+	HASH_FIND (hh, set->programs, name, (unsigned) nmlen, prog);
+	bool isnew = (prog == NULL);
+	if (isnew) {
+		prog = malloc (sizeof (MULTTY_INPROG));
+		char *key = malloc (nmlen + 1);
+		if ((prog == NULL) || (key == NULL)) {
+			free (prog);
+			free (key);
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset (prog, 0, sizeof (MULTTY_INPROG));
+		memcpy (key, name, nmlen + 1);
+		prog->name = key;
+		prog->namelen = nmlen;
+		prog->set = set;
+		prog->default_stream.shiftctl = c_SO;
+		HASH_ADD_KEYPTR (hh, set->programs, prog->name, nmlen, prog);
+		prog->default_stream.shard = prog->hh.hashv;
+	}
+	//
+	// Keep the last description given for the program
+	if (flow->has_us) {
+		unsigned dsclen = _MTY_UPTO (flow->usofs + 1, flow->postnm);
+		char *descr = realloc (prog->descr, dsclen + 1);
+		if (descr != NULL) {
+			_mty_ringcopy (flow, flow->usofs + 1, dsclen, descr);
+			prog->descr = descr;
+		}
+	}
+	//
+	// Report a new program once it is complete; its input starts
+	// on the default stream, after any streams are registered
+	if (isnew) {
+		if (flow->cb_inprog != NULL) {
+			flow->cb_inprog (flow, flow->cb_inprogdata, prog, false, NULL);
+		}
+		prog->current_stream = &prog->default_stream;
+	}
+	return prog;
+}
+
+
+/* Make a program the current one in its set.  The program that
+ * was current becomes the previous, for <DC4> to switch back;
+ * switching to the current program forgets the previous.
+ */
+static void _mty_inprog_current (MULTTY_INPROGSET *set, MULTTY_INPROG *prog) {
+	if (set->current == prog) {
+		set->previous = NULL;
+		return;
+	}
+	set->previous = set->current;
+	set->current = prog;
+}
+
+
+/* End the program that was removed with <DC2>.  With an <EM>
+ * and <SOH> name, that name is reported as the reason.  Workers
+ * first finish the work passed to them, so they are done with
+ * its streams.
+ */
+static void _mty_inprog_end (MULTTY_INFLOW *flow, bool with_reason) {
+	MULTTY_INPROG *prog = flow->endprog;
+	flow->endprog = NULL;
+	char *reason = NULL;
+	if (with_reason && flow->named) {
+		unsigned len = _MTY_UPTO (flow->prenm, flow->postnm);
+		reason = malloc (len + 1);
+		if (reason != NULL) {
+			_mty_ringcopy (flow, flow->prenm, len, reason);
+		}
+	}
+	int i;
+	for (i = 0; i < flow->numworkers; i++) {
+		_mty_spsc_drain (&flow->workers [i].ring);
+	}
+	flow->textstream =
+	flow->unstream = NULL;
+	_mty_inprog_free (flow, prog, true, reason);
+	free (reason);
+}
+
+
+/* Process multiplexing commands: <DCx>, and <EM> after <DC2>.
  * There may or may not have been a preceding <SOH> name prefix.
  *
  * Return if suitable control codes were found.
@@ -444,50 +1277,104 @@ static bool _mty_streamctl (MULTTY_INFLOW *flow) {
 static bool _mty_multiplexctl (MULTTY_INFLOW *flow) {
 	//
 	// Fetch the control character
-	if (flow->rdend >= flow->wrofs) {
+	if (flow->rdend == flow->wrofs) {
+		return false;
+	}
+	uint8_t ctl = _MTY_AT (flow, flow->rdend);
+	//
+	// Handle <EM> as the end of a program removed with <DC2>
+	if (ctl == c_EM) {
+		if (flow->endprog == NULL) {
+			return false;
+		}
+		_mty_inprog_end (flow, true);
+		flow->rdend++;
+		return true;
+	}
+	if ((ctl < c_DC1) || (ctl > c_DC4)) {
+		//
+		// Unknown control code, 0 bytes recognised
 		return false;
 	}
-	uint8_t ctl = flow->buf [flow->rdend];
 	//
-	// Handle <DC1> through <DC4> and <EM> control codes
+	// Without <EM>, a removed program ends without a reason
+	if (flow->endprog != NULL) {
+		_mty_inprog_end (flow, false);
+	}
+	//
+	// Find the program set to work on
 	// (Break to finish after recognised control code)
+	MULTTY_INPROGSET *set = flow->curset;
+	MULTTY_INPROG *prog = NULL;
 	switch (ctl) {
 	case c_PUP:	/* c_DC1 == c_PUP */
-		TODO_FROM_CURRENT_TO_PARENT;
-		TODO_SEARCH_SOH_AMONG_NEIGHBOURS;
+		if (set->parent->set == NULL) {
+			return false;
+		}
+		set = set->parent->set;
 		break;
 	case c_PRM:	/* c_DC2 == c_PRM */
-		TODO_SEARCH_SOH_AMONG_NEIGHHOURS;
-		TODO_REMOVE_CURRENT_PROGRAM;
 		break;
 	case c_PDN:	/* c_DC3 == c_PDN */
-		TODO_FROM_CURRENT_TO_CHILDSET;
-		TODO_SEARCH_SOH_AMONG_NEIGHBOURS;
+		if (set->current == NULL) {
+			return false;
+		}
+		if (set->current->children == NULL) {
+			MULTTY_INPROGSET *children = malloc (sizeof (MULTTY_INPROGSET));
+			if (children == NULL) {
+				return false;
+			}
+			memset (children, 0, sizeof (MULTTY_INPROGSET));
+			children->parent = set->current;
+			set->current->children = children;
+		}
+		set = set->current->children;
 		break;
 	case c_PSW:	/* c_DC4 == c_PSW */
-		TODO_SEARCH_SOH_AMONG_NEIGHBOURS;
-		break;
-	case c_EM:	/* Reason for recent program end */
-		if (flow->current_stream != NULL) {
+		if (!flow->named) {
 			//
-			// This must be handled by the stream
-			return false;
+			// Switch back to the previous program
+			if (set->previous == NULL) {
+				return false;
+			}
+			prog = set->previous;
 		}
-		TODO_HANDLE_EM;
 		break;
-	default:
-		//
-		// Unknown control code, 0 bytes recognised
-		return false;
 	}
 	//
-	// Control code was processed
+	// Search the <SOH> name among the programs in the set
+	if (flow->named) {
+		prog = _mty_inprog_have (flow, set);
+		if (prog == NULL) {
+			return false;
+		}
+	}
+	if (prog != NULL) {
+		_mty_inprog_current (set, prog);
+	}
+	//
+	// Remove the current program, to be ended by <EM> or later
+	if (ctl == c_PRM) {
+		prog = set->current;
+		if (prog == NULL) {
+			return false;
+		}
+		HASH_DEL (set->programs, prog);
+		_mty_unalias (&set->aliases, prog->name, prog->namelen);
+		set->current = NULL;
+		if (set->previous == prog) {
+			set->previous = NULL;
+		}
+		flow->endprog = prog;
+	}
+	//
+	// Input continues for the current program, or its parent
+	flow->curset = set;
+	flow->curprog = (set->current != NULL) ? set->current : set->parent;
 	flow->rdend++;
 	return true;
 }
 
-#endif
-
 
 /* Register a callback function with arbitrary userdata
  * pointer, to be invoked when data arrives for the
@@ -513,7 +1400,21 @@ static bool _mty_multiplexctl (MULTTY_INFLOW *flow) {
  */
 bool mtyregister_ready (MULTTY_INFLOW *flow, char *stream,
 			mtycb_ready *rdy, void *userdata) {
-	MULTTY_INSTREAM *instream = _mty_instream_byname (flow, stream, -1);
+	return mtyregister_progready (flow, &flow->rootprog, stream, rdy, userdata);
+}
+
+
+/* Register a callback function for a named stream of a program
+ * in an inflow, like mtyregister_ready() does for input that is
+ * not for a program.  Each program has its own streams.  The
+ * program must not have ended.
+ *
+ * Return true on success, else false/errno
+ */
+bool mtyregister_progready (MULTTY_INFLOW *flow, MULTTY_INPROG *prog, char *stream,
+			mtycb_ready *rdy, void *userdata) {
+	(void) flow;
+	MULTTY_INSTREAM *instream = _mty_instream_byname (prog, stream, -1);
 	if (instream == NULL) {
 		if (errno == ENOENT) {
 			instream = malloc (sizeof (MULTTY_INSTREAM));
@@ -525,62 +1426,886 @@ bool mtyregister_ready (MULTTY_INFLOW *flow, char *stream,
 			return false;
 		}
 		memset (instream, 0, sizeof (MULTTY_INSTREAM));
-		instream->next = flow->default_stream.next;
 		instream->name = stream;
+		instream->namelen = strlen (stream);
 		instream->shiftctl = c_SO;
-		flow->current_stream =
-		flow->default_stream.next = instream;
+		HASH_ADD_KEYPTR (hh, prog->named_streams, stream, instream->namelen, instream);
+		instream->shard = instream->hh.hashv + 31 * prog->hh.hashv;
+		int slot = _mty_wellknown_slot (stream, instream->namelen);
+		if (slot >= 0) {
+			prog->wellknown [slot] = instream;
+		}
 	}
 	instream->cb_ready = rdy;
 	instream->cb_userdata = userdata;
+	return true;
 }
 
 
-/* Dispatch an input read event by appending to the buffer and
- * distributing as much as possible over programs.
+/* Set whether an inflow accepts aliases for the names of streams
+ * and programs, see mtyoutflow_aliases().
  */
-void multty_vin_dispatch (MULTTY_INFLOW *flow) {
+void mtyinflow_aliases (MULTTY_INFLOW *flow, bool aliases) {
+	flow->aliases = aliases;
+}
+
+
+/* Register a callback function for programs that start and end
+ * in the input of an inflow, or NULL to stop it.
+ */
+void mtyregister_programs (MULTTY_INFLOW *flow,
+			mtycb_inprog *cb, void *userdata) {
+	flow->cb_inprog = cb;
+	flow->cb_inprogdata = userdata;
+}
+
+
+/* Return the program that input of an inflow is currently for,
+ * or NULL when it is not for a program.
+ */
+MULTTY_INPROG *mtyinflow_program (MULTTY_INFLOW *flow) {
+	return (flow->curprog != &flow->rootprog) ? flow->curprog : NULL;
+}
+
+
+/* Return the name of a program, ending in <US> if it was given
+ * with a description.
+ */
+const char *mtyinprog_name (MULTTY_INPROG *prog) {
+	return prog->name;
+}
+
+
+/* Return the last description given for a program, or NULL.
+ */
+const char *mtyinprog_descr (MULTTY_INPROG *prog) {
+	return prog->descr;
+}
+
+
+/* Return the parent of a program, or NULL at the top level.
+ */
+MULTTY_INPROG *mtyinprog_parent (MULTTY_INPROG *prog) {
+	MULTTY_INPROG *parent = prog->set->parent;
+	return (parent->set != NULL) ? parent : NULL;
+}
+
+
+/* Register a callback function for batched dispatch of the
+ * input for an inflow, or NULL to return to the callbacks
+ * for each stream.  The userdata is passed to every call.
+ */
+void mtyregister_batch (MULTTY_INFLOW *flow,
+			mtycb_batch *batch, void *userdata) {
+	flow->cb_batch = batch;
+	flow->cb_batchdata = userdata;
+}
+
+
+/* Register an escape style for a stream at an inflow, so its
+ * input is unescaped while it is parsed.  The unescaped bytes
+ * go into opt_buf, or into a buffer of the input buffer size
+ * when it is NULL.  Use MULTTY_ESC_MULTTY to stop unescaping.
+ * This should not be called from a callback for the stream.
+ *
+ * Return true on success, else false/errno
+ */
+bool mtyregister_unescape (MULTTY_INFLOW *flow, char *stream,
+			uint32_t escstyle, uint8_t *opt_buf, int buflen) {
+	return mtyregister_progunescape (flow, &flow->rootprog, stream,
+			escstyle, opt_buf, buflen);
+}
+
+
+/* Register an escape style for a named stream of a program in an
+ * inflow, like mtyregister_unescape() does for input that is not
+ * for a program.  The stream must have been registered with
+ * mtyregister_progready() first.
+ *
+ * Return true on success, else false/errno
+ */
+bool mtyregister_progunescape (MULTTY_INFLOW *flow, MULTTY_INPROG *prog, char *stream,
+			uint32_t escstyle, uint8_t *opt_buf, int buflen) {
+	MULTTY_INSTREAM *instream = _mty_instream_byname (prog, stream, -1);
+	if (instream == NULL) {
+		return false;
+	}
+	if ((opt_buf != NULL) && (buflen <= 0)) {
+		errno = EINVAL;
+		return false;
+	}
 	//
-	// Try to read more.  May silently fail if non-blocking.
-	if (!_mty_readmore (flow)) {
-		return;
+	// Setup the style first, it may be new to the library
+	const bool *unesc = NULL;
+	if (escstyle != MULTTY_ESC_MULTTY) {
+		unesc = mtyescape_register (escstyle | (1 << c_DLE));
+		if (unesc == NULL) {
+			return false;
+		}
 	}
 	//
-	// Require at least enough to decide on <SOH> presence/absence.
-again:
-	if (!_mty_getname (flow)) {
+	// Replace the buffer, if any
+	uint8_t *newbuf = opt_buf;
+	if ((unesc != NULL) && (opt_buf == NULL)) {
+		buflen = flow->bufsize;
+		newbuf = malloc (buflen);
+		if (newbuf == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+	}
+	if (instream->unbuf_own) {
+		free (instream->unbuf);
+	}
+	instream->unesc = unesc;
+	instream->unbuf = newbuf;
+	instream->unbufsize = (unesc != NULL) ? buflen : 0;
+	instream->unbuf_own = (unesc != NULL) && (opt_buf == NULL);
+	instream->unstart =
+	instream->unfill = 0;
+	//
+	// Text that was paused continues in the new style
+	if (flow->textstream == instream) {
+		flow->unstream = (unesc != NULL) ? instream : NULL;
+		flow->unofs = flow->postnm;
+	}
+	return true;
+}
+
+
+/* Register a stream at an inflow for reading with mtyread(),
+ * rather than with callbacks.  Its input is held in a queue,
+ * without or with escapes depending on mtyregister_unescape().
+ * When the queue reaches highwater bytes, the inflow stops
+ * reading until mtyread() drains it to half.  With a pressure
+ * callback, the queue reports this at highwater and the inflow
+ * stops at twice that.  Use 0 for MULTTY_INQUEUE_HIGH.
+ *
+ * The stream is added if it was not registered yet.  Calling
+ * this again changes the settings.
+ *
+ * Returns the handle for mtyread() on success, else NULL/errno
+ */
+MULTTY *mtyregister_queue (MULTTY_INFLOW *flow, char *stream, size_t highwater,
+			mtycb_pressure *opt_pressure, void *userdata) {
+	return mtyregister_progqueue (flow, &flow->rootprog, stream,
+			highwater, opt_pressure, userdata);
+}
+
+
+/* Register a named stream of a program in an inflow for reading
+ * with mtyread(), like mtyregister_queue() does for input that
+ * is not for a program.  The program must not have ended.
+ *
+ * Returns the handle for mtyread() on success, else NULL/errno
+ */
+MULTTY *mtyregister_progqueue (MULTTY_INFLOW *flow, MULTTY_INPROG *prog, char *stream,
+			size_t highwater, mtycb_pressure *opt_pressure, void *userdata) {
+	if (highwater == 0) {
+		highwater = MULTTY_INQUEUE_HIGH;
+	}
+	if (highwater > INT_MAX / 4) {
+		errno = EINVAL;
+		return NULL;
+	}
+	MULTTY_INSTREAM *instream = _mty_instream_byname (prog, stream, -1);
+	if (instream == NULL) {
+		if ((errno != ENOENT) || !mtyregister_progready (flow, prog, stream, NULL, NULL)) {
+			return NULL;
+		}
+		instream = _mty_instream_byname (prog, stream, -1);
+	}
+	if (!instream->queued) {
+		memset (&instream->input, 0, sizeof (MULTTY));
+		instream->flow = flow;
+		instream->queued = true;
+	}
+	instream->qhigh = highwater;
+	instream->cb_pressure = opt_pressure;
+	instream->cb_pressuredata = userdata;
+	_mty_qpressure (flow, instream);
+	return &instream->input;
+}
+
+
+/* Invoke the callback of a stream for a work item, in a worker.
+ * When the stream has an escape style, the input is unescaped
+ * here, so this is also spread over the workers.
+ */
+static void _mty_workcb (struct multty_workitem *item) {
+	MULTTY_INSTREAM *mis = item->mis;
+	char *name = (item->namelen >= 0) ? mis->name : NULL;
+	uint8_t *ptr = (uint8_t *) (item + 1);
+	int len = item->len;
+	if (mis->unesc == NULL) {
+		mis->input.buf     = ptr;
+		mis->input.bufsize =
+		mis->input.fill    = len;
+		mis->input.rdofs   = 0;
+		mis->cb_ready (&mis->input, mis->cb_userdata, name, item->namelen, item->control);
 		return;
 	}
 	//
-	// Now we can have one of three things, or an error.
-	//  - application byte string
-	//  - stream operations
-	//  - program multiplexing
+	// Unescape in parts that fit the buffer of the stream
+	int i = 0;
+	while (i < len) {
+		int out = 0;
+		while ((i < len) && (out < mis->unbufsize)) {
+			if (mis->wk_dle) {
+				uint8_t c = ptr [i++] ^ 0x40;
+				mis->wk_dle = false;
+				if (mis->unesc [c]) {
+					mis->unbuf [out++] = c;
+				} else {
+					syslog (LOG_ERR, "Bad escaped character 0x%02x in mulTTY input\n", c);
+				}
+				continue;
+			}
+			int run = len - i;
+			if (run > mis->unbufsize - out) {
+				run = mis->unbufsize - out;
+			}
+			const uint8_t *dle = memchr (ptr + i, c_DLE, run);
+			int clean = (dle != NULL) ? (dle - (ptr + i)) : run;
+			memcpy (mis->unbuf + out, ptr + i, clean);
+			out += clean;
+			i   += clean;
+			if (dle != NULL) {
+				mis->wk_dle = true;
+				i++;
+			}
+		}
+		if (out > 0) {
+			mis->input.buf     = mis->unbuf;
+			mis->input.bufsize =
+			mis->input.fill    = out;
+			mis->input.rdofs   = 0;
+			mis->cb_ready (&mis->input, mis->cb_userdata, name, item->namelen, item->control);
+		}
+	}
+}
+
+
+/* The main loop of a worker thread.
+ */
+static void *_mty_worker (void *arg) {
+	struct multty_worker *wk = arg;
+	while (true) {
+		unsigned itemlen;
+		struct multty_workitem *item = _mty_spsc_peek (&wk->ring, &itemlen);
+		MULTTY_INSTREAM *mis = item->mis;
+		switch (item->op) {
+		case MTY_WK_TEXT:
+			_mty_workcb (item);
+			break;
+		case MTY_WK_FREE:
+			_mty_instream_free (mis, false);
+			break;
+		case MTY_WK_STOP:
+			_mty_spsc_release (&wk->ring, itemlen);
+			return NULL;
+		}
+		_mty_spsc_release (&wk->ring, itemlen);
+	}
+}
+
+
+/* Run the callbacks for the streams of an inflow on a number of
+ * worker threads, so they may use more than one core.  The input
+ * is still read and parsed by the calling thread, and then passed
+ * over to the worker for its stream.  The input for one stream
+ * always goes to the same worker, so it arrives in order, but the
+ * callbacks for different streams may run at the same time.  When
+ * a stream has an escape style, its worker does the unescaping.
+ *
+ * Batched dispatch and queued streams are not passed to workers.
+ * Registrations should not change while workers run.  Use 0 to
+ * stop the workers, after they did the work passed to them, which
+ * also happens when the inflow is closed.  Any other value first
+ * stops the current workers.
+ *
+ * Returns the number of workers on success, or else -1/errno.
+ */
+int mtyinflow_workers (MULTTY_INFLOW *flow, int numworkers) {
+	if ((numworkers < 0) || (numworkers > MULTTY_WORKERS_MAX)) {
+		errno = EINVAL;
+		return -1;
+	}
+	//
+	// Stop the current workers after the work passed to them
+	int i;
+	for (i = 0; i < flow->numworkers; i++) {
+		struct multty_worker *wk = &flow->workers [i];
+		struct multty_workitem *item = _mty_spsc_reserve (&wk->ring, sizeof (struct multty_workitem));
+		item->mis = NULL;
+		item->op = MTY_WK_STOP;
+		_mty_spsc_commit (&wk->ring, sizeof (struct multty_workitem));
+	}
+	for (i = 0; i < flow->numworkers; i++) {
+		pthread_join (flow->workers [i].thread, NULL);
+		_mty_spsc_fini (&flow->workers [i].ring);
+	}
+	free (flow->workers);
+	flow->workers = NULL;
+	flow->numworkers = 0;
+	//
+	// Start the new workers
+	if (numworkers > 0) {
+		flow->workers = calloc (numworkers, sizeof (struct multty_worker));
+		if (flow->workers == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		for (i = 0; i < numworkers; i++) {
+			struct multty_worker *wk = &flow->workers [i];
+			if (!_mty_spsc_init (&wk->ring, MTY_WORKER_RING)) {
+				break;
+			}
+			int err = pthread_create (&wk->thread, NULL, _mty_worker, wk);
+			if (err != 0) {
+				_mty_spsc_fini (&wk->ring);
+				errno = err;
+				break;
+			}
+			flow->numworkers++;
+		}
+		if (flow->numworkers < numworkers) {
+			int err = errno;
+			mtyinflow_workers (flow, 0);
+			errno = err;
+			return -1;
+		}
+	}
+	//
+	// Text that was paused continues in the new mode
+	MULTTY_INSTREAM *mis = flow->textstream;
+	if ((mis != NULL) && (mis->unesc != NULL) && !_mty_inworker (flow, mis)) {
+		if (flow->unstream == NULL) {
+			flow->unstream = mis;
+			flow->unofs = flow->postnm;
+		}
+	} else {
+		flow->unstream = NULL;
+	}
+	return numworkers;
+}
+
+
+/* End a unit at the given offset, dropping any name, so the
+ * ring can be filled up to there.
+ */
+static void _mty_endunit (MULTTY_INFLOW *flow, unsigned ofs) {
+	flow->named = false;
+	flow->has_us = false;
+	flow->drop_name = false;
+	flow->rdofs =
+	flow->rdend =
+	flow->postnm = ofs;
+}
+
+
+/* Deliver application text from postnm up to an offset, if any.
+ */
+static void _mty_text (MULTTY_INFLOW *flow, unsigned ofs) {
+	if (ofs != flow->postnm) {
+		flow->rdend = ofs;
+		_mty_appcb (flow);
+	}
+}
+
+
+/* Process a control code for streams or for programs.  Others
+ * are reported.
+ */
+static void _mty_control (MULTTY_INFLOW *flow, unsigned ofs) {
+	flow->rdend = ofs;
 	if (_mty_streamctl (flow)) {
 		//
 		// We processed a stream control code
 		;
-#ifdef MULTTY_MIXED
 	} else if (_mty_multiplexctl (flow)) {
 		//
 		// We processed a program multiplex control code
-		// (Only when compiled with multiplexing support)
 		;
-#endif
-	} else if (_mty_appstring (flow)) {
-		//
-		// We recognised an applicating byte string to process
-		_mty_appcb (flow);
 	} else {
 		//
-		// Not recognised, complain and skip codes
-		int badlen = _mty_badchar (flow, flow->rdend);
-		_mty_cutback (flow, flow->rdend, badlen);
+		// Not recognised, complain and skip it
+		_mty_badchar (flow, ofs);
+	}
+}
+
+
+/* Drop a name that is too long.  Its stream is not known, so
+ * the text that follows is dropped too, as for a name that is
+ * not registered, until a nameless shift or <EM> returns to the
+ * default stream.
+ */
+static void _mty_namedrop (MULTTY_INFLOW *flow, unsigned ofs) {
+	flow->curprog->current_stream = NULL;
+	_mty_endunit (flow, ofs);
+}
+
+
+/* End a name at its control code, dropping it when it is too long.
+ *
+ * Returns true if the name is kept, or false if it was dropped.
+ */
+static bool _mty_nameend (MULTTY_INFLOW *flow, unsigned ofs) {
+	flow->postnm = ofs;
+	if (!flow->drop_name && (_MTY_UPTO (flow->prenm, ofs) <= flow->nmmax)) {
+		flow->named = true;
+		return true;
+	}
+	if (!flow->drop_name) {
+		syslog (LOG_ERR, "Dropped mulTTY input name over %u bytes\n", flow->nmmax);
+	}
+	_mty_namedrop (flow, ofs);
+	return false;
+}
+
+
+/* Pause the state machine when the input runs out.  Pending
+ * text is delivered, except for a trailing <DLE>.  A name that
+ * grows too long or fills the ring is dropped, so its bytes
+ * need not be held.
+ */
+static void _mty_pause (MULTTY_INFLOW *flow, unsigned pos) {
+	switch (flow->state) {
+	case MTY_IN_NAME:
+	case MTY_IN_DESCR:
+		if (!flow->drop_name && ((_MTY_UPTO (flow->prenm, pos) > flow->nmmax) ||
+				(_MTY_UPTO (flow->rdofs, pos) >= flow->bufsize))) {
+			syslog (LOG_ERR, "Dropped mulTTY input name over %u bytes\n", flow->nmmax);
+			flow->drop_name = true;
+		}
+		if (flow->drop_name) {
+			flow->rdofs = pos;
+		}
+		break;
+	case MTY_IN_NAMED:
+		if (_MTY_UPTO (flow->rdofs, pos) >= flow->bufsize) {
+			syslog (LOG_ERR, "Dropped mulTTY input name over %u bytes\n", flow->nmmax);
+			_mty_namedrop (flow, pos);
+			flow->state = MTY_IN_UNIT;
+		}
+		break;
+	case MTY_IN_TEXT:
+		_mty_text (flow, pos);
+		_mty_endunit (flow, pos);
+		break;
+	case MTY_IN_TEXTDLE:
+		_mty_text (flow, pos - 1);
+		_mty_endunit (flow, pos - 1);
+		break;
+	default:
+		break;
+	}
+	flow->scan = pos;
+}
+
+
+/* INTERNAL ROUTINE to dispatch an input read event by appending
+ * to the buffer and distributing as much as possible over programs.
+ *
+ * The bytes read are fed to the state machine, which continues
+ * where it stopped after the previous read.
+ *
+ * Returns the number of bytes read, 0 at the end of input,
+ * or else -1/errno, which is EAGAIN when non-blocking and
+ * ENOBUFS while queued streams are full.
+ */
+ssize_t _mty_inflow_dispatch (MULTTY_INFLOW *flow) {
+	//
+	// Do not read while queued streams are full
+	if (flow->backlog > 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	//
+	// Try to read more.  May silently fail if non-blocking.
+	ssize_t gotten = _mty_readmore (flow);
+	flow->eof = (gotten == 0);
+	if (gotten <= 0) {
+		return gotten;
+	}
+	//
+	// Resume the state machine where it stopped
+	unsigned pos = flow->scan;
+	switch (flow->state) {
+	case MTY_IN_UNIT:    goto unit;
+	case MTY_IN_NAME:    goto name;
+	case MTY_IN_DESCR:   goto descr;
+	case MTY_IN_NAMED:   goto named;
+	case MTY_IN_TEXT:    goto text;
+	case MTY_IN_TEXTDLE: goto textdle;
+	}
+	//
+	// At the start of a unit
+unit:
+	if (pos == flow->wrofs) {
+		flow->state = MTY_IN_UNIT;
+		goto pause;
+	}
+	switch (_mty_inclass [_MTY_AT (flow, pos)]) {
+	case MTY_CL_SOH:
+		flow->prenm = ++pos;
+		goto name;
+	case MTY_CL_SHIFT:
+	case MTY_CL_EM:
+	case MTY_CL_DCX:
+		_mty_control (flow, pos);
+		_mty_endunit (flow, ++pos);
+		goto unit;
+	case MTY_CL_US:
+	case MTY_CL_BAD:
+		_mty_badchar (flow, pos);
+		_mty_endunit (flow, ++pos);
+		goto unit;
+	case MTY_CL_DLE:
+		_mty_textstart (flow, pos++);
+		goto textdle;
+	default:
+		_mty_textstart (flow, pos++);
+		goto text;
+	}
+	//
+	// In a name after <SOH>
+name:
+	pos = _mty_skiptext (flow, MULTTY_ESC_BINARY, pos);
+	if (pos == flow->wrofs) {
+		flow->state = MTY_IN_NAME;
+		goto pause;
+	}
+	switch (_mty_inclass [_MTY_AT (flow, pos)]) {
+	case MTY_CL_TEXT:
+	case MTY_CL_ESCD:
+		pos++;
+		goto name;
+	case MTY_CL_US:
+		flow->usofs = pos++;
+		flow->has_us = true;
+		goto descr;
+	case MTY_CL_SHIFT:
+	case MTY_CL_EM:
+	case MTY_CL_DCX:
+		goto namectl;
+	default:
+		goto nameend;
+	}
+	//
+	// In a name after <US>
+descr:
+	pos = _mty_skiptext (flow, MULTTY_ESC_MIXED | (1<<c_SO) | (1<<c_SI), pos);
+	if (pos == flow->wrofs) {
+		flow->state = MTY_IN_DESCR;
+		goto pause;
+	}
+	switch (_mty_inclass [_MTY_AT (flow, pos)]) {
+	case MTY_CL_TEXT:
+	case MTY_CL_ESCD:
+	case MTY_CL_CTL:
+		pos++;
+		goto descr;
+	case MTY_CL_SHIFT:
+	case MTY_CL_EM:
+	case MTY_CL_DCX:
+		goto namectl;
+	default:
+		goto nameend;
+	}
+	//
+	// End a name and process its control, or drop both
+namectl:
+	if (_mty_nameend (flow, pos)) {
+		_mty_control (flow, pos);
+	}
+	_mty_endunit (flow, ++pos);
+	goto unit;
+	//
+	// End a name before its control, which may be text
+nameend:
+	if (!_mty_nameend (flow, pos)) {
+		goto unit;
+	}
+	//
+	// At the control after a name
+named:
+	if (pos == flow->wrofs) {
+		flow->state = MTY_IN_NAMED;
+		goto pause;
+	}
+	switch (_mty_inclass [_MTY_AT (flow, pos)]) {
+	case MTY_CL_SOH:
+		syslog (LOG_ERR, "Dropped mulTTY input name without use\n");
+		_mty_endunit (flow, pos);
+		goto unit;
+	case MTY_CL_SHIFT:
+	case MTY_CL_EM:
+	case MTY_CL_DCX:
+		_mty_control (flow, pos);
+		_mty_endunit (flow, ++pos);
+		goto unit;
+	case MTY_CL_US:
+	case MTY_CL_BAD:
+		_mty_badchar (flow, pos);
+		flow->postnm = ++pos;
+		goto named;
+	case MTY_CL_DLE:
+		_mty_textstart (flow, pos++);
+		goto textdle;
+	default:
+		_mty_textstart (flow, pos++);
+		goto text;
+	}
+	//
+	// In application text
+text:
+	pos = _mty_skiptext (flow, MULTTY_ESC_MIXED | (1<<c_SO) | (1<<c_SI), pos);
+	if (flow->unstream != NULL) {
+		_mty_uncopy (flow, pos);
+	}
+	if (pos == flow->wrofs) {
+		flow->state = MTY_IN_TEXT;
+		goto pause;
+	}
+	switch (_mty_inclass [_MTY_AT (flow, pos)]) {
+	case MTY_CL_TEXT:
+	case MTY_CL_ESCD:
+	case MTY_CL_CTL:
+		pos++;
+		goto text;
+	case MTY_CL_DLE:
+		pos++;
+		goto textdle;
+	case MTY_CL_SHIFT:
+	case MTY_CL_EM:
+	case MTY_CL_DCX:
+		_mty_text (flow, pos);
+		_mty_endunit (flow, pos);
+		_mty_control (flow, pos);
+		_mty_endunit (flow, ++pos);
+		goto unit;
+	default:
+		_mty_text (flow, pos);
+		_mty_endunit (flow, pos);
+		goto unit;
+	}
+	//
+	// In application text, after <DLE>
+textdle:
+	if (pos == flow->wrofs) {
+		flow->state = MTY_IN_TEXTDLE;
+		goto pause;
+	}
+	switch (_mty_inclass [_MTY_AT (flow, pos)]) {
+	case MTY_CL_ESCD:
+		if ((flow->unstream == NULL) || _mty_unescd (flow, pos)) {
+			pos++;
+			goto text;
+		}
+		//
+		// The style of the stream would not escape this
+		/* fallthrough */
+	case MTY_CL_TEXT:
+	case MTY_CL_CTL:
+		//
+		// Skip <DLE> with the text byte after it
+		_mty_text (flow, pos - 1);
+		_mty_badchar (flow, pos - 1);
+		_mty_endunit (flow, ++pos);
+		goto unit;
+	default:
+		//
+		// Skip <DLE>, but not the mulTTY code after it
+		_mty_text (flow, pos - 1);
+		_mty_badchar (flow, pos - 1);
+		_mty_endunit (flow, pos);
+		goto unit;
 	}
 	//
-	// We processed a command; cleanup and try another.
-	// This also cleans up the <SOH> name prefix, if any.
-	_mty_reset_inflow (flow);
-	goto again;
+	// Wait for more input
+pause:
+	_mty_pause (flow, pos);
+	//
+	// Deliver the batch collected from this read
+	if (flow->cb_batch != NULL) {
+		_mty_batchcb (flow);
+	}
+	return gotten;
+}
+
+
+/* Dispatch an input read event by appending to the buffer and
+ * distributing as much as possible over programs.
+ */
+void multty_vin_dispatch (MULTTY_INFLOW *flow) {
+	_mty_inflow_dispatch (flow);
 }
 
+
+/* Read input from a stream registered with mtyregister_queue().
+ * When its queue is empty, input is read and dispatched for the
+ * inflow until the stream has some; if the inflow is blocking,
+ * then so is this call.  Other streams receive their input as
+ * usual while this happens.
+ *
+ * Drop-in replacement for read() with FD changed to MULTTY*.
+ * Returns 0 at the end of the stream, marked with <EM>, once for
+ * each end and in its place between the input before and after
+ * it, or at the end of the input.  Returns -1/ENOBUFS when other
+ * queued streams are full, so no input can be read for this stream.
+ */
+ssize_t mtyread (MULTTY *mty, void *buf, size_t len) {
+	MULTTY_INSTREAM *mis = _MTY_QUEUED (mty);
+	MULTTY_INFLOW *flow = mis->flow;
+	while (true) {
+		//
+		// Report an end where it was queued, before later input
+		if ((mis->numqends > 0) && (mis->qends [0] == mis->qout)) {
+			mis->numqends--;
+			memmove (mis->qends, mis->qends + 1, mis->numqends * sizeof (size_t));
+			return 0;
+		}
+		if (mty->rdofs < mty->fill) {
+			break;
+		}
+		if (flow->eof) {
+			return 0;
+		}
+		if (_mty_inflow_dispatch (flow) < 0) {
+			return -1;
+		}
+	}
+	size_t held = mty->fill - mty->rdofs;
+	if ((mis->numqends > 0) && (mis->qends [0] - mis->qout < held)) {
+		held = mis->qends [0] - mis->qout;
+	}
+	if (len > held) {
+		len = held;
+	}
+	memcpy (buf, mty->buf + mty->rdofs, len);
+	mty->rdofs += len;
+	mis->qout  += len;
+	if (mty->rdofs == mty->fill) {
+		mty->rdofs =
+		mty->fill  = 0;
+	}
+	_mty_qpressure (flow, mis);
+	return len;
+}
+
+
+/* Wait until streams registered with mtyregister_queue() can
+ * be read without blocking.  Input is read and dispatched for
+ * their inflows while waiting, for up to timeout_ms, or without
+ * limit when it is negative.  The ready flags tell for each of
+ * the nmty handles whether mtyread() returns immediately.
+ *
+ * Returns the number of handles ready, 0 on timeout, or else
+ * -1/errno, which is ENOBUFS when full queues stop all inflows.
+ */
+int mtypoll (MULTTY **mtys, bool *ready, int nmty, int timeout_ms) {
+	if (nmty <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct timespec start;
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	while (true) {
+		//
+		// Report the handles that have input or reached their end
+		int count = 0;
+		int i;
+		for (i = 0; i < nmty; i++) {
+			MULTTY_INSTREAM *mis = _MTY_QUEUED (mtys [i]);
+			ready [i] = (mtys [i]->fill > mtys [i]->rdofs) || (mis->numqends > 0) || mis->flow->eof;
+			if (ready [i]) {
+				count++;
+			}
+		}
+		if (count > 0) {
+			return count;
+		}
+		//
+		// Collect the inflows that may read, each one once
+		struct pollfd fds [nmty];
+		MULTTY_INFLOW *flows [nmty];
+		int nfds = 0;
+		for (i = 0; i < nmty; i++) {
+			MULTTY_INSTREAM *mis = _MTY_QUEUED (mtys [i]);
+			int j = 0;
+			while ((j < nfds) && (flows [j] != mis->flow)) {
+				j++;
+			}
+			if ((j < nfds) || (mis->flow->backlog > 0)) {
+				continue;
+			}
+			flows [nfds] = mis->flow;
+			fds [nfds].fd = mis->flow->infd;
+			fds [nfds].events = POLLIN;
+			nfds++;
+		}
+		if (nfds == 0) {
+			errno = ENOBUFS;
+			return -1;
+		}
+		//
+		// Wait for the rest of the timeout
+		int wait = timeout_ms;
+		if (wait > 0) {
+			struct timespec now;
+			clock_gettime (CLOCK_MONOTONIC, &now);
+			wait -= (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+			if (wait < 0) {
+				wait = 0;
+			}
+		}
+		int numfds = poll (fds, nfds, wait);
+		if (numfds < 0) {
+			if (errno != EINTR) {
+				return -1;
+			}
+			continue;
+		}
+		if (numfds == 0) {
+			return 0;
+		}
+		//
+		// Dispatch input for the inflows that have it
+		for (i = 0; i < nfds; i++) {
+			if (fds [i].revents == 0) {
+				continue;
+			}
+			if ((_mty_inflow_dispatch (flows [i]) < 0) &&
+					(errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				return -1;
+			}
+		}
+	}
+}
+
+
+/* INTERNAL ROUTINE to get the file descriptor of an inflow.
+ */
+int _mty_inflow_fd (MULTTY_INFLOW *flow) {
+	return flow->infd;
+}
+
+
+/* INTERNAL ROUTINE to test if full queues stop an inflow from
+ * reading, see mtyregister_queue().
+ */
+bool _mty_inflow_backlog (MULTTY_INFLOW *flow) {
+	return (flow->backlog > 0);
+}
+
+
+/* INTERNAL ROUTINE to set a function that is called when an
+ * inflow may read again, after mtyread() drained the queues
+ * that stopped it.  Use NULL to remove it.
+ */
+void _mty_inflow_onresume (MULTTY_INFLOW *flow,
+			void (*resume) (void *resumedata), void *resumedata) {
+	flow->cb_resume = resume;
+	flow->cb_resumedata = resumedata;
+}
@@ -7,9 +7,12 @@
 #include <limits.h>
 
 #include <errno.h>
+#include <poll.h>
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 /* We can use MULTTY_MUTEX_STDOUT to ensure that nobody else
  * tries to write out.  That is sad, but given the low level
@@ -33,14 +36,130 @@ static pthread_mutex_t _multty_stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 
+/* Declare whether this process is the only writer to its output.
+ * This is the case for a socket or pipe that no other process or
+ * thread writes to, and then atomicity against other writers is
+ * moot.  In this mode, many complete units are gathered and sent
+ * with one writev() and short writes are continued instead of
+ * being treated as a broken connection.
+ *
+ * Units are still limited to ATOMIC_SEND_MAX and each returns to
+ * the default stream, so a reader sees the same units as before,
+ * unless output is made sticky with mtyoutflow_sticky().
+ * Only set this when you are sure there are no other writers.
+ */
+void mtyexclusive (bool exclusive) {
+	mtyoutflow_exclusive (MULTTY_OUTFLOW_STDOUT, exclusive);
+}
+
+
+/* Declare whether this process is the only writer to an outflow,
+ * as with mtyexclusive() for MULTTY_OUTFLOW_STDOUT.
+ */
+void mtyoutflow_exclusive (MULTTY_OUTFLOW *flow, bool exclusive) {
+	if (!exclusive) {
+		_mty_sticky_end (flow);
+	}
+	flow->exclusive = exclusive;
+}
+
+
+/* Let the output to an outflow stay in a stream between units.
+ * Every unit normally shifts to its stream with <SOH>name<SO>
+ * and returns to the default stream with <SO>, so it stands on
+ * its own between the units of other writers.  With only one
+ * writer, that is a waste on a burst of units for one stream.
+ * Sticky output only shifts when the stream changes, and it
+ * returns to the default stream before a switch of program and
+ * before output to the default stream or from mtyp_raw().
+ *
+ * This only has effect while the outflow is exclusive, see
+ * mtyoutflow_exclusive(), and not while output is scheduled by
+ * program.  Otherwise, units stand on their own as before.
+ *
+ * Returns true on success, or else false/errno.
+ */
+bool mtyoutflow_sticky (MULTTY_OUTFLOW *flow, bool sticky) {
+	flow->sticky = sticky;
+	return sticky || _mty_sticky_end (flow);
+}
+
+
+/* INTERNAL ROUTINE to return the output of an outflow to the
+ * default stream, when sticky output left it in another stream.
+ * This is done before output that is not for a stream, and when
+ * sticky output stops.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_sticky_end (MULTTY_OUTFLOW *flow) {
+	if (flow->wirestream == NULL) {
+		return true;
+	}
+	flow->wirestream = NULL;
+	struct iovec iov = {
+		.iov_base = s_SO,
+		.iov_len  = 1,
+	};
+	return mtyv_outflow (flow, 1, 1, &iov);
+}
+
+
+/* INTERNAL ROUTINE to write all bytes in an iovec array, for an
+ * output that is owned exclusively.  Short writes are continued,
+ * interrupts retried and a non-blocking output is waited for,
+ * so the data is never cut off halfway a unit.  Writing stops
+ * at the end of the array, even if len promised more.
+ *
+ * Returns true on success, or false/errno.
+ */
+bool _mty_writev_all (int fd, int len, int ioc, const struct iovec *iov) {
+	struct iovec rest [ioc];
+	memcpy (rest, iov, ioc * sizeof (struct iovec));
+	struct iovec *cur = rest;
+	while ((len > 0) && (ioc > 0)) {
+		ssize_t out = writev (fd, cur, ioc);
+		if (out < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+				if ((poll (&pfd, 1, -1) < 0) && (errno != EINTR)) {
+					return false;
+				}
+				continue;
+			}
+			return false;
+		}
+		if (out == 0) {
+			break;
+		}
+		len -= out;
+		//
+		// Skip what was written, possibly halfway an entry
+		while ((ioc > 0) && ((size_t) out >= cur->iov_len)) {
+			out -= cur->iov_len;
+			cur++;
+			ioc--;
+		}
+		if (ioc > 0) {
+			cur->iov_base = ((uint8_t *) cur->iov_base) + out;
+			cur->iov_len -= out;
+		}
+	}
+	return true;
+}
+
+
 /* INTERNAL ROUTINE for sending literaly bytes from an iovec
- * array to stdout.  This is used after composing a complete
+ * array to MULTTY_OUTFLOW_STDOUT.  This is used after composing a complete
  * structure intended to be sent.
  *
  * The primary function here is to send atomically, to
  * avoid one structure getting intertwined with another.
  * This is necessary for security and general correctness.
- * This requirement imposes a PIPE_BUF as maximum for len.
+ * This requirement imposes ATOMIC_SEND_MAX as maximum for len,
+ * which is PIPE_BUF unless mtyatomic_send() detects or sets it.
  *
  * Stream output should be sent such that it returns to
  * the default stream within the atomic unit, which is
@@ -48,22 +167,54 @@ static pthread_mutex_t _multty_stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
  *
  * Returns true on succes, or false/errno.  Specifically
  * note EMSGSIZE, which is returned when the message is
- * too large (the limit is PIPE_BUF).  This might occur
+ * too large (the limit is ATOMIC_SEND_MAX).  This might occur
  * when writing "<SOH>id<US>very_long_description<XXX>"
  * or similar constructs that user input inside an atom.
  * It may then be possible to send "<SOH>id<US><XXX>".
+ *
+ * When the output is owned exclusively, see mtyexclusive(),
+ * the length is not limited and short writes are continued.
+ * When coalescing, see mtycoalesce(), small units may be
+ * queued and sent later, together with other units.
  */
 bool mtyv_out (int len, int ioc, const struct iovec *iov) {
-	if (len > PIPE_BUF) {
+	return mtyv_outflow (MULTTY_OUTFLOW_STDOUT, len, ioc, iov);
+}
+
+
+/* INTERNAL ROUTINE for sending literaly bytes from an iovec
+ * array to an outflow, as mtyv_out() does for stdout.
+ *
+ * Returns true on succes, or false/errno.
+ */
+bool mtyv_outflow (MULTTY_OUTFLOW *flow, int len, int ioc, const struct iovec *iov) {
+	if (_mty_queue_enabled (flow)) {
+		return _mty_queue_out (flow, NULL, len, ioc, iov);
+	}
+	return _mty_vout_direct (flow, len, ioc, iov);
+}
+
+
+/* INTERNAL ROUTINE for sending an iovec array to an outflow as
+ * in mtyv_outflow(), but bypassing the coalescing queue.
+ *
+ * Returns true on succes, or false/errno.
+ */
+bool _mty_vout_direct (MULTTY_OUTFLOW *flow, int len, int ioc, const struct iovec *iov) {
+	if (flow->exclusive) {
+		return _mty_writev_all (flow->outfd, len, ioc, iov);
+	}
+	if (len > _mty_atomic_send (flow)) {
 		errno = EMSGSIZE;
 		return false;
 	}
-	ssize_t out = writev (1, iov, ioc);
+	ssize_t out = writev (flow->outfd, iov, ioc);
 	if (out < 0) {
 		return false;
 	} else if (out != len) {
 		/* Inconsistency! refuse to do anything more */
-		close (1);
+		close (flow->outfd);
+		flow->outfd = -1;
 		errno = ECONNABORTED;
 		return false;
 	} else {
@@ -6,6 +6,8 @@
 
 #include <arpa2/multty.h>
 
+#include "mty-int.h"
+
 
 /* Send binary data to the given mulTTY steam.
  * Since it passes over ASCII, some codes will
@@ -17,23 +19,8 @@
  * Returns buf-bytes written on success, else -1&errno
  */
 ssize_t mtywrite (MULTTY *mty, const void *buf, size_t count) {
-	size_t tgtlen = count;
-	int esclen;
-	const uint8_t *bufbyt = buf;
-	while (tgtlen > 0) {
-		esclen = mtyescape (MULTTY_ESC_BINARY, mty, bufbyt, tgtlen);
-		if (mtyflush (mty) != 0) {
-			if (tgtlen == 0) {
-				/* Error at the start... return error */
-				return -1;
-			} else {
-				/* Error halfway... return how far we got */
-				break;
-			}
-		}
-		bufbyt += esclen;
-		tgtlen -= esclen;
-	}
-	return count - tgtlen;
+	struct iovec iov;
+	iov.iov_base = (void *) buf;
+	iov.iov_len  = count;
+	return _mty_escwritev (MULTTY_ESC_BINARY, mty, &iov, 1);
 }
-
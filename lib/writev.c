@@ -0,0 +1,260 @@
+/* mulTTY -> write data without copying it into the buffer
+ *
+ * Clean runs of data are sent straight from the caller's
+ * memory, with small static <DLE> pairs in between for the
+ * bytes that need escaping.  The stream's <SOH>name<SO>
+ * prefix and the closing <SO> come from the MULTTY handle.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <arpa2/multty.h>
+
+#include "mty-int.h"
+
+
+/* The <DLE> escape for each byte value, generated at compile time.
+ */
+#define _MTY_DLEPAIR4(c) \
+	{ c_DLE, ((c)+0) ^ 0x40 }, { c_DLE, ((c)+1) ^ 0x40 }, \
+	{ c_DLE, ((c)+2) ^ 0x40 }, { c_DLE, ((c)+3) ^ 0x40 }
+#define _MTY_DLEPAIR16(c) \
+	_MTY_DLEPAIR4 ((c)+0x0), _MTY_DLEPAIR4 ((c)+0x4), \
+	_MTY_DLEPAIR4 ((c)+0x8), _MTY_DLEPAIR4 ((c)+0xc)
+static const uint8_t _mty_dlepairs [256] [2] = {
+	_MTY_DLEPAIR16 (0x00), _MTY_DLEPAIR16 (0x10),
+	_MTY_DLEPAIR16 (0x20), _MTY_DLEPAIR16 (0x30),
+	_MTY_DLEPAIR16 (0x40), _MTY_DLEPAIR16 (0x50),
+	_MTY_DLEPAIR16 (0x60), _MTY_DLEPAIR16 (0x70),
+	_MTY_DLEPAIR16 (0x80), _MTY_DLEPAIR16 (0x90),
+	_MTY_DLEPAIR16 (0xa0), _MTY_DLEPAIR16 (0xb0),
+	_MTY_DLEPAIR16 (0xc0), _MTY_DLEPAIR16 (0xd0),
+	_MTY_DLEPAIR16 (0xe0), _MTY_DLEPAIR16 (0xf0),
+};
+
+
+/* INTERNAL ROUTINE to escape data from an iovec array and send
+ * it to a MULTTY stream, without copying it into the buffer.
+ * Any data already in the buffer is flushed first, to keep the
+ * order of the stream intact.
+ *
+ * The output is cut into atomic units of at most ATOMIC_SEND_MAX,
+ * each with the stream's shift prefix and return to the default.
+ * A switch to the stream's program starts the first unit, or
+ * it is left to the queue while scheduling by program.  The
+ * first unit may also bind an alias, see mtyoutflow_aliases().
+ * Sticky output, see mtyoutflow_sticky(), only shifts to the
+ * stream when the output was elsewhere, and stays there.
+ * When the output is owned exclusively, many units are sent
+ * together in one batch.
+ *
+ * Returns the number of bytes consumed from iov on success,
+ * or else -1/errno when nothing could be sent.
+ */
+ssize_t _mty_escwritev (uint32_t style, MULTTY *mty,
+			const struct iovec *iov, int iovcnt) {
+	//
+	// Buffered output is collected in the buffer, see mtysetvbuf()
+	if (mty->vbufmode != _IONBF) {
+		return _mty_vbufwritev (style, mty, iov, iovcnt);
+	}
+	//
+	// Data in the buffer precedes what we are asked to send
+	if (mty->fill > mty->shift) {
+		if (mtyflush (mty) != 0) {
+			return -1;
+		}
+	}
+	//
+	// Iterate over the input, cutting it into batches of units
+	MULTTY_OUTFLOW *flow = _MTY_FLOW (mty->flow);
+	bool sched = (mty->prog != NULL) && _mty_queue_scheduled (flow);
+	bool sticky = _MTY_STICKY (flow);
+	int send_max = _mty_atomic_send (flow);
+	ssize_t done = 0;
+	char head [MULTTY_ALIAS_HEAD];
+	int headlen = 0;
+	int i = 0;
+	size_t ofs = 0;
+	while ((i < iovcnt) && (ofs >= iov [i].iov_len)) {
+		i++;
+	}
+	while (i < iovcnt) {
+		struct iovec out [MULTTY_BATCH_IOVS];
+		int outc = 0;
+		int outlen = 0;
+		ssize_t batchdone = 0;
+		//
+		// If this stream is assigned to a program, switch to it
+		// at the start of the first unit, and commit after sending
+		int switchlen = 0;
+		bool switched = true;
+		if ((mty->prog != NULL) && !sched) {
+			struct iovec sw [MULTTY_SWITCH_IOVS];
+			int swc = mtyp_switch_iov (flow, mty->prog, sw);
+			if (swc < 0) {
+				return (done > 0) ? done : -1;
+			}
+			//
+			// Sticky output returns to the default stream first
+			if (sticky && (swc > 0) && (flow->wirestream != NULL)) {
+				out [outc].iov_base = s_SO;
+				out [outc].iov_len  = 1;
+				outc++;
+				switchlen++;
+				flow->wirestream = NULL;
+			}
+			int j;
+			for (j = 0; j < swc; j++) {
+				out [outc++] = sw [j];
+				switchlen += sw [j].iov_len;
+			}
+			//
+			// A switch that leaves no room for data is sent before it
+			switched = false;
+			if ((outc > 0) && !flow->exclusive &&
+					(switchlen + mty->shift + 3 > send_max)) {
+				if (!mtyv_outflow (flow, switchlen, outc, out)) {
+					return (done > 0) ? done : -1;
+				}
+				mtyp_switch_commit (flow, mty->prog);
+				switched = true;
+				outc = 0;
+				switchlen = 0;
+			}
+		}
+		if (sticky && (mty->shift == 0) && (flow->wirestream != NULL)) {
+			out [outc].iov_base = s_SO;
+			out [outc].iov_len  = 1;
+			outc++;
+			switchlen++;
+			flow->wirestream = NULL;
+		}
+		bool onwire = sticky && (flow->wirestream == mty);
+		//
+		// The first unit of a stream may bind an alias for its name
+		bool bind = false;
+		if ((done == 0) && !onwire) {
+			headlen = _mty_alias_head (mty, flow, switchlen + mty->shift + 3, head);
+			bind = (headlen > 0);
+		}
+		do {
+			int unitend = outc + MULTTY_UNIT_IOVS - 3;
+			int unitlen = switchlen;
+			switchlen = 0;
+			//
+			// Start with the <SOH>name<SO> prefix for the stream,
+			// or with the head that binds an alias for it
+			if (bind) {
+				out [outc].iov_base = head;
+				out [outc].iov_len  = headlen;
+				outc++;
+				out [outc].iov_base = mty->prefix + 1;
+				out [outc].iov_len  = mty->shift - 1;
+				outc++;
+				unitlen += headlen - 1 + mty->shift;
+				bind = false;
+			} else if ((mty->shift > 0) && !onwire) {
+				out [outc].iov_base = (mty->buf != NULL) ? mty->buf : mty->prefix;
+				out [outc].iov_len  = mty->shift;
+				outc++;
+				unitlen += mty->shift;
+			}
+			int room = send_max - unitlen - ((mty->shift > 0) ? 1 : 0);
+			//
+			// Add clean runs and <DLE> pairs while they fit
+			while ((room > 0) && (i < iovcnt) && (outc < unitend)) {
+				const uint8_t *ptr = ((const uint8_t *) iov [i].iov_base) + ofs;
+				size_t run = iov [i].iov_len - ofs;
+				if (run > (size_t) room) {
+					run = room;
+				}
+				size_t clean = _mty_escscan (style, ptr, run);
+				if (clean > 0) {
+					out [outc].iov_base = (void *) ptr;
+					out [outc].iov_len  = clean;
+					outc++;
+					unitlen   += clean;
+					room      -= clean;
+					batchdone += clean;
+					ofs       += clean;
+				}
+				if (clean == run) {
+					//
+					// Move to the next input buffer, or end the unit
+					if (ofs < iov [i].iov_len) {
+						break;
+					}
+					do {
+						i++;
+						ofs = 0;
+					} while ((i < iovcnt) && (iov [i].iov_len == 0));
+					continue;
+				}
+				//
+				// The next byte needs escaping, which takes two bytes
+				if (room < 2) {
+					break;
+				}
+				out [outc].iov_base = (void *) _mty_dlepairs [ptr [clean]];
+				out [outc].iov_len  = 2;
+				outc++;
+				unitlen   += 2;
+				room      -= 2;
+				batchdone += 1;
+				ofs       += 1;
+				while ((i < iovcnt) && (ofs >= iov [i].iov_len)) {
+					i++;
+					ofs = 0;
+				}
+			}
+			//
+			// Return to the default stream within the same unit,
+			// or let sticky output stay in the stream
+			onwire = sticky;
+			if ((mty->shift > 0) && !sticky) {
+				out [outc].iov_base = s_SO;
+				out [outc].iov_len  = 1;
+				outc++;
+				unitlen++;
+			}
+			outlen += unitlen;
+		} while (flow->exclusive && (i < iovcnt) &&
+				(outc + MULTTY_UNIT_IOVS <= MULTTY_BATCH_IOVS));
+		//
+		// Send the batch; report partial success as such
+		bool ok = sched
+			? _mty_queue_out (flow, mty->prog, outlen, outc, out)
+			: mtyv_outflow (flow, outlen, outc, out);
+		if (!ok) {
+			return (done > 0) ? done : -1;
+		}
+		if (!switched) {
+			mtyp_switch_commit (flow, mty->prog);
+		}
+		if (sticky && (mty->shift > 0)) {
+			flow->wirestream = mty;
+		}
+		if ((headlen > 0) && (done == 0)) {
+			_mty_alias_commit (mty, head, headlen);
+		}
+		done += batchdone;
+	}
+	return done;
+}
+
+
+/* Send binary data from an iovec array to the given mulTTY stream,
+ * without copying it into the MULTTY buffer.  Clean runs are
+ * sent straight from the caller's memory, and bytes that need
+ * escaping are sent as <DLE> pairs from a static table.  The
+ * atomic units sent are limited to ATOMIC_SEND_MAX, and each
+ * returns to the default stream.
+ *
+ * Drop-in replacement for writev() with FD changed to MULTTY*.
+ * Returns buf-bytes written on success, else -1&errno
+ */
+ssize_t mtywritev (MULTTY *mty, const struct iovec *iov, int iovcnt) {
+	return _mty_escwritev (MULTTY_ESC_BINARY, mty, iov, iovcnt);
+}
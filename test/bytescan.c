@@ -0,0 +1,223 @@
+/* mulTTY -> compare the byte scanning kernels, and time them
+ *
+ * The kernels in lib/bytescan.c are static, so this includes
+ * that file to reach them.  Every vectorised kernel that this
+ * CPU supports is compared with the plain C kernel, over random
+ * buffers at unaligned offsets, with lengths around the vector
+ * sizes.  Any difference is reported and fails the test.
+ *
+ * With the argument "bench", the kernels are also timed over
+ * clean text, and the cost is reported in cycles per byte.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../lib/bytescan.c"
+
+
+/* The kernels are compared over this many random buffers.
+ */
+#define ROUNDS 20000
+
+/* Buffers are at most this long, well beyond 64-byte strides.
+ */
+#define MAXLEN 300
+
+/* Benchmarks scan a buffer of this size, many times over.
+ */
+#define BENCHLEN 65536
+#define BENCHRUNS 2000
+
+
+typedef size_t escscan_t   (uint32_t style, const uint8_t *ptr, size_t len);
+typedef size_t ctlscan_t   (uint32_t ctlset, const uint8_t *ptr, size_t len);
+typedef size_t inputscan_t (const uint8_t *ptr, size_t len, size_t *dles);
+
+
+struct kernels {
+	const char *name;
+	escscan_t *escscan;
+	ctlscan_t *ctlscan;
+	inputscan_t *inputscan;
+};
+
+
+static int errors = 0;
+
+
+/* Fill a buffer with mostly printable text and a sprinkling of
+ * control codes, <DEL> and 0xff, as the scanners stop at those.
+ */
+static void randomfill (uint8_t *buf, size_t len) {
+	static const uint8_t special [] = {
+		0x00, 0x01, 0x08, 0x09, 0x0a, 0x0d, 0x0e, 0x0f,
+		0x10, 0x11, 0x14, 0x19, 0x1b, 0x1f, 0x7f, 0x80, 0xff
+	};
+	int rarity = 1 + (rand () % 64);
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if ((rand () % rarity) == 0) {
+			buf [i] = special [rand () % sizeof (special)];
+		} else {
+			buf [i] = 0x20 + (rand () % 0x60);
+		}
+	}
+}
+
+
+/* Pick an escape style: a built-in one, or a random mask.
+ */
+static uint32_t randomstyle (void) {
+	switch (rand () % 6) {
+	case 0:
+		return MULTTY_ESC_MULTTY;
+	case 1:
+		return MULTTY_ESC_BINARY;
+	case 2:
+		return MULTTY_ESC_ASCII;
+	case 3:
+		return MULTTY_ESC_MIXED;
+	default:
+		return (((uint32_t) rand ()) << 16) ^ ((uint32_t) rand ());
+	}
+}
+
+
+/* Compare one set of kernels with the plain C kernels.
+ */
+static void compare (const struct kernels *k, const uint8_t *buf, size_t len,
+			uint32_t style, uint32_t ctlset) {
+	size_t want = _mty_escscan_scalar (style, buf, len);
+	size_t got  = k->escscan (style, buf, len);
+	if (got != want) {
+		fprintf (stderr, "escscan_%s: style 0x%08x, len %zu: %zu instead of %zu\n",
+				k->name, style, len, got, want);
+		errors++;
+	}
+	want = _mty_ctlscan_scalar (ctlset, buf, len);
+	got  = k->ctlscan (ctlset, buf, len);
+	if (got != want) {
+		fprintf (stderr, "ctlscan_%s: ctlset 0x%08x, len %zu: %zu instead of %zu\n",
+				k->name, ctlset, len, got, want);
+		errors++;
+	}
+	size_t wantdles = 7;
+	size_t gotdles  = 7;
+	want = _mty_inputscan_scalar (buf, len, &wantdles);
+	got  = k->inputscan (buf, len, &gotdles);
+	if ((got != want) || (gotdles != wantdles)) {
+		fprintf (stderr, "inputscan_%s: len %zu: %zu/%zu instead of %zu/%zu\n",
+				k->name, len, got, gotdles, want, wantdles);
+		errors++;
+	}
+}
+
+
+#ifdef MULTTY_SIMD_X86
+
+/* Time one kernel set over clean text, and report cycles per byte.
+ * Clean text is the common case, where the kernels run to the end.
+ */
+static void bench (const struct kernels *k, const uint8_t *buf) {
+	volatile size_t sink = 0;
+	size_t dles = 0;
+	int run;
+	uint64_t t0 = __rdtsc ();
+	for (run = 0; run < BENCHRUNS; run++) {
+		sink += k->escscan (MULTTY_ESC_MIXED, buf, BENCHLEN);
+	}
+	uint64_t t1 = __rdtsc ();
+	for (run = 0; run < BENCHRUNS; run++) {
+		sink += k->ctlscan ((1 << c_SOH) | (1 << c_SO) | (1 << c_SI), buf, BENCHLEN);
+	}
+	uint64_t t2 = __rdtsc ();
+	for (run = 0; run < BENCHRUNS; run++) {
+		sink += k->inputscan (buf, BENCHLEN, &dles);
+	}
+	uint64_t t3 = __rdtsc ();
+	double bytes = (double) BENCHLEN * BENCHRUNS;
+	printf ("%-7s escscan %6.3f  ctlscan %6.3f  inputscan %6.3f  cycles/byte\n",
+			k->name,
+			(t1 - t0) / bytes, (t2 - t1) / bytes, (t3 - t2) / bytes);
+	(void) sink;
+}
+
+#endif /* MULTTY_SIMD_X86 */
+
+
+int main (int argc, char *argv []) {
+	bool benchmark = (argc > 1) && (strcmp (argv [1], "bench") == 0);
+	struct kernels kernels [3];
+	int numkernels = 0;
+	kernels [numkernels].name      = "scalar";
+	kernels [numkernels].escscan   = _mty_escscan_scalar;
+	kernels [numkernels].ctlscan   = _mty_ctlscan_scalar;
+	kernels [numkernels].inputscan = _mty_inputscan_scalar;
+	numkernels++;
+#ifdef MULTTY_SIMD_X86
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse2") && __builtin_cpu_supports ("popcnt")) {
+		kernels [numkernels].name      = "sse2";
+		kernels [numkernels].escscan   = _mty_escscan_sse2;
+		kernels [numkernels].ctlscan   = _mty_ctlscan_sse2;
+		kernels [numkernels].inputscan = _mty_inputscan_sse2;
+		numkernels++;
+	}
+	if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("popcnt")) {
+		kernels [numkernels].name      = "avx2";
+		kernels [numkernels].escscan   = _mty_escscan_avx2;
+		kernels [numkernels].ctlscan   = _mty_ctlscan_avx2;
+		kernels [numkernels].inputscan = _mty_inputscan_avx2;
+		numkernels++;
+	}
+#endif
+	if (numkernels == 1) {
+		printf ("No vectorised kernels for this CPU, nothing to compare\n");
+	}
+	//
+	// Compare over random buffers, at unaligned offsets
+	static uint8_t buf [MAXLEN + 64];
+	srand (argc > 2 ? atoi (argv [2]) : 1);
+	int round;
+	for (round = 0; round < ROUNDS; round++) {
+		size_t ofs = rand () % 64;
+		size_t len = rand () % (MAXLEN + 1);
+		randomfill (buf, sizeof (buf));
+		uint32_t style  = randomstyle ();
+		uint32_t ctlset = (((uint32_t) rand ()) << 16) ^ ((uint32_t) rand ());
+		int k;
+		for (k = 1; k < numkernels; k++) {
+			compare (&kernels [k], buf + ofs, len, style, ctlset);
+		}
+	}
+	printf ("Compared %d vectorised kernel sets over %d buffers, %d errors\n",
+			numkernels - 1, ROUNDS, errors);
+	//
+	// Time the kernels over clean text
+#ifdef MULTTY_SIMD_X86
+	if (benchmark) {
+		uint8_t *text = malloc (BENCHLEN);
+		if (text == NULL) {
+			perror ("Failed to allocate benchmark text");
+			exit (1);
+		}
+		size_t i;
+		for (i = 0; i < BENCHLEN; i++) {
+			text [i] = ((i % 64) == 63) ? '\n' : 'a' + (i % 26);
+		}
+		int k;
+		for (k = 0; k < numkernels; k++) {
+			bench (&kernels [k], text);
+		}
+		free (text);
+	}
+#else
+	(void) benchmark;
+#endif
+	exit ((errors == 0) ? 0 : 1);
+}
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+#
+# Generate a corpus of mulTTY traffic (for benchmarks).
+# Lines of random words are sent to the "stderr" stream and
+# to the "log" stream with a description, and lines without
+# a name go to the default stream.  Now and then a line holds
+# a control code that is escaped.
+#
+# The output is the same for every run with the same size,
+# so numbers from the inflow benchmark can be compared.  The
+# bytes per stream are printed, as the inflow should find them.
+#
+# From: Rick van Rein <rick@openfortress.nl>
+
+
+import random
+from sys import argv, stdout, stderr, exit
+
+
+if not 2 <= len (argv) <= 3:
+	stderr.write ('Usage: %s corpusfile [megabytes]\n' % argv [0])
+	exit (1)
+
+size = int (argv [2] if len (argv) > 2 else '64') * 1024 * 1024
+
+
+escapable = b'\x01\x0e\x0f\x10\x11\x12\x13\x14\x19\x1c\x1d\x1e\x1f\x00\xff'
+
+words = [ b'hello', b'world', b'the', b'quick', b'brown', b'fox',
+	b'mulTTY', b'stream', b'x' * 30 ]
+
+
+def escape (s):
+	out = bytearray ()
+	for c in s:
+		if c in escapable:
+			out += bytes ([ 0x10, c ^ 0x40 ])
+		else:
+			out.append (c)
+	return bytes (out)
+
+
+random.seed (7)
+corpus = bytearray ()
+streambytes = { 'stderr': 0, 'log': 0, 'default': 0 }
+while len (corpus) < size:
+	line = b' '.join ([ random.choice (words)
+		for _ in range (random.randint (3, 15)) ]) + b'\n'
+	if random.random () < 0.01:
+		line = line [:5] + bytes ([ random.choice (b'\x01\x10\x1f') ]) + line [5:]
+	escline = escape (line)
+	pick = random.random ()
+	if pick < 0.6:
+		corpus += escline
+		stream = 'default'
+	elif pick < 0.8:
+		corpus += b'\x01stderr\x0e' + escline + b'\x0e'
+		stream = 'stderr'
+	else:
+		corpus += b'\x01log\x1fdebug log\x0e' + escline + b'\x0e'
+		stream = 'log'
+	streambytes [stream] += len (line)
+
+open (argv [1], 'wb').write (corpus)
+
+for stream in [ 'stderr', 'log', 'default' ]:
+	stdout.write ('%-8s %12d bytes\n' % (stream, streambytes [stream]))
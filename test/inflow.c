@@ -1,4 +1,14 @@
 /* mulTTY -> apply the inflow parser
+ *
+ * This reads a corpus of mulTTY traffic from a file, such as
+ * made with gencorpus.py, and dispatches it over the "stderr"
+ * and "log" streams, and the default stream.  The callbacks
+ * unescape their input, as an application would.  With the
+ * argument "unescape", the inflow unescapes in the same pass
+ * as it splits, see mtyregister_unescape().
+ *
+ * The bytes and units per stream are reported, along with the
+ * time taken and the speed of parsing.
  *
  * From: Rick van Rein <rick@openfortress.nl>
  */
@@ -6,10 +16,105 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include <arpa2/multty.h>
 
 
+/* Statistics for one stream.
+ */
+struct counter {
+	char *stream;
+	size_t bytes;
+	size_t units;
+};
+
+
+static bool unescaping = false;
+
+
+/* Count the input for a stream.  Escaped input is unescaped
+ * into a local buffer, as an application would do.
+ */
+void count_ready (MULTTY *mty, void *userdata, char *name, int namelen, uint8_t control) {
+	(void) name;
+	(void) namelen;
+	(void) control;
+	struct counter *ctr = userdata;
+	ctr->units++;
+	if (unescaping) {
+		ctr->bytes += mty->fill - mty->rdofs;
+		return;
+	}
+	uint8_t buf [1024];
+	int got;
+	while ((got = mtyunescape (MULTTY_ESC_MIXED, mty, buf, sizeof (buf))) > 0) {
+		ctr->bytes += got;
+	}
+}
+
+
 int main (int argc, char *argv []) {
+	if ((argc < 2) || (argc > 3) ||
+			((argc == 3) && (strcmp (argv [2], "unescape") != 0))) {
+		fprintf (stderr, "Usage: %s corpus [unescape]\n", argv [0]);
+		exit (1);
+	}
+	unescaping = (argc == 3);
+	int fd = open (argv [1], O_RDONLY);
+	struct stat st;
+	if ((fd < 0) || (fstat (fd, &st) != 0)) {
+		perror ("Failed to open corpus");
+		exit (1);
+	}
+	MULTTY_INFLOW *flow = mtyinflow (fd);
+	if (flow == NULL) {
+		perror ("Failed to open inflow");
+		exit (1);
+	}
+	//
+	// Register the streams in the corpus
+	struct counter ctrs [] = {
+		{ "stderr", 0, 0 },
+		{ "log",    0, 0 },
+		{ NULL,     0, 0 },
+	};
+	int numctrs = sizeof (ctrs) / sizeof (ctrs [0]);
+	int i;
+	for (i = 0; i < numctrs; i++) {
+		bool ok = mtyregister_ready (flow, ctrs [i].stream, count_ready, &ctrs [i]);
+		assert (ok);
+		if (unescaping) {
+			ok = mtyregister_unescape (flow, ctrs [i].stream, MULTTY_ESC_MIXED, NULL, 0);
+			assert (ok);
+		}
+	}
+	//
+	// Dispatch until the corpus is read, then once more for the end
+	struct timespec t0, t1;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	while (lseek (fd, 0, SEEK_CUR) < st.st_size) {
+		multty_vin_dispatch (flow);
+	}
+	multty_vin_dispatch (flow);
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	//
+	// Report what was parsed, and how fast
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	for (i = 0; i < numctrs; i++) {
+		printf ("%-8s %12zu bytes %10zu units\n",
+				(ctrs [i].stream != NULL) ? ctrs [i].stream : "default",
+				ctrs [i].bytes, ctrs [i].units);
+	}
+	printf ("Parsed %lld bytes in %.3f s, %.1f MB/s\n",
+			(long long) st.st_size, secs, st.st_size / secs / 1e6);
+	mtyinflow_close (flow);
+	close (fd);
+	exit (0);
 }
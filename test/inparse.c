@@ -0,0 +1,281 @@
+/* mulTTY -> parse a corpus that arrives one byte at a time
+ *
+ * The inflow parser keeps its state between reads, so a unit
+ * may be split anywhere: in a name, between a <DLE> and the
+ * byte that it escapes, or just before a control code.  This
+ * generates a corpus, sends it in packets of one byte, then of
+ * random sizes and then as large as the inflow can receive, and
+ * compares the text of every stream with what the generator
+ * wrote for it.
+ *
+ * The corpus holds names over the maximum, whose text is to be
+ * dropped, and a name right before an <SOH>, which is dropped
+ * without affecting the name that follows.  This is done with
+ * callbacks that unescape, and with mtyregister_unescape().
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <arpa2/multty.h>
+
+#include "../lib/mty-int.h"
+
+
+/* The corpus is about this size.
+ */
+#define CORPUSLEN 100000
+
+/* Names are accepted up to this size; "log" with its description
+ * fits, the long names in the corpus do not.
+ */
+#define NAMEMAX 16
+
+
+static int errors = 0;
+
+
+/* Text for one stream, as written by the generator or as read
+ * back by the inflow.
+ */
+struct text {
+	char *stream;
+	uint8_t *want;
+	size_t wantlen;
+	uint8_t *got;
+	size_t gotlen;
+};
+
+static struct text texts [] = {
+	{ "stderr", NULL, 0, NULL, 0 },
+	{ "log",    NULL, 0, NULL, 0 },
+	{ NULL,     NULL, 0, NULL, 0 },
+};
+
+#define STDERR  (&texts [0])
+#define LOG     (&texts [1])
+#define DEFAULT (&texts [2])
+#define NUMTEXTS (sizeof (texts) / sizeof (texts [0]))
+
+
+static uint8_t corpus [CORPUSLEN + 1024];
+static size_t corpuslen = 0;
+
+static bool unescaping = false;
+
+
+/* Add bytes to the corpus.
+ */
+static void add (const void *data, size_t len) {
+	memcpy (corpus + corpuslen, data, len);
+	corpuslen += len;
+}
+
+
+/* Add a line of random text to the corpus, escaped, and add it to
+ * the text that is expected for a stream, or drop it for NULL.
+ */
+static void addline (struct text *expect) {
+	static const uint8_t special [] = {
+		0x00, 0x01, 0x10, 0x14, 0x19, 0x1f, 0x7f, 0xff, 0x80, '\t'
+	};
+	uint8_t line [80];
+	int len = 1 + (rand () % 60);
+	int i;
+	for (i = 0; i < len; i++) {
+		if ((rand () % 8) == 0) {
+			line [i] = special [rand () % sizeof (special)];
+		} else {
+			line [i] = 'a' + (rand () % 26);
+		}
+	}
+	line [len++] = '\n';
+	for (i = 0; i < len; i++) {
+		if (mtyescapewish (MULTTY_ESC_MIXED, line [i])) {
+			uint8_t esc [2] = { c_DLE, line [i] ^ 0x40 };
+			add (esc, 2);
+		} else {
+			add (line + i, 1);
+		}
+	}
+	if (expect != NULL) {
+		memcpy (expect->want + expect->wantlen, line, len);
+		expect->wantlen += len;
+	}
+}
+
+
+/* Generate the corpus and the text that each stream should get.
+ * Every named unit ends in a nameless <SO>, back to the default.
+ */
+static void generate (void) {
+	while (corpuslen < CORPUSLEN) {
+		int pick = rand () % 100;
+		if (pick < 50) {
+			addline (DEFAULT);
+		} else if (pick < 70) {
+			add ("\x01" "stderr\x0e", 8);
+			addline (STDERR);
+			add ("\x0e", 1);
+		} else if (pick < 85) {
+			add ("\x01" "log\x1f" "debug log\x0e", 15);
+			addline (LOG);
+			add ("\x0e", 1);
+		} else if (pick < 90) {
+			//
+			// A name over the maximum drops its text
+			add ("\x01" "stderr\x1f" "much too long\x0e", 22);
+			addline (NULL);
+			add ("\x0e", 1);
+		} else if (pick < 95) {
+			//
+			// A name that is not registered drops its text
+			add ("\x01" "other\x0e", 7);
+			addline (NULL);
+			add ("\x0e", 1);
+		} else {
+			//
+			// A name without use before <SOH> is dropped
+			add ("\x01" "log\x01" "stderr\x0e", 12);
+			addline (STDERR);
+			add ("\x0e", 1);
+		}
+	}
+}
+
+
+/* Collect the input of a stream, unescaping it unless the inflow
+ * has done so already.
+ */
+static void collect (MULTTY *mty, void *userdata, char *name, int namelen, uint8_t control) {
+	(void) name;
+	(void) namelen;
+	(void) control;
+	struct text *text = userdata;
+	uint8_t *buf = text->got + text->gotlen;
+	size_t space = CORPUSLEN + 1024 - text->gotlen;
+	if (unescaping) {
+		size_t len = mty->fill - mty->rdofs;
+		if (len > space) {
+			len = space;
+		}
+		memcpy (buf, mty->buf + mty->rdofs, len);
+		mty->rdofs += len;
+		text->gotlen += len;
+		return;
+	}
+	int got;
+	while ((got = mtyunescape (MULTTY_ESC_MIXED, mty, buf, space)) > 0) {
+		text->gotlen += got;
+		buf += got;
+		space -= got;
+	}
+}
+
+
+/* Send the corpus in packets of the given size, or of random sizes
+ * for 0, and compare what the streams get with what is expected.
+ * A recv_min other than 0 is set as the ATOMIC_RECV_MIN.
+ */
+static void parse (const char *what, int pktsize, bool unescape, int recv_min) {
+	int sox [2];
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sox) != 0) {
+		perror ("Failed to make a socket pair");
+		exit (1);
+	}
+	pid_t child = fork ();
+	if (child < 0) {
+		perror ("Failed to fork");
+		exit (1);
+	}
+	if (child == 0) {
+		close (sox [0]);
+		size_t ofs = 0;
+		while (ofs < corpuslen) {
+			size_t len = (pktsize > 0) ? pktsize : 1 + (rand () % 300);
+			if (len > corpuslen - ofs) {
+				len = corpuslen - ofs;
+			}
+			if (send (sox [1], corpus + ofs, len, 0) != (ssize_t) len) {
+				perror ("Failed to send corpus");
+				exit (1);
+			}
+			ofs += len;
+		}
+		exit (0);
+	}
+	close (sox [1]);
+	unescaping = unescape;
+	MULTTY_INFLOW *flow = mtyinflow (sox [0]);
+	if ((flow == NULL) || (mtyinflow_namemax (flow, NAMEMAX) != NAMEMAX) ||
+			((recv_min > 0) && (mtyinflow_atomic (flow, recv_min) < 0))) {
+		perror ("Failed to open inflow");
+		exit (1);
+	}
+	unsigned i;
+	for (i = 0; i < NUMTEXTS; i++) {
+		texts [i].gotlen = 0;
+		if (!mtyregister_ready (flow, texts [i].stream, collect, &texts [i]) ||
+				(unescape && !mtyregister_unescape (flow, texts [i].stream,
+						MULTTY_ESC_MIXED, NULL, 0))) {
+			perror ("Failed to register stream");
+			exit (1);
+		}
+	}
+	while (_mty_inflow_dispatch (flow) > 0) {
+		;
+	}
+	mtyinflow_close (flow);
+	close (sox [0]);
+	int status;
+	if ((waitpid (child, &status, 0) != child) || (status != 0)) {
+		fprintf (stderr, "%s: failed to send corpus\n", what);
+		errors++;
+	}
+	for (i = 0; i < NUMTEXTS; i++) {
+		struct text *text = &texts [i];
+		const char *stream = (text->stream != NULL) ? text->stream : "default";
+		if ((text->gotlen != text->wantlen) ||
+				(memcmp (text->got, text->want, text->wantlen) != 0)) {
+			size_t diff = 0;
+			while ((diff < text->gotlen) && (diff < text->wantlen) &&
+					(text->got [diff] == text->want [diff])) {
+				diff++;
+			}
+			fprintf (stderr, "%s: stream %s got %zu bytes instead of %zu, differing from byte %zu\n",
+					what, stream, text->gotlen, text->wantlen, diff);
+			errors++;
+		}
+	}
+}
+
+
+int main (int argc, char *argv []) {
+	srand (argc > 1 ? atoi (argv [1]) : 1);
+	unsigned i;
+	for (i = 0; i < NUMTEXTS; i++) {
+		texts [i].want = malloc (CORPUSLEN + 1024);
+		texts [i].got  = malloc (CORPUSLEN + 1024);
+		if ((texts [i].want == NULL) || (texts [i].got == NULL)) {
+			perror ("Failed to allocate stream text");
+			exit (1);
+		}
+	}
+	generate ();
+	parse ("bytes",             1,    false, 0);
+	parse ("bytes, unescaped",  1,    true,  0);
+	parse ("chunks",            0,    false, 0);
+	parse ("chunks, unescaped", 0,    true,  0);
+	parse ("packets",           4096, false, 4096);
+	printf ("Parsed %zu bytes of corpus, %zu/%zu/%zu for stderr/log/default, %d errors\n",
+			corpuslen, STDERR->wantlen, LOG->wantlen, DEFAULT->wantlen, errors);
+	exit ((errors == 0) ? 0 : 1);
+}
@@ -0,0 +1,208 @@
+/* mulTTY -> program switches in the same unit as stream data
+ *
+ * Streams that are assigned to a program start their output
+ * with a switch to it.  This sends output over a sequential
+ * packet socket, so each unit arrives as one packet, and it
+ * checks that every unit of data starts with the switch that
+ * it needs, through mtyflush() as well as mtywrite().  When
+ * a unit fails to send, its switch is not taken as made.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include <arpa2/multty.h>
+
+#include "../lib/mty-int.h"
+#include "../lib/mtyp-int.h"
+
+
+static int errors = 0;
+
+
+/* Receive the next unit and compare it with what is expected.
+ */
+static void expect (int fd, const char *what, const char *want) {
+	char buf [MULTTY_ATOMIC_MAX];
+	ssize_t got = recv (fd, buf, sizeof (buf), MSG_DONTWAIT);
+	if (got < 0) {
+		got = 0;
+	}
+	if ((got != (ssize_t) strlen (want)) || (memcmp (buf, want, got) != 0)) {
+		fprintf (stderr, "%s: got \"", what);
+		int i;
+		for (i = 0; i < got; i++) {
+			uint8_t ch = buf [i];
+			fprintf (stderr, (ch < 0x20) ? "^%c" : "%c", (ch < 0x20) ? ch + 0x40 : ch);
+		}
+		fprintf (stderr, "\"\n");
+		errors++;
+	}
+}
+
+
+/* Break the socket under a file descriptor, so writes fail, or
+ * restore it from a saved copy.
+ */
+static void breaksocket (int fd, int saved) {
+	if (saved >= 0) {
+		dup2 (saved, fd);
+		return;
+	}
+	int bad [2];
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, bad) != 0) {
+		perror ("Failed to make a socket pair");
+		exit (1);
+	}
+	close (bad [1]);
+	dup2 (bad [0], fd);
+	close (bad [0]);
+}
+
+
+int main (int argc, char *argv []) {
+	(void) argc;
+	(void) argv;
+	int sox [2];
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sox) != 0) {
+		perror ("Failed to make a socket pair");
+		exit (1);
+	}
+	MULTTY_OUTFLOW *flow = mtyoutflow (sox [0]);
+	MULTTY_PROGSET set;
+	memset (&set, 0, sizeof (set));
+	mtyp_bind (&set, flow);
+	MULTTY_PROGID id_alpha, id_beta;
+	mtyp_mkid ("alpha", false, id_alpha);
+	mtyp_mkid ("beta",  false, id_beta);
+	MULTTY_PROG *alpha = mtyp_have (&set, id_alpha, NULL);
+	MULTTY_PROG *beta  = mtyp_have (&set, id_beta,  NULL);
+	MULTTY *ma = mtyoutstream ("out");
+	MULTTY *mb = mtyoutstream ("out");
+	if ((alpha == NULL) || (beta == NULL) || (ma == NULL) || (mb == NULL) ||
+			(mtyoutflow_bind (ma, flow) != 0) || (mtyoutflow_bind (mb, flow) != 0)) {
+		perror ("Failed to setup programs and streams");
+		exit (1);
+	}
+	ma->prog = alpha;
+	mb->prog = beta;
+	//
+	// Buffered output sends the switch with mtyflush()
+	mtysetvbuf (ma, NULL, _IOFBF, 0);
+	mtysetvbuf (mb, NULL, _IOFBF, 0);
+	mtywrite (ma, "A1", 2);
+	mtyflush (ma);
+	expect (sox [1], "flush to alpha", "\x01" "alpha\x14\x01out\x0e" "A1\x0e");
+	mtywrite (mb, "B1", 2);
+	mtyflush (mb);
+	expect (sox [1], "flush to beta", "\x01" "beta\x14\x01out\x0e" "B1\x0e");
+	mtywrite (ma, "A2", 2);
+	mtyflush (ma);
+	expect (sox [1], "flush back to alpha", "\x14\x01out\x0e" "A2\x0e");
+	mtywrite (ma, "A3", 2);
+	mtyflush (ma);
+	expect (sox [1], "flush in alpha", "\x01out\x0e" "A3\x0e");
+	//
+	// Unbuffered output sends the switch with mtywrite()
+	mtysetvbuf (ma, NULL, _IONBF, 0);
+	mtysetvbuf (mb, NULL, _IONBF, 0);
+	mtywrite (mb, "B2", 2);
+	expect (sox [1], "write to beta", "\x01" "beta\x14\x01out\x0e" "B2\x0e");
+	mtywrite (ma, "A4", 2);
+	expect (sox [1], "write back to alpha", "\x14\x01out\x0e" "A4\x0e");
+	mtywrite (ma, "A5", 2);
+	expect (sox [1], "write in alpha", "\x01out\x0e" "A5\x0e");
+	//
+	// A switch that failed to send is made again
+	signal (SIGPIPE, SIG_IGN);
+	int saved = dup (sox [0]);
+	breaksocket (sox [0], -1);
+	if (mtywrite (mb, "B3", 2) >= 0) {
+		fprintf (stderr, "write to broken socket: no failure\n");
+		errors++;
+	}
+	breaksocket (sox [0], saved);
+	mtywrite (mb, "B4", 2);
+	expect (sox [1], "write to beta after failure", "\x01" "beta\x14\x01out\x0e" "B4\x0e");
+	mtysetvbuf (ma, NULL, _IOFBF, 0);
+	mtywrite (ma, "A6", 2);
+	breaksocket (sox [0], -1);
+	if (mtyflush (ma) == 0) {
+		fprintf (stderr, "flush to broken socket: no failure\n");
+		errors++;
+	}
+	breaksocket (sox [0], saved);
+	mtywrite (ma, "A7", 2);
+	mtyflush (ma);
+	expect (sox [1], "flush back to alpha after failure", "\x14\x01out\x0e" "A6A7\x0e");
+	//
+	// Scheduled output makes switches again when they failed to send
+	mtysetvbuf (ma, NULL, _IONBF, 0);
+	if (!mtyoutflow_coalesce (flow, true, 10000000) || !mtyp_schedule (&set, true)) {
+		perror ("Failed to schedule by program");
+		exit (1);
+	}
+	mtywrite (mb, "B5", 2);
+	mtywrite (ma, "A8", 2);
+	breaksocket (sox [0], -1);
+	if (mtyoutflow_sync (flow) == 0) {
+		fprintf (stderr, "sync to broken socket: no failure\n");
+		errors++;
+	}
+	breaksocket (sox [0], saved);
+	mtyoutflow_sync (flow);
+	expect (sox [1], "scheduled after failure",
+		"\x01out\x0e" "A8\x0e\x01" "beta\x14\x01out\x0e" "B5\x0e");
+	expect (sox [1], "nothing more", "");
+	//
+	// An alias for a program is only used once its binding was sent
+	int sox2 [2];
+	if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, sox2) != 0) {
+		perror ("Failed to make a socket pair");
+		exit (1);
+	}
+	MULTTY_OUTFLOW *flow2 = mtyoutflow (sox2 [0]);
+	mtyoutflow_aliases (flow2, true);
+	MULTTY_PROGSET set2;
+	memset (&set2, 0, sizeof (set2));
+	mtyp_bind (&set2, flow2);
+	MULTTY_PROGID id_gamma, id_delta;
+	mtyp_mkid ("gamma", false, id_gamma);
+	mtyp_mkid ("delta", false, id_delta);
+	MULTTY_PROG *gamma = mtyp_have (&set2, id_gamma, NULL);
+	MULTTY_PROG *delta = mtyp_have (&set2, id_delta, NULL);
+	MULTTY *mg = mtyoutstream ("out");
+	if ((gamma == NULL) || (delta == NULL) || (mg == NULL) ||
+			(mtyoutflow_bind (mg, flow2) != 0)) {
+		perror ("Failed to setup aliased programs");
+		exit (1);
+	}
+	mg->prog = gamma;
+	int saved2 = dup (sox2 [0]);
+	breaksocket (sox2 [0], -1);
+	if (mtywrite (mg, "G1", 2) >= 0) {
+		fprintf (stderr, "aliased write to broken socket: no failure\n");
+		errors++;
+	}
+	breaksocket (sox2 [0], saved2);
+	mtywrite (mg, "G2", 2);
+	expect (sox2 [1], "bind alias after failure", "\x01#1=gamma\x14\x01#3=out\x0e" "G2\x0e");
+	mtyp_switch (delta);
+	expect (sox2 [1], "switch to delta", "\x01#4=delta\x14");
+	//
+	// Switching to the current program forgets the previous one
+	mtyp_switch (delta);
+	mtywrite (mg, "G3", 2);
+	expect (sox2 [1], "switch to gamma by alias", "\x01#1\x14\x01#3\x0e" "G3\x0e");
+	expect (sox2 [1], "nothing more on aliases", "");
+	printf ("Program switches checked, %d errors\n", errors);
+	exit ((errors == 0) ? 0 : 1);
+}
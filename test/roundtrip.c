@@ -0,0 +1,281 @@
+/* mulTTY -> write streams and read them back
+ *
+ * Output that the library writes must arrive in the same
+ * streams when the library reads it.  This writes to a pipe
+ * through an outflow, reads it back through an inflow, and
+ * compares the stream of every byte with what was written.
+ * Text without a name is for the default stream, until a
+ * named shift; a nameless shift or <EM> returns to it.  This
+ * is also checked for sticky output, which stays in a stream
+ * between units and returns with a bare <SO>.  The streams
+ * of a program are read with a callback and with mtyread(),
+ * which reports each <EM> in its place between the input.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <arpa2/multty.h>
+
+#include "../lib/mty-int.h"
+#include "../lib/mtyp-int.h"
+
+
+static int errors = 0;
+
+
+/* Input read back, as [stream] labels before the text of each
+ * stream, so a change of stream shows.
+ */
+static char got [4096];
+static int gotlen = 0;
+static const char *gotlabel = NULL;
+
+
+/* Log the input for a stream, labelled by its userdata.
+ */
+static void logtext (MULTTY *mty, void *userdata, char *name, int namelen, uint8_t control) {
+	(void) name;
+	(void) namelen;
+	(void) control;
+	const char *label = userdata;
+	if ((gotlabel == NULL) || (strcmp (gotlabel, label) != 0)) {
+		gotlen += snprintf (got + gotlen, sizeof (got) - gotlen, "[%s]", label);
+		gotlabel = label;
+	}
+	gotlen += mtyunescape (MULTTY_ESC_MIXED, mty,
+			(uint8_t *) got + gotlen, sizeof (got) - 1 - gotlen);
+	got [gotlen] = '\0';
+}
+
+
+/* The "err" stream of a program, read with mtyread().
+ */
+static MULTTY *progerr = NULL;
+
+
+/* Register the "out" stream of programs as they appear, and
+ * queue their "err" stream unescaped.
+ */
+static void newprog (MULTTY_INFLOW *flow, void *userdata,
+			MULTTY_INPROG *prog, bool ended, const char *opt_reason) {
+	(void) userdata;
+	(void) opt_reason;
+	if (!ended) {
+		mtyregister_progready (flow, prog, "out", logtext, "prog1/out");
+		progerr = mtyregister_progqueue (flow, prog, "err", 0, NULL, NULL);
+		if ((progerr == NULL) ||
+				!mtyregister_progunescape (flow, prog, "err", MULTTY_ESC_MIXED, NULL, 0)) {
+			perror ("Failed to queue program stream");
+			exit (1);
+		}
+	}
+}
+
+
+/* Read everything from a pipe through an inflow, and compare the
+ * streams that it arrives in with what is expected.
+ */
+static void readback (const char *what, int fd, const char *want) {
+	MULTTY_INFLOW *flow = mtyinflow (fd);
+	if (flow == NULL) {
+		perror ("Failed to open inflow");
+		exit (1);
+	}
+	//
+	// The default stream is registered before the others, and
+	// "beta" last, so neither should affect where text goes
+	mtyregister_ready (flow, NULL,    logtext, "default");
+	mtyregister_ready (flow, "alpha", logtext, "alpha");
+	mtyregister_ready (flow, "beta",  logtext, "beta");
+	mtyregister_programs (flow, newprog, NULL);
+	gotlen = 0;
+	gotlabel = NULL;
+	got [0] = '\0';
+	while (_mty_inflow_dispatch (flow) > 0) {
+		;
+	}
+	if (progerr != NULL) {
+		char err [100];
+		ssize_t errlen = 0;
+		ssize_t rd;
+		while ((rd = mtyread (progerr, err + errlen, sizeof (err) - 1 - errlen)) > 0) {
+			errlen += rd;
+		}
+		err [errlen] = '\0';
+		if (errlen > 0) {
+			gotlen += snprintf (got + gotlen, sizeof (got) - gotlen, "[prog1/err]%s", err);
+		}
+		progerr = NULL;
+	}
+	if (strcmp (got, want) != 0) {
+		fprintf (stderr, "%s:\n  got  %s\n  want %s\n", what, got, want);
+		errors++;
+	}
+	mtyinflow_close (flow);
+	close (fd);
+}
+
+
+int main (int argc, char *argv []) {
+	(void) argc;
+	(void) argv;
+	int pfd [2];
+	//
+	// Streams written by the library return to the default stream
+	if (pipe (pfd) != 0) {
+		perror ("Failed to make a pipe");
+		exit (1);
+	}
+	MULTTY_OUTFLOW *flow = mtyoutflow (pfd [1]);
+	MULTTY *deflt = mtyoutflow_stdout (flow);
+	MULTTY *alpha = mtyoutstream ("alpha");
+	mtyoutflow_bind (alpha, flow);
+	mtywrite (deflt, "root1 ", 6);
+	mtywrite (alpha, "A1 ", 3);
+	mtywrite (deflt, "root2 ", 6);
+	mtywrite (alpha, "A\0012 ", 4);
+	mtywrite (deflt, "root3", 5);
+	mtyclose (alpha);
+	mtyoutflow_close (flow);
+	close (pfd [1]);
+	readback ("streams", pfd [0],
+		"[default]root1 [alpha]A1 [default]root2 [alpha]A\0012 [default]root3");
+	//
+	// Text before a program switch stays with the root program
+	if (pipe (pfd) != 0) {
+		perror ("Failed to make a pipe");
+		exit (1);
+	}
+	flow = mtyoutflow (pfd [1]);
+	deflt = mtyoutflow_stdout (flow);
+	MULTTY_PROGSET set;
+	memset (&set, 0, sizeof (set));
+	mtyp_bind (&set, flow);
+	MULTTY_PROGID id;
+	mtyp_mkid ("prog1", false, id);
+	MULTTY *out = mtyoutstream ("out");
+	mtyoutflow_bind (out, flow);
+	out->prog = mtyp_have (&set, id, NULL);
+	MULTTY *err = mtyoutstream ("err");
+	mtyoutflow_bind (err, flow);
+	err->prog = out->prog;
+	mtywrite (deflt, "root", 4);
+	mtywrite (out, "P1", 2);
+	mtywrite (err, "E\0011", 3);
+	mtyclose (out);
+	mtyclose (err);
+	mtyoutflow_close (flow);
+	close (pfd [1]);
+	readback ("programs", pfd [0], "[default]root[prog1/out]P1[prog1/err]E\0011");
+	//
+	// Sticky output stays in a stream, until a bare <SO> returns
+	// to the default stream or precedes a switch of program
+	if (pipe (pfd) != 0) {
+		perror ("Failed to make a pipe");
+		exit (1);
+	}
+	flow = mtyoutflow (pfd [1]);
+	mtyoutflow_exclusive (flow, true);
+	if (!mtyoutflow_sticky (flow, true)) {
+		perror ("Failed to make output sticky");
+		exit (1);
+	}
+	deflt = mtyoutflow_stdout (flow);
+	alpha = mtyoutstream ("alpha");
+	mtyoutflow_bind (alpha, flow);
+	MULTTY *beta = mtyoutstream ("beta");
+	mtyoutflow_bind (beta, flow);
+	MULTTY_PROGSET stickyset;
+	memset (&stickyset, 0, sizeof (stickyset));
+	mtyp_bind (&stickyset, flow);
+	out = mtyoutstream ("out");
+	mtyoutflow_bind (out, flow);
+	out->prog = mtyp_have (&stickyset, id, NULL);
+	mtywrite (deflt, "root1 ", 6);
+	mtywrite (alpha, "A1 ", 3);
+	mtywrite (alpha, "A2 ", 3);
+	mtywrite (beta,  "B1 ", 3);
+	mtywrite (deflt, "root2 ", 6);
+	mtysetvbuf (alpha, NULL, _IOFBF, 0);
+	mtywrite (alpha, "A3 ", 3);
+	mtyflush (alpha);
+	mtywrite (alpha, "A4 ", 3);
+	mtyflush (alpha);
+	mtywrite (deflt, "root3 ", 6);
+	mtywrite (alpha, "A5 ", 3);
+	mtyflush (alpha);
+	mtywrite (out, "P1", 2);
+	mtyclose (alpha);
+	mtyclose (beta);
+	mtyclose (out);
+	mtyoutflow_close (flow);
+	close (pfd [1]);
+	readback ("sticky", pfd [0],
+		"[default]root1 [alpha]A1 A2 [beta]B1 [default]root2 [alpha]A3 A4 "
+		"[default]root3 [alpha]A5 [prog1/out]P1");
+	//
+	// Text after <EM> or a nameless shift is for the default stream,
+	// and text for a stream that is not registered is dropped; the
+	// <SI> for "beta" changes its shift but is not passed as text
+	if (pipe (pfd) != 0) {
+		perror ("Failed to make a pipe");
+		exit (1);
+	}
+	static const char ended [] =
+		"\x01" "alpha\x0e" "A1\x19" "root1 "
+		"\x01" "gamma\x0e" "G1\x0e" "root2 "
+		"\x01" "beta\x0f" "B1\x0e" "root3";
+	if (write (pfd [1], ended, sizeof (ended) - 1) != sizeof (ended) - 1) {
+		perror ("Failed to write to pipe");
+		exit (1);
+	}
+	close (pfd [1]);
+	readback ("ends", pfd [0],
+		"[alpha]A1[default]root1 root2 [beta]B1[default]root3");
+	//
+	// A queued stream reports every <EM> in its place between input
+	if (pipe (pfd) != 0) {
+		perror ("Failed to make a pipe");
+		exit (1);
+	}
+	static const char queued [] =
+		"\x01" "q\x0e" "Q1\x19"
+		"\x01" "q\x0e" "Q2\x19"
+		"\x01" "q\x0e" "Q3";
+	if (write (pfd [1], queued, sizeof (queued) - 1) != sizeof (queued) - 1) {
+		perror ("Failed to write to pipe");
+		exit (1);
+	}
+	close (pfd [1]);
+	MULTTY_INFLOW *inflow = mtyinflow (pfd [0]);
+	MULTTY *q = (inflow != NULL) ? mtyregister_queue (inflow, "q", 0, NULL, NULL) : NULL;
+	if (q == NULL) {
+		perror ("Failed to queue a stream");
+		exit (1);
+	}
+	gotlen = 0;
+	int reads;
+	for (reads = 0; reads < 8; reads++) {
+		ssize_t rd = mtyread (q, got + gotlen, sizeof (got) - 1 - gotlen);
+		if (rd < 0) {
+			break;
+		}
+		gotlen += (rd > 0) ? rd : snprintf (got + gotlen, sizeof (got) - gotlen, "|");
+	}
+	got [gotlen] = '\0';
+	if (strcmp (got, "Q1|Q2|Q3|||") != 0) {
+		fprintf (stderr, "queued ends:\n  got  %s\n  want %s\n", got, "Q1|Q2|Q3|||");
+		errors++;
+	}
+	mtyinflow_close (inflow);
+	close (pfd [0]);
+	printf ("Round trips checked, %d errors\n", errors);
+	exit ((errors == 0) ? 0 : 1);
+}